@@ -0,0 +1,82 @@
+/*
+ * Typed wrapper around uthread_chan_t
+ *
+ * Values are copied bytewise into the channel and out of it, so T must be
+ * trivially copyable. Pass pointers to send larger objects without copying
+ * them. select() works on the cases built by sendCase() and recvCase().
+ */
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include "uthread.h"
+#include <type_traits>
+
+template <typename T>
+class Channel {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "channel values are copied bytewise");
+
+  public:
+    /**
+     * Constructor for Channel
+     * @param capacity values buffered before a send blocks, 0 for an
+     *        unbuffered channel
+     */
+    Channel(size_t capacity = 0) {
+      uthread_chan_init(&_chan, sizeof(T), capacity);
+    } // Channel()
+
+    /**
+     * d-tor. No thread may be blocked on the channel
+     */
+    ~Channel() {
+      uthread_chan_destroy(&_chan);
+    } // ~Channel()
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    /**
+     * Send a value, blocking while the channel is full
+     * @return false if the channel is closed
+     */
+    bool send(const T& value) {
+      return uthread_chan_send(&_chan, &value) == 0;
+    } // send()
+
+    /**
+     * Receive a value, blocking while the channel is empty
+     * @return false if the channel is closed and drained
+     */
+    bool recv(T& value) {
+      return uthread_chan_recv(&_chan, &value) == 0;
+    } // recv()
+
+    /**
+     * Close the channel, failing blocked and later sends
+     */
+    void close() {
+      uthread_chan_close(&_chan);
+    } // close()
+
+    /**
+     * Select case sending value, which must outlive the select
+     */
+    uthread_chan_case_t sendCase(const T& value) {
+      uthread_chan_case_t c = {&_chan, UTHREAD_CHAN_SEND, (void*) &value, 0};
+      return c;
+    } // sendCase()
+
+    /**
+     * Select case receiving into value
+     */
+    uthread_chan_case_t recvCase(T& value) {
+      uthread_chan_case_t c = {&_chan, UTHREAD_CHAN_RECV, &value, 0};
+      return c;
+    } // recvCase()
+
+  private:
+    uthread_chan_t _chan;
+};
+
+#endif /* CHANNEL_H */
@@ -0,0 +1,227 @@
+#include "IoPoller.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <iostream>
+
+using namespace std;
+
+IoPoller::IoPoller() {
+  _epoll_fd = -1;
+  _sleep_fd = -1;
+  _wake_fd = -1;
+  _waiting = 0;
+} // IoPoller()
+
+IoPoller::~IoPoller() {
+  if (_epoll_fd != -1)
+    close(_epoll_fd);
+  if (_sleep_fd != -1)
+    close(_sleep_fd);
+  if (_wake_fd != -1)
+    close(_wake_fd);
+} // ~IoPoller()
+
+int IoPoller::init() {
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  _sleep_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epoll_fd == -1 || _sleep_fd == -1) {
+    cerr << "Error - failed to create epoll instance" << endl;
+    return -1;
+  } // if
+  // a sleeping wait wakes when an fd is ready or on an interrupt. Level
+  // triggered, so an interrupt stays pending until a sleeping wait sees it
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = _epoll_fd;
+  if (epoll_ctl(_sleep_fd, EPOLL_CTL_ADD, _epoll_fd, &ev) == -1) {
+    cerr << "Error - failed to nest epoll instance" << endl;
+    return -1;
+  } // if
+  _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ev.data.fd = _wake_fd;
+  if (_wake_fd == -1 || epoll_ctl(_sleep_fd, EPOLL_CTL_ADD, _wake_fd, &ev) == -1) {
+    cerr << "Error - failed to create epoll wakeup fd" << endl;
+    return -1;
+  } // if
+  return 0;
+} // init()
+
+IoPoller::FdState* IoPoller::state(int fd) {
+  if ((size_t) fd >= _fds.size()) {
+    FdState empty = {nullptr, nullptr, false, false, false};
+    _fds.resize(fd + 1 > 2 * (int) _fds.size() ? fd + 1 : 2 * _fds.size(), empty);
+  } // if
+  return &_fds[fd];
+} // state()
+
+int IoPoller::setNonBlocking(int fd) {
+  if (fd < 0) {
+    errno = EBADF;
+    return -1;
+  } // if
+  FdState* fs = state(fd);
+  if (fs->nonblocking)
+    return 0;
+  int flags = fcntl(fd, F_GETFL);
+  if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    return -1;
+  fs->nonblocking = true;
+  return 0;
+} // setNonBlocking()
+
+void IoPoller::markNonBlocking(int fd) {
+  state(fd)->nonblocking = true;
+} // markNonBlocking()
+
+int IoPoller::forget(int fd, TCB* woken[2]) {
+  if (fd < 0 || (size_t) fd >= _fds.size())
+    return 0;
+  FdState* fs = &_fds[fd];
+  if (fs->registered)
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  fs->registered = false;
+  fs->armed = false;
+  fs->nonblocking = false;
+  // no event will come for the waiters any more
+  int n = 0;
+  if (fs->reader != nullptr)
+    woken[n++] = fs->reader;
+  if (fs->writer != nullptr)
+    woken[n++] = fs->writer;
+  fs->reader = fs->writer = nullptr;
+  _waiting -= n;
+  return n;
+} // forget()
+
+int IoPoller::update(int fd, FdState* fs) {
+  unsigned int events = 0;
+  if (fs->reader != nullptr)
+    events |= EPOLLIN | EPOLLRDHUP;
+  if (fs->writer != nullptr)
+    events |= EPOLLOUT;
+  if (events == 0) {
+    // nobody waits any more, stop an armed registration from firing
+    if (fs->armed)
+      epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    fs->registered = fs->armed = false;
+    return 0;
+  } // if
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.fd = fd;
+  int res = -1;
+  if (fs->registered)
+    res = epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+  // the fd may have been closed and reopened behind our back, which drops
+  // it from the epoll set
+  if (res == -1 && (!fs->registered || errno == ENOENT))
+    res = epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  fs->registered = fs->armed = res == 0;
+  return res;
+} // update()
+
+int IoPoller::arm(int fd, unsigned int events, TCB* tcb) {
+  FdState* fs = state(fd);
+  TCB** slot = (events & EPOLLIN) ? &fs->reader : &fs->writer;
+  if (*slot == tcb)
+    return 0;
+  if (*slot != nullptr) {
+    cerr << "Error - another thread is already waiting on fd " << fd << endl;
+    errno = EBUSY;
+    return -1;
+  } // if
+  *slot = tcb;
+  if (update(fd, fs) == -1) {
+    *slot = nullptr;
+    return -1;
+  } // if
+  _waiting++;
+  return 0;
+} // arm()
+
+void IoPoller::disarm(int fd, TCB* tcb) {
+  if (fd < 0 || (size_t) fd >= _fds.size())
+    return;
+  FdState* fs = &_fds[fd];
+  bool changed = false;
+  if (fs->reader == tcb) {
+    fs->reader = nullptr;
+    _waiting--;
+    changed = true;
+  } // if
+  if (fs->writer == tcb) {
+    fs->writer = nullptr;
+    _waiting--;
+    changed = true;
+  } // if
+  if (changed)
+    update(fd, fs);
+} // disarm()
+
+int IoPoller::dispatch(const struct epoll_event* event, TCB* woken[2]) {
+  int fd = event->data.fd;
+  if ((size_t) fd >= _fds.size())
+    return 0;
+  FdState* fs = &_fds[fd];
+  // the oneshot registration is disabled now
+  fs->armed = false;
+  int n = 0;
+  unsigned int errors = EPOLLERR | EPOLLHUP;
+  if (fs->reader != nullptr && (event->events & (EPOLLIN | EPOLLRDHUP | errors))) {
+    woken[n++] = fs->reader;
+    fs->reader = nullptr;
+  } // if
+  if (fs->writer != nullptr && (event->events & (EPOLLOUT | errors))) {
+    woken[n++] = fs->writer;
+    fs->writer = nullptr;
+  } // if
+  _waiting -= n;
+  // re-arm for a waiter the event was not for
+  if (fs->reader != nullptr || fs->writer != nullptr)
+    update(fd, fs);
+  return n;
+} // dispatch()
+
+int IoPoller::wait(struct epoll_event* events, int max_events, long long timeout_ns) {
+  if (timeout_ns == 0) {
+    int n = epoll_wait(_epoll_fd, events, max_events, 0);
+    return n < 0 ? 0 : n;
+  } // if
+  struct epoll_event woke[2];
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ns / 1000000000;
+  timeout.tv_nsec = timeout_ns % 1000000000;
+  // epoll_pwait2 takes a timeout in ns, so timers are not rounded up to ms
+  int n = epoll_pwait2(_sleep_fd, woke, 2, timeout_ns < 0 ? NULL : &timeout, NULL);
+  if (n == -1 && errno == ENOSYS) {
+    int timeout_ms = timeout_ns < 0 ? -1 : (timeout_ns + 999999) / 1000000;
+    n = epoll_wait(_sleep_fd, woke, 2, timeout_ms);
+  } // if
+  bool ready = false;
+  for (int i = 0; i < n; i++) {
+    if (woke[i].data.fd == _wake_fd) {
+      uint64_t count;
+      if (read(_wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        cerr << "Error - failed to read epoll wakeup fd" << endl;
+    } else {
+      ready = true;
+    } // else
+  } // for
+  if (!ready)
+    return 0;
+  n = epoll_wait(_epoll_fd, events, max_events, 0);
+  return n < 0 ? 0 : n;
+} // wait()
+
+void IoPoller::interrupt() {
+  uint64_t one = 1;
+  if (write(_wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    cerr << "Error - failed to write epoll wakeup fd" << endl;
+} // interrupt()
+
+int IoPoller::waiting() const {
+  return _waiting.load(memory_order_relaxed);
+} // waiting()
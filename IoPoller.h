@@ -0,0 +1,125 @@
+/*
+ * File descriptor readiness for blocked threads
+ *
+ * A thread that would block on a non-blocking fd registers itself as the
+ * fd's reader or writer and parks. Registrations are EPOLLONESHOT, so an
+ * event is reported to exactly one poller and the fd stays quiet until a
+ * thread waits on it again. epoll is level triggered: registering an fd that
+ * is already readable or writable reports it right away, so no wakeup is
+ * lost between a read returning EAGAIN and the registration.
+ *
+ * An eventfd lets interrupt() cut a wait short, so a worker sleeping in
+ * wait() can be woken when a thread becomes ready. It sits in a second epoll
+ * set next to the first one, which only a wait that may sleep uses: a wait
+ * that only checks for events never sees the interrupt, so it can neither
+ * take it from a sleeper nor keep finding it.
+ *
+ * Everything but wait() and interrupt() assumes the scheduler lock is held.
+ */
+#ifndef IOPOLLER_H
+#define IOPOLLER_H
+
+#include <sys/epoll.h>
+#include <atomic>
+#include <vector>
+
+class TCB;
+
+class IoPoller {
+  public:
+    /**
+     * Constructor for IoPoller. Call init before use
+     */
+    IoPoller();
+
+    /**
+     * d-tor. Closes the epoll instance
+     */
+    ~IoPoller();
+
+    /**
+     * Create the epoll instance and its wakeup eventfd
+     * @return 0 on success, -1 on failure
+     */
+    int init();
+
+    /**
+     * Put fd in non-blocking mode, the first time it is used only
+     * @return 0 on success, -1 on failure
+     */
+    int setNonBlocking(int fd);
+
+    /**
+     * Record that fd was created non-blocking (e.g. by accept4)
+     */
+    void markNonBlocking(int fd);
+
+    /**
+     * Forget everything about fd, before it is closed. The threads still
+     * waiting on it are taken off their registrations, to be woken
+     * @param woken set to the threads to wake
+     * @return the number of threads in woken, at most 2
+     */
+    int forget(int fd, TCB* woken[2]);
+
+    /**
+     * Register tcb as the thread waiting for fd to become readable (EPOLLIN)
+     * or writable (EPOLLOUT). Registering again for the same event is a no-op
+     * @return 0 on success, -1 on failure (another thread already waits
+     *         for the same event, or epoll refused the fd)
+     */
+    int arm(int fd, unsigned int events, TCB* tcb);
+
+    /**
+     * Drop the registrations of tcb on fd, if it still has any
+     */
+    void disarm(int fd, TCB* tcb);
+
+    /**
+     * Take the threads an event is for off their registrations
+     * @param event an event returned by wait
+     * @param woken set to the threads to wake
+     * @return the number of threads in woken, at most 2
+     */
+    int dispatch(const struct epoll_event* event, TCB* woken[2]);
+
+    /**
+     * Wait for events. Safe without the scheduler lock. Only a wait that
+     * may sleep (timeout_ns not 0) sees and consumes an interrupt
+     * @param timeout_ns longest wait in ns, -1 to wait indefinitely
+     * @return the number of events, 0 on timeout or interruption
+     */
+    int wait(struct epoll_event* events, int max_events, long long timeout_ns);
+
+    /**
+     * Make a wait in progress (or the next one) return right away. Safe
+     * without the scheduler lock and from any kernel thread
+     */
+    void interrupt();
+
+    /**
+     * Number of threads waiting on an fd. Safe without the scheduler lock
+     */
+    int waiting() const;
+
+  private:
+    struct FdState {
+      TCB* reader;
+      TCB* writer;
+      bool registered;        // fd is in the epoll set
+      bool armed;             // registration has not fired yet
+      bool nonblocking;       // O_NONBLOCK was set by us or at creation
+    };
+
+    FdState* state(int fd);
+    // re-register fd for the events its remaining waiters need
+    int update(int fd, FdState* fs);
+
+    int _epoll_fd;                // the fds threads wait on
+    int _sleep_fd;                // _epoll_fd and _wake_fd, for sleeping
+    int _wake_fd;                 // eventfd written by interrupt()
+    std::vector<FdState> _fds;    // indexed by fd
+    std::atomic<int> _waiting;
+};
+
+#endif /* IOPOLLER_H */
@@ -0,0 +1,83 @@
+#include "Profiler.h"
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <map>
+#include <string>
+
+using namespace std;
+
+ProfBuffer::ProfBuffer(long capacity) : _head(0) {
+  long size = 1;
+  while (size < capacity)
+    size <<= 1;
+  _samples = new ProfSample[size];
+  _mask = size - 1;
+} // ProfBuffer()
+
+ProfBuffer::~ProfBuffer() {
+  delete [] _samples;
+} // ~ProfBuffer()
+
+void ProfBuffer::clear() {
+  _head.store(0, memory_order_relaxed);
+} // clear()
+
+string symbolName(void* addr) {
+  Dl_info info;
+  char text[64];
+  if (dladdr(addr, &info) == 0 || info.dli_fname == nullptr) {
+    snprintf(text, sizeof(text), "%p", addr);
+    return text;
+  } // if
+  string name;
+  if (info.dli_sname != nullptr) {
+    int status;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    name = status == 0 ? demangled : info.dli_sname;
+    free(demangled);
+  } else {
+    const char* object = strrchr(info.dli_fname, '/');
+    snprintf(text, sizeof(text), "+0x%lx", (unsigned long) ((char*) addr - (char*) info.dli_fbase));
+    name = string(object != nullptr ? object + 1 : info.dli_fname) + text;
+  } // else
+  return name;
+} // symbolName()
+
+// Name of the frame at pc. A return address is looked up one byte back, as
+// the call may be the last instruction of the function
+static string frameName(void* pc, bool return_address) {
+  string name = symbolName((char*) pc - (return_address ? 1 : 0));
+  // ';' separates the frames of a collapsed stack
+  for (char& c : name) {
+    if (c == ';')
+      c = ':';
+  } // for
+  return name;
+} // frameName()
+
+int ProfBuffer::dump(FILE* out, ProfBuffer* const* buffers, int num_buffers) {
+  map<string, long> stacks;
+  map<pair<void*, bool>, string> names;
+  for (int b = 0; b < num_buffers; b++) {
+    const ProfBuffer* buffer = buffers[b];
+    long head = buffer->_head.load(memory_order_acquire);
+    long first = head > buffer->_mask + 1 ? head - buffer->_mask - 1 : 0;
+    for (long i = first; i < head; i++) {
+      const ProfSample& sample = buffer->_samples[i & buffer->_mask];
+      string stack = sample.tid >= 0 ? "uthread " + to_string(sample.tid) : "idle";
+      for (int f = sample.depth - 1; f >= 0; f--) {
+        pair<void*, bool> key(sample.pcs[f], f > 0);
+        auto it = names.find(key);
+        if (it == names.end())
+          it = names.insert(make_pair(key, frameName(key.first, key.second))).first;
+        stack += ";" + it->second;
+      } // for
+      stacks[stack]++;
+    } // for
+  } // for
+  for (auto& stack : stacks)
+    fprintf(out, "%s %ld\n", stack.first.c_str(), stack.second);
+  return ferror(out) ? -1 : 0;
+} // dump()
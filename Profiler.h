@@ -0,0 +1,87 @@
+/*
+ * Ring buffer of cpu profile samples, for uthread_prof_start/_dump
+ *
+ * Each worker's SIGPROF handler samples the thread it interrupted: its tid
+ * and the return addresses found by following the frame pointers up that
+ * thread's stack. The worker is its buffer's only writer, and the handler
+ * cannot be interrupted by another sample on the same worker, so a sample
+ * is written in place with no lock and no allocation. Once a buffer is full
+ * the oldest samples are overwritten.
+ *
+ * Samples are only read by dump(), which expects sampling to have stopped:
+ * a sample written during a dump may come out torn.
+ */
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+
+// Most frames kept per sample, innermost first
+static const int PROF_MAX_DEPTH = 32;
+
+struct ProfSample {
+  int tid;                  // -1 for a worker's idle thread
+  int depth;
+  void* pcs[PROF_MAX_DEPTH]; // interrupted pc, then return addresses
+};
+
+// Name of the function holding addr: its demangled symbol from the dynamic
+// symbol table, or the object it is in and the offset within it
+std::string symbolName(void* addr);
+
+class ProfBuffer {
+  public:
+    /**
+     * Constructor for ProfBuffer
+     * @param capacity samples kept, rounded up to a power of two
+     */
+    ProfBuffer(long capacity);
+
+    /**
+     * d-tor. Frees the samples
+     */
+    ~ProfBuffer();
+
+    ProfBuffer(const ProfBuffer&) = delete;
+    ProfBuffer& operator=(const ProfBuffer&) = delete;
+
+    /**
+     * The slot of the next sample, to fill and then commit(). The buffer's
+     * single writer only
+     */
+    ProfSample* next() {
+      return &_samples[_head.load(std::memory_order_relaxed) & _mask];
+    } // next()
+
+    /**
+     * Publish the sample filled in next()
+     */
+    void commit() {
+      _head.store(_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    } // commit()
+
+    /**
+     * Drop every sample
+     */
+    void clear();
+
+    /**
+     * Write the buffers' samples in the collapsed stack format of
+     * flamegraph.pl and speedscope: one line per distinct stack, with the
+     * thread ("uthread <tid>" or "idle") as its root frame, then the
+     * functions outermost first, then the number of samples. Functions are
+     * named from the dynamic symbol table (link with -rdynamic), others as
+     * object+offset
+     * @return 0 on success, -1 if writing failed
+     */
+    static int dump(FILE* out, ProfBuffer* const* buffers, int num_buffers);
+
+  private:
+    ProfSample* _samples;
+    long _mask;
+    std::atomic<long> _head;  // samples ever recorded
+};
+
+#endif /* PROFILER_H */
@@ -0,0 +1,194 @@
+#include "StackPool.h"
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <iostream>
+
+using namespace std;
+
+// Resident bytes of cached stacks kept before the coldest are trimmed
+static const size_t STACK_CACHE_WATERMARK = 8 << 20;
+// Cached stacks beyond this many bytes are unmapped instead of kept
+static const size_t STACK_CACHE_LIMIT = 8 * STACK_CACHE_WATERMARK;
+// Number of unguarded stacks mapped at once
+static const size_t SLAB_STACKS = 64;
+
+static size_t pageSize() {
+  static size_t page_size = sysconf(_SC_PAGESIZE);
+  return page_size;
+} // pageSize()
+
+StackPool& StackPool::global() {
+  static StackPool pool(STACK_CACHE_WATERMARK);
+  return pool;
+} // global()
+
+StackPool::StackPool(size_t watermark) {
+  _lock.clear();
+  _watermark = watermark;
+  _guarded.resident = _guarded.cached = 0;
+  _unguarded.resident = _unguarded.cached = 0;
+} // StackPool()
+
+StackPool::~StackPool() {
+  size_t guard = pageSize();
+  for (map<size_t, FreeList>::iterator it = _guarded.free.begin();
+       it != _guarded.free.end(); ++it) {
+    for (size_t i = 0; i < it->second.stacks.size(); i++)
+      munmap(it->second.stacks[i] - guard, it->first + guard);
+  } // for
+  // a slab with a live stack stays, its thread may still be running
+  for (map<char*, Slab>::iterator it = _slabs.begin(); it != _slabs.end(); ++it) {
+    if (it->second.free == SLAB_STACKS)
+      munmap(it->first, it->second.size * SLAB_STACKS);
+  } // for
+} // ~StackPool()
+
+size_t StackPool::roundSize(size_t size) {
+  size_t page = pageSize();
+  if (size == 0)
+    size = page;
+  return (size + page - 1) & ~(page - 1);
+} // roundSize()
+
+void StackPool::lock() {
+  while (_lock.test_and_set(memory_order_acquire))
+    sched_yield();
+} // lock()
+
+void StackPool::unlock() {
+  _lock.clear(memory_order_release);
+} // unlock()
+
+char* StackPool::allocate(size_t size, bool guard) {
+  size = roundSize(size);
+  lock();
+  Cache& cache = guard ? _guarded : _unguarded;
+  FreeList& list = cache.free[size];
+  if (!guard && list.stacks.empty() && !mapSlab(list, size)) {
+    unlock();
+    return nullptr;
+  } // if
+  if (!list.stacks.empty()) {
+    // reuse the most recently released (warmest) stack
+    char* stack = list.stacks.back();
+    list.stacks.pop_back();
+    if (list.trimmed > list.stacks.size())
+      list.trimmed = list.stacks.size();
+    else
+      cache.resident -= size;
+    cache.cached -= size;
+    if (!guard)
+      slabOf(stack)->second.free--;
+    unlock();
+    return stack;
+  } // if
+  unlock();
+  // map a new stack with a guard page below it. Pages are only committed
+  // once they are touched
+  size_t guard_size = pageSize();
+  void* base = mmap(NULL, size + guard_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (base == MAP_FAILED) {
+    cerr << "Error - failed to map thread stack" << endl;
+    return nullptr;
+  } // if
+  if (mprotect(base, guard_size, PROT_NONE) == -1) {
+    cerr << "Error - failed to protect thread stack guard page" << endl;
+    munmap(base, size + guard_size);
+    return nullptr;
+  } // if
+  return (char*) base + guard_size;
+} // allocate()
+
+bool StackPool::mapSlab(FreeList& list, size_t size) {
+  void* base = mmap(NULL, size * SLAB_STACKS, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (base == MAP_FAILED) {
+    cerr << "Error - failed to map thread stacks" << endl;
+    return false;
+  } // if
+  // the new stacks are not resident yet, like trimmed ones
+  for (size_t i = 0; i < SLAB_STACKS; i++)
+    list.stacks.push_back((char*) base + i * size);
+  list.trimmed = SLAB_STACKS;
+  _unguarded.cached += size * SLAB_STACKS;
+  Slab slab = {size, SLAB_STACKS};
+  _slabs[(char*) base] = slab;
+  return true;
+} // mapSlab()
+
+map<char*, StackPool::Slab>::iterator StackPool::slabOf(char* stack) {
+  map<char*, Slab>::iterator it = _slabs.upper_bound(stack);
+  return --it;
+} // slabOf()
+
+void StackPool::unmapSlab(map<char*, Slab>::iterator slab) {
+  char* base = slab->first;
+  size_t size = slab->second.size;
+  char* end = base + size * SLAB_STACKS;
+  FreeList& list = _unguarded.free[size];
+  // take its stacks off the free list, keeping the others in order
+  size_t kept = 0;
+  size_t trimmed = list.trimmed;
+  for (size_t i = 0; i < list.stacks.size(); i++) {
+    char* stack = list.stacks[i];
+    if (stack < base || stack >= end) {
+      list.stacks[kept++] = stack;
+    } else if (i < list.trimmed) {
+      trimmed--;
+    } else {
+      _unguarded.resident -= size;
+    } // else
+  } // for
+  list.stacks.resize(kept);
+  list.trimmed = trimmed;
+  _unguarded.cached -= size * SLAB_STACKS;
+  _slabs.erase(slab);
+  munmap(base, size * SLAB_STACKS);
+} // unmapSlab()
+
+void StackPool::release(char* stack, size_t size, bool guard) {
+  size = roundSize(size);
+  lock();
+  if (!guard) {
+    _unguarded.free[size].stacks.push_back(stack);
+    _unguarded.cached += size;
+    _unguarded.resident += size;
+    map<char*, Slab>::iterator slab = slabOf(stack);
+    if (++slab->second.free == SLAB_STACKS && _unguarded.cached > STACK_CACHE_LIMIT)
+      unmapSlab(slab);
+    if (_unguarded.resident > _watermark)
+      trim(_unguarded);
+    unlock();
+    return;
+  } // if
+  if (_guarded.cached + size > STACK_CACHE_LIMIT) {
+    unlock();
+    munmap(stack - pageSize(), size + pageSize());
+    return;
+  } // if
+  _guarded.free[size].stacks.push_back(stack);
+  _guarded.cached += size;
+  _guarded.resident += size;
+  if (_guarded.resident > _watermark)
+    trim(_guarded);
+  unlock();
+} // release()
+
+void StackPool::trim(Cache& cache) {
+  for (map<size_t, FreeList>::iterator it = cache.free.begin();
+       it != cache.free.end() && cache.resident > _watermark; ++it) {
+    FreeList& list = it->second;
+    while (list.trimmed < list.stacks.size() && cache.resident > _watermark) {
+      // the contents of a cached stack are dead, let the kernel take the pages
+      madvise(list.stacks[list.trimmed], it->first, MADV_FREE);
+      list.trimmed++;
+      cache.resident -= it->first;
+    } // while
+  } // for
+} // trim()
+
+size_t StackPool::residentBytes() const {
+  return _guarded.resident + _unguarded.resident;
+} // residentBytes()
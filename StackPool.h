@@ -0,0 +1,109 @@
+/*
+ * Thread stack allocator
+ *
+ * Stacks are mmap'd with a PROT_NONE guard page below them, so an overflow
+ * faults instead of silently corrupting a neighbouring allocation. Released
+ * stacks are kept on a per-size free list and handed out again (most
+ * recently used first, while they are still warm). Once the cached stacks
+ * exceed the watermark, the coldest ones are trimmed with MADV_FREE: they
+ * stay mapped but the kernel may reclaim their pages.
+ *
+ * Every guarded stack costs two kernel mappings, which caps the number of
+ * live stacks at about vm.max_map_count / 2. Stacks without a guard page are
+ * carved out of slabs of many stacks per mapping instead, for programs with
+ * very many threads. Guarded and unguarded stacks are cached apart, each
+ * against the watermark, and a slab is unmapped once all its stacks are
+ * free and the unguarded cache is over its limit.
+ */
+#ifndef STACKPOOL_H
+#define STACKPOOL_H
+
+#include <stddef.h>
+#include <atomic>
+#include <map>
+#include <vector>
+
+class StackPool {
+  public:
+    /**
+     * The process wide pool used for thread stacks
+     */
+    static StackPool& global();
+
+    /**
+     * Constructor for StackPool
+     * @param watermark bytes of cached stacks of each kind (guarded or
+     *        unguarded) kept resident before trimming
+     */
+    StackPool(size_t watermark);
+
+    /**
+     * d-tor. Unmaps all cached guarded stacks and free slabs
+     */
+    ~StackPool();
+
+    /**
+     * Take a stack from the pool, mapping a new one if none is cached
+     * @param size usable stack size, rounded up to whole pages
+     * @param guard whether the stack gets a guard page
+     * @return lowest usable address of the stack, nullptr on failure
+     */
+    char* allocate(size_t size, bool guard = true);
+
+    /**
+     * Return a stack to the pool
+     * @param stack address returned by allocate
+     * @param size the size passed to allocate
+     * @param guard the guard passed to allocate
+     */
+    void release(char* stack, size_t size, bool guard = true);
+
+    /**
+     * Usable size of a stack allocated with the given requested size
+     */
+    static size_t roundSize(size_t size);
+
+    /**
+     * Number of bytes in cached stacks that have not been trimmed
+     */
+    size_t residentBytes() const;
+
+  private:
+    struct FreeList {
+      std::vector<char*> stacks;  // cached stacks, coldest first
+      size_t trimmed;             // stacks[0, trimmed) were given MADV_FREE
+    };
+
+    // The cached stacks of one kind, guarded or unguarded
+    struct Cache {
+      std::map<size_t, FreeList> free; // keyed by rounded usable size
+      size_t resident;            // bytes in untrimmed cached stacks
+      size_t cached;              // bytes in all cached stacks
+    };
+
+    // A mapping of unguarded stacks of one size
+    struct Slab {
+      size_t size;                // usable size of its stacks
+      size_t free;                // its stacks that are cached
+    };
+
+    void lock();
+    void unlock();
+    // map a slab of unguarded stacks onto an empty free list
+    bool mapSlab(FreeList& list, size_t size);
+    // the slab an unguarded stack was carved from
+    std::map<char*, Slab>::iterator slabOf(char* stack);
+    // drop a slab whose stacks are all cached from the cache, and unmap it
+    void unmapSlab(std::map<char*, Slab>::iterator slab);
+    // trim the coldest stacks of a cache until its resident bytes are under
+    // the watermark
+    void trim(Cache& cache);
+
+    std::atomic_flag _lock;
+    size_t _watermark;
+    Cache _guarded;
+    Cache _unguarded;
+    std::map<char*, Slab> _slabs; // keyed by base address
+};
+
+#endif /* STACKPOOL_H */
@@ -1,37 +1,199 @@
 #include "TCB.h"
+#include "StackPool.h"
+#include <cstring>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// Byte painted over a stack, see getStackHighwater()
+static const unsigned char STACK_PAINT = 0xa5;
 
 /**
- * Constructor for TCB. Allocate a thread stack and setup the thread
- * context to call the stub function
+ * Constructor for TCB. Records how to start the thread: the stack and the
+ * context calling the stub function are set up by prepare() when the thread
+ * is first scheduled
  * @param tid id for the new thread
  * @param f the thread function that get no args and return nothing
        * @param arg the thread function argument
  * @param state current state for the new thread
+ * @param stack_size usable size of the thread's stack in bytes
+ * @param stack_guard whether the stack gets a guard page
+ */
+TCB::TCB(int tid, void *(*start_routine)(void* arg), void *arg, State state,
+         size_t stack_size, bool stack_guard)
+  : TCB(tid, (ctx_entry_t) stub, (void*) start_routine, arg, state, stack_size,
+        stack_guard) {
+  _start_routine = (void*) start_routine;
+} // TCB()
+
+/**
+ * Constructor for library internal threads whose context calls
+ * entry(arg0, arg1) directly instead of the stub
+ * @param tid id for the new thread
+ * @param entry function the context starts in, must never return
+ * @param arg0 first argument for entry
+ * @param arg1 second argument for entry
+ * @param state current state for the new thread
+ * @param stack_size usable size of the thread's stack in bytes
+ * @param stack_guard whether the stack gets a guard page
  */
-TCB::TCB(int tid, void *(*start_routine)(void* arg), void *arg, State state) {
+TCB::TCB(int tid, ctx_entry_t entry, void *arg0, void *arg1, State state,
+         size_t stack_size, bool stack_guard) {
   // initialize all member variables
   _tid = tid;
   _quantum = 0;
   _state = state;
-  // allocate a thread stack
-  _stack = new char[STACK_SIZE];
-  // get the current execution context to initialize _context
-  int res = getcontext(&_context);
-  if (res == -1) {
-    std::cerr << "Error - failed to get context in TCB constructor" << std::endl;
-  } // if
-  _context.uc_stack.ss_sp = _stack; 
-  _context.uc_stack.ss_size = STACK_SIZE;
-  _context.uc_stack.ss_flags = 0;
-  // create initial thread context which points to stub
-  makecontext(&_context, (void(*)()) stub, 2, start_routine, arg);
+  // threads start inside the critical section of the switch that runs them
+  _critical = true;
+  _preempt_pending = false;
+  _suspend_pending = false;
+  _prio = UTHREAD_PRIO_DEFAULT;
+  _level = 0;
+  _cpu_ns = 0;
+  _quota = nullptr;
+  _ready_since = -1;
+  _joiners.head = nullptr;
+  _joiners.tail = nullptr;
+  _join_pending = 0;
+  _refs = 1;
+  _retval = nullptr;
+  _detached = false;
+  _suspended = false;
+  _wait_queue = nullptr;
+  _wait_next = nullptr;
+  _wait_prev = nullptr;
+  _wait_data = nullptr;
+  _wait_writer = false;
+  TimerWheel::initTimer(&_timer, this);
+  _timed_out = false;
+  _fd_closed = false;
+  _poll_fds = nullptr;
+  _poll_nfds = 0;
+  // the stack is only taken from the pool once the thread is scheduled,
+  // so threads that have not started yet cost no stack memory
+  _stack = nullptr;
+  _stack_size = StackPool::roundSize(stack_size);
+  _stack_guard = stack_guard;
+  _paint_stack = false;
+  _trim_stack = false;
+  _stack_painted = false;
+  _stack_highwater = -1;
+  _start_routine = (void*) entry;
+  _entry = entry;
+  _arg0 = arg0;
+  _arg1 = arg1;
+} // TCB()
+
+/**
+ * Constructor for a thread that is already running on a stack it does not
+ * own (the main thread)
+ * @param tid id for the thread
+ */
+TCB::TCB(int tid) {
+  _tid = tid;
+  _quantum = 0;
+  _state = RUNNING;
+  // the thread is running the library's initialization
+  _critical = true;
+  _preempt_pending = false;
+  _suspend_pending = false;
+  _prio = UTHREAD_PRIO_DEFAULT;
+  _level = 0;
+  _cpu_ns = 0;
+  _quota = nullptr;
+  _ready_since = -1;
+  _joiners.head = nullptr;
+  _joiners.tail = nullptr;
+  _join_pending = 0;
+  _refs = 1;
+  _retval = nullptr;
+  _detached = false;
+  _suspended = false;
+  _wait_queue = nullptr;
+  _wait_next = nullptr;
+  _wait_prev = nullptr;
+  _wait_data = nullptr;
+  _wait_writer = false;
+  TimerWheel::initTimer(&_timer, this);
+  _timed_out = false;
+  _fd_closed = false;
+  _poll_fds = nullptr;
+  _poll_nfds = 0;
+  _stack = nullptr;
+  _stack_size = 0;
+  _stack_guard = false;
+  _paint_stack = false;
+  _trim_stack = false;
+  _stack_painted = false;
+  _stack_highwater = -1;
+  _start_routine = nullptr;
+  _entry = nullptr;
+  _arg0 = nullptr;
+  _arg1 = nullptr;
 } // TCB()
 
 TCB::~TCB() {
-  // free dynamically allocated _stack member
-  delete [] _stack;
+  releaseStack();
 } // ~TCB()
 
+bool TCB::prepare() {
+  if (_entry == nullptr)
+    return true;
+  // take a guarded thread stack from the pool
+  _stack = StackPool::global().allocate(_stack_size, _stack_guard);
+  if (_stack == nullptr)
+    return false;
+  // painting makes the whole stack resident, so it is only done on request
+  if (_paint_stack) {
+    memset(_stack, STACK_PAINT, _stack_size);
+    _stack_painted = true;
+  } // if
+  // create initial thread context which points to entry
+  if (ctx_init(&_context, _stack, _stack_size, _entry, _arg0, _arg1) == -1) {
+    std::cerr << "Error - failed to initialize thread context" << std::endl;
+    releaseStack();
+    return false;
+  } // if
+  _entry = nullptr;
+  return true;
+} // prepare()
+
+void TCB::releaseStack() {
+  if (_stack != nullptr) {
+    _stack_highwater = getStackHighwater();
+    StackPool::global().release(_stack, _stack_size, _stack_guard);
+  } // if
+  _stack = nullptr;
+} // releaseStack()
+
+long TCB::getStackHighwater() const {
+  if (!_stack_painted || _stack == nullptr)
+    return _stack_highwater;
+  // the stack grows down: scan up from its lowest word for the first one
+  // that was written to
+  uintptr_t paint;
+  memset(&paint, STACK_PAINT, sizeof(paint));
+  const uintptr_t* word = (const uintptr_t*) _stack;
+  const uintptr_t* top = (const uintptr_t*) (_stack + _stack_size);
+  while (word < top && *word == paint)
+    word++;
+  return (const char*) top - (const char*) word;
+} // getStackHighwater()
+
+void TCB::trimStack() {
+  char* sp = ctx_sp(&_context);
+  if (_stack == nullptr || _stack_painted || sp <= _stack || sp > _stack + _stack_size)
+    return;
+  // stacks are page aligned, only whole pages below sp can go
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  char* end = (char*) ((uintptr_t) sp & ~(page - 1));
+  if (end > _stack)
+    madvise(_stack, end - _stack, MADV_DONTNEED);
+} // trimStack()
+
+void* TCB::getStartRoutine() const {
+  return _start_routine;
+} // getStartRoutine()
+
 void TCB::setState(State state) {
   _state = state;
 } // setState()
@@ -40,10 +202,22 @@ State TCB::getState() const {
   return _state;
 } // getState()
 
+bool TCB::casState(State expected, State state) {
+  return _state.compare_exchange_strong(expected, state);
+} // casState()
+
 int TCB::getId() const {
   return _tid;
 } // getId()
 
+char* TCB::getStack() const {
+  return _stack;
+} // getStack()
+
+size_t TCB::getStackSize() const {
+  return _stack == nullptr ? 0 : _stack_size;
+} // getStackSize()
+
 void TCB::increaseQuantum() {
   _quantum ++;
 } // increaseQuantum()
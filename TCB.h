@@ -6,11 +6,13 @@
 
 #include <stdio.h>
 #include <signal.h>
-#include <ucontext.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <iostream>
+#include <atomic>
 #include "uthread.h"
+#include "context.h"
+#include "TimerWheel.h"
 
 extern void stub(void *(*start_routine)(void *), void *arg);
 
@@ -28,14 +30,75 @@ class TCB {
      * @param f the thread function that get no args and return nothing
            * @param arg the thread function argument
      * @param state current state for the new thread
+     * @param stack_size usable size of the thread's stack in bytes
+     * @param stack_guard whether the stack gets a guard page
      */
-    TCB(int tid, void *(*start_routine)(void* arg), void *arg, State state);
+    TCB(int tid, void *(*start_routine)(void* arg), void *arg, State state,
+        size_t stack_size = STACK_SIZE, bool stack_guard = true);
+
+    /**
+     * Constructor for library internal threads (e.g. a worker's idle loop)
+     * whose context calls entry(arg0, arg1) directly instead of the stub
+     * @param tid id for the new thread
+     * @param entry function the context starts in, must never return
+     * @param arg0 first argument for entry
+     * @param arg1 second argument for entry
+     * @param state current state for the new thread
+     * @param stack_size usable size of the thread's stack in bytes
+     * @param stack_guard whether the stack gets a guard page
+     */
+    TCB(int tid, ctx_entry_t entry, void *arg0, void *arg1, State state,
+        size_t stack_size = STACK_SIZE, bool stack_guard = true);
+
+    /**
+     * Constructor for a thread that is already running on a stack it does
+     * not own (the main thread). Its context is filled in when it is first
+     * switched out
+     * @param tid id for the thread
+     */
+    explicit TCB(int tid);
     
     /**
      * thread d-tor
      */
     ~TCB();
 
+    /**
+     * function to allocate the thread's stack and build its initial context
+     * if it has not run yet. Called before the thread is first switched to
+     * @return true on success, false if no stack could be allocated
+     */
+    bool prepare();
+
+    /**
+     * function to return the thread's stack to the stack pool. Only called
+     * once the thread has finished and is no longer running on it. The
+     * high-water mark of a painted stack is kept
+     */
+    void releaseStack();
+
+    /**
+     * function that measures how much of a painted stack the thread has
+     * used: the distance from the top of the stack to the deepest word that
+     * no longer holds the paint
+     * @return the bytes used, -1 if the stack was not painted
+     */
+    long getStackHighwater() const;
+
+    /**
+     * function to return the pages of the stack below the thread's saved
+     * stack pointer to the kernel. Only called while the thread is switched
+     * out and cannot be switched back to. A painted stack is left alone
+     */
+    void trimStack();
+
+    /**
+     * function that get what the thread runs: its start routine, or the
+     * entry point of a library internal thread
+     * @return the function
+     */
+    void* getStartRoutine() const;
+
     /**
      * function to set the thread state
      * @param state the new state for our thread
@@ -47,6 +110,14 @@ class TCB {
      * @return the current state of the thread
      */
     State getState() const;
+
+    /**
+     * function that atomically moves the thread from one state to another
+     * @param expected the state the thread must currently be in
+     * @param state the new state for our thread
+     * @return true if the thread was in the expected state and was moved
+     */
+    bool casState(State expected, State state);
     
     /**
      * function that get the ID of the thread
@@ -54,6 +125,18 @@ class TCB {
      */
     int getId() const;
     
+    /**
+     * function that get the lowest address of the thread's stack
+     * @return the stack, nullptr if the thread has none
+     */
+    char* getStack() const;
+
+    /**
+     * function that get the usable size of the thread's stack
+     * @return the size in bytes, 0 if the thread has no stack
+     */
+    size_t getStackSize() const;
+
     /**
      * function to increase the quantum of the thread
      */
@@ -65,13 +148,62 @@ class TCB {
      */
      int getQuantum() const;
 
-    ucontext_t _context;    // The thread's saved context
+    uthread_ctx_t _context; // The thread's saved context
+
+    // Critical section flags, read by the timer handler. They belong to the
+    // thread rather than the worker because a thread may migrate between
+    // workers at any point outside of a critical section
+    volatile sig_atomic_t _critical;        // thread is inside the library
+    volatile sig_atomic_t _preempt_pending; // quantum ran out, not yet yielded
+    // set when another worker suspends this thread while it is running
+    std::atomic<bool> _suspend_pending;
+
+    // Scheduling policy state (see uthread_init_sched). The level is only
+    // changed by the thread itself, or by uthread_setprio under the lock
+    int _prio;              // priority set with uthread_setprio
+    int _level;             // ready queue the thread goes to, 0 is served first
+    long long _cpu_ns;      // time run so far, charged at every switch
+    uthread_quota_t* _quota; // cpu quota the thread counts against, if any
+    long long _ready_since; // when it was last made ready, -1 once it runs
+
+    // Wait state, protected by the scheduler lock. Kept in the TCB so that
+    // joining, exiting, suspending and resuming need no lookups or allocation
+    uthread_waitq_t _joiners; // threads blocked joining this one
+    int _join_pending;      // joiners woken by its exit, yet to collect it
+    // what keeps the TCB alive: its tid while in the thread table, and each
+    // ready queue entry, stale ones included (they are popped without the
+    // lock). The last one dropped frees it
+    std::atomic<int> _refs;
+    void* _retval;          // the thread's result once it has finished
+    bool _detached;         // reclaimed when it finishes, cannot be joined
+    bool _suspended;        // blocked by uthread_suspend until resumed
+    bool _paint_stack;      // paint the stack when it is allocated, for
+                            // getStackHighwater()
+    bool _trim_stack;       // trimStack() whenever the thread blocks
+    uthread_waitq_t* _wait_queue; // queue the thread is blocked on, if any
+    TCB* _wait_next;        // neighbours on _wait_queue
+    TCB* _wait_prev;
+    void* _wait_data;       // mutex to reacquire after a condition wait
+    bool _wait_writer;      // waiting to lock a rwlock for writing
+    Timer _timer;           // wakes the thread when a timed wait expires
+    bool _timed_out;        // the last timed wait expired
+    bool _fd_closed;        // the fd of the last fd wait was closed
+    struct pollfd* _poll_fds; // fds of the uthread_poll the thread is blocked
+    nfds_t _poll_nfds;      // in, all dropped by whatever wakes it first
 
   private:
     int _tid;               // The thread id number.
     int _quantum;           // The time interval, as explained in the pdf.
-    State _state;           // The state of the thread
-    char* _stack;           // The thread's stack
+    std::atomic<State> _state; // The state of the thread
+    char* _stack;           // The thread's stack, from StackPool
+    size_t _stack_size;     // Usable size of _stack
+    bool _stack_guard;      // _stack has a guard page below it
+    bool _stack_painted;    // _stack was filled with STACK_PAINT
+    long _stack_highwater;  // measured when a painted stack was released
+    void* _start_routine;   // what the thread runs, for stack reports
+    ctx_entry_t _entry;     // Entry point and arguments of a thread that
+    void* _arg0;            // has not been prepared yet, _entry is
+    void* _arg1;            // nullptr once it has a context
 };
 
 #endif /* TCB_H */
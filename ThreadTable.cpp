@@ -0,0 +1,89 @@
+#include "ThreadTable.h"
+#include <cstddef>
+
+ThreadTable::ThreadTable() {
+  for (int i = 0; i < MAX_CHUNKS; i++)
+    _chunks[i] = NULL;
+  _num_chunks = 0;
+  _free_head = -1;
+  _free_tail = -1;
+  _size = 0;
+  grow();
+} // ThreadTable()
+
+ThreadTable::~ThreadTable() {
+  for (int i = 0; i < _num_chunks; i++)
+    delete [] _chunks[i];
+} // ~ThreadTable()
+
+ThreadTable::Slot* ThreadTable::slot(int index) const {
+  return &_chunks[index / CHUNK_SLOTS][index % CHUNK_SLOTS];
+} // slot()
+
+bool ThreadTable::grow() {
+  if (_num_chunks == MAX_CHUNKS)
+    return false;
+  Slot* chunk = new Slot[CHUNK_SLOTS];
+  int first = _num_chunks * CHUNK_SLOTS;
+  for (int i = 0; i < CHUNK_SLOTS; i++) {
+    chunk[i].tcb = NULL;
+    chunk[i].generation = 0;
+    chunk[i].next_free = i + 1 < CHUNK_SLOTS ? first + i + 1 : -1;
+  } // for
+  _chunks[_num_chunks++] = chunk;
+  // append the new slots to the free list
+  if (_free_tail == -1)
+    _free_head = first;
+  else
+    slot(_free_tail)->next_free = first;
+  _free_tail = first + CHUNK_SLOTS - 1;
+  return true;
+} // grow()
+
+int ThreadTable::allocate() {
+  if (_free_head == -1 && !grow())
+    return -1;
+  int index = _free_head;
+  Slot* s = slot(index);
+  _free_head = s->next_free;
+  if (_free_head == -1)
+    _free_tail = -1;
+  s->next_free = -1;
+  _size++;
+  return (s->generation << SLOT_BITS) | index;
+} // allocate()
+
+void ThreadTable::set(int tid, TCB* tcb) {
+  slot(tid & (MAX_SLOTS - 1))->tcb = tcb;
+} // set()
+
+void ThreadTable::release(int tid) {
+  int index = tid & (MAX_SLOTS - 1);
+  Slot* s = slot(index);
+  s->tcb = NULL;
+  s->generation = (s->generation + 1) & GENERATION_MASK;
+  // freed slots go to the back so they are reused as late as possible
+  if (_free_tail == -1)
+    _free_head = index;
+  else
+    slot(_free_tail)->next_free = index;
+  _free_tail = index;
+  _size--;
+} // release()
+
+bool ThreadTable::contains(int tid) const {
+  return tid >= 0 && (tid & (MAX_SLOTS - 1)) < _num_chunks * CHUNK_SLOTS;
+} // contains()
+
+TCB* ThreadTable::lookup(int tid) const {
+  if (!contains(tid))
+    return NULL;
+  Slot* s = slot(tid & (MAX_SLOTS - 1));
+  if (s->generation != tid >> SLOT_BITS)
+    return NULL;
+  return s->tcb;
+} // lookup()
+
+int ThreadTable::size() const {
+  return _size;
+} // size()
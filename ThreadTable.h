@@ -0,0 +1,92 @@
+/*
+ * Growable table mapping thread ids to TCBs
+ *
+ * Slots live in fixed size chunks that are allocated as the table grows and
+ * never move, so a TCB pointer lookup is two array indexes. Free slots are
+ * kept on a FIFO list threaded through the slots, so allocating and freeing
+ * a tid is O(1) and a freed slot is reused as late as possible.
+ *
+ * A tid is the slot index tagged with the slot's generation, which is bumped
+ * every time the slot is freed. A stale tid (one whose thread was joined and
+ * whose slot now holds another thread) does not match the slot's generation
+ * and looks up as a terminated thread.
+ *
+ * The generation has 11 bits and wraps: after its slot has been freed 2048
+ * times a stale tid names the slot again. Since a freed slot goes behind
+ * every other free slot, that takes at least 2048 times as many thread
+ * creations as there are free slots.
+ */
+#ifndef THREADTABLE_H
+#define THREADTABLE_H
+
+class TCB;
+
+class ThreadTable {
+  public:
+    static const int SLOT_BITS = 20;                  // slot index bits in a tid
+    static const int MAX_SLOTS = 1 << SLOT_BITS;
+    static const int CHUNK_SLOTS = 4096;              // slots per chunk
+    static const int MAX_CHUNKS = MAX_SLOTS / CHUNK_SLOTS;
+    static const int GENERATION_MASK = (1 << (31 - SLOT_BITS)) - 1;
+
+    /**
+     * Constructor for ThreadTable. Starts with one chunk of free slots
+     */
+    ThreadTable();
+
+    /**
+     * d-tor. Frees the chunks (but not the TCBs)
+     */
+    ~ThreadTable();
+
+    /**
+     * Reserve a free slot, growing the table if needed
+     * @return the tid for the slot, -1 if the table is full
+     */
+    int allocate();
+
+    /**
+     * Store the TCB for a tid returned by allocate
+     */
+    void set(int tid, TCB* tcb);
+
+    /**
+     * Free the slot of a tid returned by allocate. The tid becomes stale
+     */
+    void release(int tid);
+
+    /**
+     * Find the TCB of a thread
+     * @return the TCB, nullptr if the tid is stale or its slot is empty
+     */
+    TCB* lookup(int tid) const;
+
+    /**
+     * Whether tid names a slot of the table, stale or not
+     */
+    bool contains(int tid) const;
+
+    /**
+     * Number of allocated slots
+     */
+    int size() const;
+
+  private:
+    struct Slot {
+      TCB* tcb;
+      int generation;
+      int next_free;          // next slot on the free list, -1 at the tail
+    };
+
+    Slot* slot(int index) const;
+    // allocate the next chunk and append its slots to the free list
+    bool grow();
+
+    Slot* _chunks[MAX_CHUNKS];
+    int _num_chunks;
+    int _free_head;
+    int _free_tail;
+    int _size;
+};
+
+#endif /* THREADTABLE_H */
@@ -0,0 +1,158 @@
+#include "TimerWheel.h"
+#include <cstddef>
+
+TimerWheel::TimerWheel(long long now_ns) {
+  _current = now_ns / TICK_NS;
+  for (int level = 0; level < LEVELS; level++) {
+    for (int slot = 0; slot < SLOTS; slot++)
+      _slots[level][slot] = NULL;
+    _occupied[level] = 0;
+  } // for
+  _size = 0;
+} // TimerWheel()
+
+void TimerWheel::initTimer(Timer* timer, void* owner) {
+  timer->deadline = 0;
+  timer->next = NULL;
+  timer->prev = NULL;
+  timer->level = -1;
+  timer->slot = -1;
+  timer->owner = owner;
+} // initTimer()
+
+bool TimerWheel::pending(const Timer* timer) {
+  return timer->level != -1;
+} // pending()
+
+void TimerWheel::insert(Timer* timer, long long earliest) {
+  // the first tick at or after the deadline, and never one already done
+  long long expires = (timer->deadline + TICK_NS - 1) / TICK_NS;
+  if (expires < earliest)
+    expires = earliest;
+  long long delta = expires - _current;
+  int level = 0;
+  while (level < LEVELS - 1 && delta >= (1LL << (SLOT_BITS * (level + 1))))
+    level++;
+  if (delta >= (1LL << (SLOT_BITS * LEVELS))) {
+    // beyond the wheel: park in the farthest slot, reinserted from there
+    expires = _current + (1LL << (SLOT_BITS * LEVELS)) - 1;
+  } // if
+  int slot = (expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+  timer->level = level;
+  timer->slot = slot;
+  timer->prev = NULL;
+  timer->next = _slots[level][slot];
+  if (timer->next != NULL)
+    timer->next->prev = timer;
+  _slots[level][slot] = timer;
+  _occupied[level] |= 1ULL << slot;
+} // insert()
+
+void TimerWheel::unlink(Timer* timer) {
+  if (timer->prev != NULL)
+    timer->prev->next = timer->next;
+  else
+    _slots[timer->level][timer->slot] = timer->next;
+  if (timer->next != NULL)
+    timer->next->prev = timer->prev;
+  if (_slots[timer->level][timer->slot] == NULL)
+    _occupied[timer->level] &= ~(1ULL << timer->slot);
+  timer->next = timer->prev = NULL;
+  timer->level = timer->slot = -1;
+} // unlink()
+
+void TimerWheel::add(Timer* timer) {
+  insert(timer, _current + 1);
+  _size++;
+} // add()
+
+void TimerWheel::cancel(Timer* timer) {
+  if (!pending(timer))
+    return;
+  unlink(timer);
+  _size--;
+} // cancel()
+
+void TimerWheel::cascade(int level) {
+  int slot = (_current >> (SLOT_BITS * level)) & (SLOTS - 1);
+  // at the start of a whole turn of this level, the level above comes first
+  // since its timers may land in this very slot
+  if (slot == 0 && level + 1 < LEVELS)
+    cascade(level + 1);
+  Timer* timer = _slots[level][slot];
+  _slots[level][slot] = NULL;
+  _occupied[level] &= ~(1ULL << slot);
+  while (timer != NULL) {
+    Timer* next = timer->next;
+    // the current tick is about to be processed, timers due now stay due
+    insert(timer, _current);
+    timer = next;
+  } // while
+} // cascade()
+
+Timer* TimerWheel::advance(long long now_ns) {
+  long long target = now_ns / TICK_NS;
+  Timer* expired = NULL;
+  while (_current < target) {
+    if (_size == 0) {
+      _current = target;
+      break;
+    } // if
+    // skip to the next occupied level 0 slot of this turn, or to the end
+    // of the turn where the levels above cascade
+    int slot = _current & (SLOTS - 1);
+    uint64_t later = slot == SLOTS - 1 ? 0 : _occupied[0] & (~0ULL << (slot + 1));
+    long long next = later != 0 ? (_current & ~(long long) (SLOTS - 1)) + __builtin_ctzll(later)
+                                : (_current | (SLOTS - 1)) + 1;
+    if (next > target) {
+      _current = target;
+      break;
+    } // if
+    _current = next;
+    if ((_current & (SLOTS - 1)) == 0)
+      cascade(1);
+    slot = _current & (SLOTS - 1);
+    Timer* timer = _slots[0][slot];
+    _slots[0][slot] = NULL;
+    _occupied[0] &= ~(1ULL << slot);
+    while (timer != NULL) {
+      Timer* following = timer->next;
+      if (timer->deadline > _current * TICK_NS) {
+        // parked beyond the wheel's reach, not due yet
+        insert(timer, _current + 1);
+      } else {
+        timer->level = timer->slot = -1;
+        timer->prev = NULL;
+        timer->next = expired;
+        expired = timer;
+        _size--;
+      } // else
+      timer = following;
+    } // while
+  } // while
+  return expired;
+} // advance()
+
+long long TimerWheel::nextExpiry() const {
+  if (_size == 0)
+    return -1;
+  long long earliest = -1;
+  for (int level = 0; level < LEVELS; level++) {
+    if (_occupied[level] == 0)
+      continue;
+    int shift = SLOT_BITS * level;
+    long long turn = _current >> shift;
+    int slot = turn & (SLOTS - 1);
+    // first occupied slot after the current one, wrapping around
+    uint64_t rotated = (_occupied[level] >> 1 >> slot) |
+                       (_occupied[level] << (SLOTS - 1 - slot));
+    long long tick = (turn + 1 + __builtin_ctzll(rotated)) << shift;
+    if (earliest == -1 || tick < earliest)
+      earliest = tick;
+  } // for
+  return earliest * TICK_NS;
+} // nextExpiry()
+
+int TimerWheel::size() const {
+  return _size;
+} // size()
@@ -0,0 +1,96 @@
+/*
+ * Hierarchical timer wheel
+ *
+ * Time is counted in ticks of TICK_NS. Level 0 has one slot per tick for the
+ * next SLOTS ticks, and every level above covers SLOTS times the span of the
+ * one below it. A timer goes into the lowest level that reaches its
+ * deadline, and moves down a level each time the wheel below it wraps
+ * around, until it expires from level 0. Timers are linked into their slot,
+ * so adding and cancelling one is O(1) and needs no allocation. Per level
+ * bitmaps of occupied slots let advance() skip idle stretches of time.
+ *
+ * Not thread safe: the scheduler lock protects the wheel.
+ */
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+// A timer, embedded in whatever waits for it (a TCB)
+struct Timer {
+  long long deadline;       // CLOCK_MONOTONIC ns
+  Timer* next;
+  Timer* prev;
+  int level;                // position in the wheel, -1 if not pending
+  int slot;
+  void* owner;
+};
+
+class TimerWheel {
+  public:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = 5;                   // SLOTS^5 ticks, about 30 h
+    static const long long TICK_NS = 100000;       // 100 us
+
+    /**
+     * Constructor for TimerWheel
+     * @param now_ns the current CLOCK_MONOTONIC time
+     */
+    TimerWheel(long long now_ns);
+
+    /**
+     * Prepare a timer that is not in any wheel
+     */
+    static void initTimer(Timer* timer, void* owner);
+
+    /**
+     * Whether a timer is waiting to expire
+     */
+    static bool pending(const Timer* timer);
+
+    /**
+     * Add a timer that expires at timer->deadline. A deadline in the past
+     * expires at the next advance
+     */
+    void add(Timer* timer);
+
+    /**
+     * Remove a pending timer. Does nothing if the timer is not pending
+     */
+    void cancel(Timer* timer);
+
+    /**
+     * Move the wheel to now_ns and take off every timer that expired
+     * @return the expired timers, linked through next
+     */
+    Timer* advance(long long now_ns);
+
+    /**
+     * Time the wheel should next be advanced at. It is never after the
+     * earliest deadline, but may be before it when that timer still has to
+     * move down a level
+     * @return CLOCK_MONOTONIC ns, -1 if no timer is pending
+     */
+    long long nextExpiry() const;
+
+    /**
+     * Number of pending timers
+     */
+    int size() const;
+
+  private:
+    // put a timer in the slot for its deadline, or for tick earliest if the
+    // deadline is before it
+    void insert(Timer* timer, long long earliest);
+    void unlink(Timer* timer);
+    // move the timers of the current slot of a level down the wheel
+    void cascade(int level);
+
+    long long _current;                 // every tick up to here is done
+    Timer* _slots[LEVELS][SLOTS];
+    uint64_t _occupied[LEVELS];         // bit per non-empty slot
+    int _size;
+};
+
+#endif /* TIMERWHEEL_H */
@@ -0,0 +1,87 @@
+#include "Trace.h"
+#include <climits>
+#include <vector>
+
+using namespace std;
+
+static const char* type_names[] = {
+  "create", "switch", "preempt", "suspend", "resume",
+};
+
+static const char* reason_names[] = {
+  "", "yielded", "preempted", "exited", "blocked: waitq", "blocked: join",
+  "blocked: sleep", "blocked: suspend", "blocked: io", "blocked: quota",
+};
+
+TraceRing::TraceRing(long capacity) : _head(0) {
+  long size = 1;
+  while (size < capacity)
+    size <<= 1;
+  _events = new TraceEvent[size];
+  _mask = size - 1;
+} // TraceRing()
+
+TraceRing::~TraceRing() {
+  delete [] _events;
+} // ~TraceRing()
+
+void TraceRing::clear() {
+  _head.store(0, memory_order_relaxed);
+} // clear()
+
+// Microseconds since base, as Chrome trace timestamps are
+static double traceUs(long long ts, long long base) {
+  return (ts - base) / 1000.0;
+} // traceUs()
+
+int TraceRing::dump(FILE* out, TraceRing* const* rings, int num_rings) {
+  // the events still held by each ring, oldest first
+  vector<vector<TraceEvent> > events(num_rings);
+  long long base = LLONG_MAX;
+  for (int r = 0; r < num_rings; r++) {
+    long head = rings[r]->_head.load(memory_order_acquire);
+    long first = head > rings[r]->_mask + 1 ? head - rings[r]->_mask - 1 : 0;
+    for (long i = first; i < head; i++)
+      events[r].push_back(rings[r]->_events[i & rings[r]->_mask]);
+    if (!events[r].empty())
+      base = min(base, events[r].front().ts);
+  } // for
+  fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+  const char* sep = "";
+  for (int r = 0; r < num_rings; r++) {
+    if (r < num_rings - 1)
+      fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+              "\"args\": {\"name\": \"worker %d\"}}", sep, r, r);
+    else
+      fprintf(out, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+              "\"args\": {\"name\": \"other kernel threads\"}}", sep, r);
+    sep = ",\n";
+    // the thread switched in last, and since when
+    int running = -1;
+    long long since = 0;
+    for (const TraceEvent& e : events[r]) {
+      if (e.type == TRACE_SWITCH) {
+        // the idle thread (tid -1) runs when nothing else is ready
+        if (running >= 0 && e.ts > since)
+          fprintf(out, ",\n{\"name\": \"uthread %d\", \"cat\": \"run\", \"ph\": \"X\", "
+                  "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, "
+                  "\"args\": {\"tid\": %d, \"left\": \"%s\"}}", running,
+                  traceUs(since, base), (e.ts - since) / 1000.0, r, running,
+                  reason_names[e.reason]);
+        running = e.tid;
+        since = e.ts;
+      } else {
+        fprintf(out, ",\n{\"name\": \"%s\", \"cat\": \"sched\", \"ph\": \"i\", \"s\": \"t\", "
+                "\"ts\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {\"tid\": %d}}",
+                type_names[e.type], traceUs(e.ts, base), r, e.tid);
+      } // else
+    } // for
+    // the thread still running at the last event
+    if (running >= 0 && !events[r].empty() && events[r].back().ts > since)
+      fprintf(out, ",\n{\"name\": \"uthread %d\", \"cat\": \"run\", \"ph\": \"X\", "
+              "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d, \"args\": {\"tid\": %d}}",
+              running, traceUs(since, base), (events[r].back().ts - since) / 1000.0, r, running);
+  } // for
+  fprintf(out, "\n]}\n");
+  return ferror(out) ? -1 : 0;
+} // dump()
@@ -0,0 +1,117 @@
+/*
+ * Ring buffer of scheduler events, for uthread_trace_start/_dump
+ *
+ * Each worker records into its own ring and is its only writer: a record
+ * stores the event and bumps the head, with no lock, no atomic
+ * read-modify-write and no allocation. The preemption signal handler only
+ * records when it interrupted a thread outside the library, so never in
+ * the middle of another record. Kernel threads that are not workers share
+ * one more ring, where a record claims its slot with a fetch_add. Once a
+ * ring is full the oldest events are overwritten.
+ *
+ * A switch is one event, stamped with the time the switch read anyway:
+ * why the previous thread left (yielded, preempted, exited, or what it
+ * blocked on) is its reason.
+ *
+ * Events are only read by dump(), which expects recording to have stopped:
+ * an event written during a dump may come out torn.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdio>
+
+// What happened to the thread of an event
+enum TraceType {
+  TRACE_CREATE,     // created
+  TRACE_SWITCH,     // switched in
+  TRACE_PREEMPT,    // quantum ran out in the timer handler
+  TRACE_SUSPEND,    // suspended by uthread_suspend
+  TRACE_RESUME,     // resumed by uthread_resume
+};
+
+// Why the previous thread left, for TRACE_SWITCH
+enum TraceReason {
+  TRACE_NONE,
+  TRACE_YIELDED,
+  TRACE_PREEMPTED,
+  TRACE_EXITED,
+  // blocked on
+  TRACE_ON_WAITQ,   // mutex, semaphore, channel, future, ...
+  TRACE_ON_JOIN,
+  TRACE_ON_SLEEP,
+  TRACE_ON_SUSPEND,
+  TRACE_ON_IO,
+  TRACE_ON_QUOTA,
+};
+
+struct TraceEvent {
+  long long ts;             // CLOCK_MONOTONIC ns
+  int tid;
+  unsigned char type;       // TraceType
+  unsigned char reason;     // TraceReason
+  unsigned short unused;
+};
+
+class TraceRing {
+  public:
+    /**
+     * Constructor for TraceRing
+     * @param capacity events kept, rounded up to a power of two
+     */
+    TraceRing(long capacity);
+
+    /**
+     * d-tor. Frees the events
+     */
+    ~TraceRing();
+
+    TraceRing(const TraceRing&) = delete;
+    TraceRing& operator=(const TraceRing&) = delete;
+
+    /**
+     * Record an event. The ring's single writer only
+     */
+    void record(long long ts, int tid, int type, int reason) {
+      long i = _head.load(std::memory_order_relaxed);
+      fill(&_events[i & _mask], ts, tid, type, reason);
+      _head.store(i + 1, std::memory_order_release);
+    } // record()
+
+    /**
+     * Record an event. Safe from any thread
+     */
+    void recordShared(long long ts, int tid, int type, int reason) {
+      long i = _head.fetch_add(1, std::memory_order_acq_rel);
+      fill(&_events[i & _mask], ts, tid, type, reason);
+    } // recordShared()
+
+    /**
+     * Drop every event
+     */
+    void clear();
+
+    /**
+     * Write the rings' events as Chrome trace JSON (chrome://tracing,
+     * Perfetto): a track per ring with a slice for every run of a thread
+     * between two switches, and an instant for every other event
+     * @param rings one per worker, then the ring of the other kernel threads
+     * @return 0 on success, -1 if writing failed
+     */
+    static int dump(FILE* out, TraceRing* const* rings, int num_rings);
+
+  private:
+    static void fill(TraceEvent* event, long long ts, int tid, int type, int reason) {
+      event->ts = ts;
+      event->tid = tid;
+      event->type = type;
+      event->reason = reason;
+    } // fill()
+
+    TraceEvent* _events;
+    long _mask;
+    std::atomic<long> _head;  // events ever recorded
+};
+
+#endif /* TRACE_H */
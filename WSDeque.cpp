@@ -0,0 +1,77 @@
+#include "WSDeque.h"
+
+using namespace std;
+
+WSDeque::Buffer::Buffer(long capacity) {
+  mask = capacity - 1;
+  slots = new atomic<TCB*>[capacity];
+} // Buffer()
+
+WSDeque::Buffer::~Buffer() {
+  delete [] slots;
+} // ~Buffer()
+
+TCB* WSDeque::Buffer::get(long i) const {
+  return slots[i & mask].load(memory_order_relaxed);
+} // get()
+
+void WSDeque::Buffer::put(long i, TCB* tcb) {
+  slots[i & mask].store(tcb, memory_order_relaxed);
+} // put()
+
+WSDeque::WSDeque(long capacity) {
+  long cap = 1;
+  while (cap < capacity)
+    cap <<= 1;
+  _top.store(0, memory_order_relaxed);
+  _bottom.store(0, memory_order_relaxed);
+  _buffer.store(new Buffer(cap), memory_order_relaxed);
+} // WSDeque()
+
+WSDeque::~WSDeque() {
+  delete _buffer.load(memory_order_relaxed);
+  for (size_t i = 0; i < _retired.size(); i++)
+    delete _retired[i];
+} // ~WSDeque()
+
+WSDeque::Buffer* WSDeque::grow(Buffer* old, long bottom, long top) {
+  Buffer* buffer = new Buffer(2 * (old->mask + 1));
+  for (long i = top; i < bottom; i++)
+    buffer->put(i, old->get(i));
+  // stealers may still be reading the old buffer
+  _retired.push_back(old);
+  _buffer.store(buffer, memory_order_release);
+  return buffer;
+} // grow()
+
+void WSDeque::push(TCB* tcb) {
+  long b = _bottom.load(memory_order_relaxed);
+  long t = _top.load(memory_order_acquire);
+  Buffer* buffer = _buffer.load(memory_order_relaxed);
+  if (b - t > buffer->mask)
+    buffer = grow(buffer, b, t);
+  buffer->put(b, tcb);
+  atomic_thread_fence(memory_order_release);
+  _bottom.store(b + 1, memory_order_relaxed);
+} // push()
+
+int WSDeque::steal(TCB** tcb) {
+  long t = _top.load(memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  long b = _bottom.load(memory_order_acquire);
+  if (t >= b)
+    return 0;
+  Buffer* buffer = _buffer.load(memory_order_acquire);
+  TCB* head = buffer->get(t);
+  if (!_top.compare_exchange_strong(t, t + 1, memory_order_seq_cst,
+                                    memory_order_relaxed))
+    return -1;
+  *tcb = head;
+  return 1;
+} // steal()
+
+long WSDeque::size() const {
+  long b = _bottom.load(memory_order_relaxed);
+  long t = _top.load(memory_order_relaxed);
+  return b > t ? b - t : 0;
+} // size()
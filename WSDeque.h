@@ -0,0 +1,69 @@
+/*
+ * Chase-Lev work-stealing deque of TCB pointers
+ *
+ * One kernel thread (the owning worker) pushes at the bottom, any worker may
+ * take from the top. The owner also takes from the top so that the local run
+ * queue stays FIFO (round robin), as the single ready queue was before.
+ * Memory orderings follow Le, Pop, Cohen and Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (PPoPP'13).
+ */
+#ifndef WSDEQUE_H
+#define WSDEQUE_H
+
+#include <atomic>
+#include <vector>
+
+class TCB;
+
+class WSDeque {
+  public:
+    /**
+     * Create an empty deque
+     * @param capacity initial capacity, rounded up to a power of two
+     */
+    WSDeque(long capacity = 256);
+
+    /**
+     * d-tor. Frees the current and all retired buffers
+     */
+    ~WSDeque();
+
+    /**
+     * Add a TCB at the bottom of the deque. Owner only
+     * @param tcb the TCB to add
+     */
+    void push(TCB* tcb);
+
+    /**
+     * Remove the TCB at the top of the deque. Safe from any thread
+     * @param tcb set to the removed TCB on success
+     * @return 1 on success, 0 if the deque is empty, -1 if another thread
+     *         won a race for the same entry (caller may retry)
+     */
+    int steal(TCB** tcb);
+
+    /**
+     * Approximate number of TCBs in the deque
+     */
+    long size() const;
+
+  private:
+    struct Buffer {
+      long mask;
+      std::atomic<TCB*>* slots;
+      Buffer(long capacity);
+      ~Buffer();
+      TCB* get(long i) const;
+      void put(long i, TCB* tcb);
+    };
+
+    // Double the buffer capacity, keeping the old buffer for late stealers
+    Buffer* grow(Buffer* old, long bottom, long top);
+
+    std::atomic<long> _top;
+    std::atomic<long> _bottom;
+    std::atomic<Buffer*> _buffer;
+    std::vector<Buffer*> _retired;  // old buffers, freed in the d-tor
+};
+
+#endif /* WSDEQUE_H */
@@ -0,0 +1,118 @@
+/*
+ * Machine context used to switch between threads.
+ *
+ * By default the library switches threads with a small assembly routine
+ * (context.S) that saves only the callee-saved registers, the stack pointer
+ * and the floating point control word(s). Building with
+ * -DUTHREAD_USE_UCONTEXT (make UCONTEXT=1) falls back to the portable
+ * getcontext/makecontext/swapcontext path, which is also used automatically
+ * on architectures without a hand-written switch routine.
+ */
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if !defined(__x86_64__) && !defined(__aarch64__) && !defined(UTHREAD_USE_UCONTEXT)
+#define UTHREAD_USE_UCONTEXT
+#endif
+
+#ifdef UTHREAD_USE_UCONTEXT
+#include <ucontext.h>
+
+typedef ucontext_t uthread_ctx_t;
+#else
+
+// Everything else lives on the suspended thread's own stack
+typedef struct uthread_ctx {
+  void* sp;               // saved stack pointer
+} uthread_ctx_t;
+
+extern "C" {
+  // Save the current context into from and resume the context in to
+  void uthread_ctx_switch(uthread_ctx_t* from, uthread_ctx_t* to);
+  // First "return address" of a new context. Calls entry(arg0, arg1)
+  void uthread_ctx_trampoline();
+}
+#endif
+
+typedef void (*ctx_entry_t)(void*, void*);
+
+/**
+ * Initialize ctx so that switching to it calls entry(arg0, arg1) on the
+ * given stack. entry must never return.
+ * @return 0 on success, -1 on failure
+ */
+static inline int ctx_init(uthread_ctx_t* ctx, char* stack, size_t size,
+                           ctx_entry_t entry, void* arg0, void* arg1) {
+#ifdef UTHREAD_USE_UCONTEXT
+  if (getcontext(ctx) == -1)
+    return -1;
+  ctx->uc_stack.ss_sp = stack;
+  ctx->uc_stack.ss_size = size;
+  ctx->uc_stack.ss_flags = 0;
+  ctx->uc_link = NULL;
+  makecontext(ctx, (void(*)()) entry, 2, arg0, arg1);
+#else
+  // align the top of the stack to 16 bytes as required by both ABIs
+  uintptr_t top = ((uintptr_t) stack + size) & ~(uintptr_t) 15;
+#if defined(__x86_64__)
+  // frame popped by uthread_ctx_switch (lowest address first):
+  // mxcsr/x87 cw, r15, r14, r13, r12, rbx, rbp, return address
+  uint64_t* frame = (uint64_t*) (top - 8) - 7;
+  uint32_t mxcsr;
+  uint16_t fpucw;
+  __asm__ __volatile__("stmxcsr %0\n\tfnstcw %1" : "=m"(mxcsr), "=m"(fpucw));
+  frame[0] = (uint64_t) mxcsr | ((uint64_t) fpucw << 32);
+  frame[1] = 0;                             // r15
+  frame[2] = (uint64_t) arg1;               // r14
+  frame[3] = (uint64_t) arg0;               // r13
+  frame[4] = (uint64_t) entry;              // r12
+  frame[5] = 0;                             // rbx
+  frame[6] = 0;                             // rbp
+  frame[7] = (uint64_t) uthread_ctx_trampoline;
+#elif defined(__aarch64__)
+  // frame popped by uthread_ctx_switch: x19-x28, x29, x30, d8-d15, fpcr
+  uint64_t* frame = (uint64_t*) (top - 176);
+  for (int i = 0; i < 22; i++)
+    frame[i] = 0;
+  uint64_t fpcr;
+  __asm__ __volatile__("mrs %0, fpcr" : "=r"(fpcr));
+  frame[0] = (uint64_t) entry;              // x19
+  frame[1] = (uint64_t) arg0;               // x20
+  frame[2] = (uint64_t) arg1;               // x21
+  frame[11] = (uint64_t) uthread_ctx_trampoline; // x30 (lr)
+  frame[20] = fpcr;
+#endif
+  ctx->sp = frame;
+#endif
+  return 0;
+} // ctx_init()
+
+// Stack pointer saved in a context that was switched out: everything
+// below it on the stack is free
+static inline char* ctx_sp(const uthread_ctx_t* ctx) {
+#ifdef UTHREAD_USE_UCONTEXT
+#if defined(__x86_64__)
+  return (char*) ctx->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  return (char*) ctx->uc_mcontext.sp;
+#else
+  return nullptr;
+#endif
+#else
+  return (char*) ctx->sp;
+#endif
+} // ctx_sp()
+
+// Save the running context into from and resume to
+static inline void ctx_switch(uthread_ctx_t* from, uthread_ctx_t* to) {
+#ifdef UTHREAD_USE_UCONTEXT
+  swapcontext(from, to);
+#else
+  uthread_ctx_switch(from, to);
+#endif
+} // ctx_switch()
+
+#endif /* CONTEXT_H */
@@ -3,9 +3,14 @@
 
 using namespace std;
 
+static int points_per_thread;
+// Each worker stores its count of points inside the circle in its slot,
+// then counts down the wait group
+static unsigned long* results;
+static uthread_wg_t done;
+
 void *worker(void *arg) {
-  int my_tid = uthread_self();
-  int points_per_thread = *(int*)arg;
+  unsigned long* slot = (unsigned long*)arg;
 
   unsigned long local_cnt = 0;
   unsigned int rand_state = rand();
@@ -16,10 +21,9 @@ void *worker(void *arg) {
       local_cnt++;
   }
 
-  // NOTE: Parent thread must deallocate
-  unsigned long *return_buffer = new unsigned long;
-  *return_buffer = local_cnt;
-  return return_buffer;
+  *slot = local_cnt;
+  uthread_wg_done(&done);
+  return nullptr;
 } // worker()
 
 int main(int argc, char *argv[]) {
@@ -27,46 +31,49 @@ int main(int argc, char *argv[]) {
   int quantum_usecs = 1000;
 
   if (argc < 3) {
-    cerr << "Usage: ./pi <total points> <threads> [quantum_usecs]" << endl;
+    cerr << "Usage: ./pi <total points> <threads> [quantum_usecs] [workers]" << endl;
     cerr << "Example: ./pi 100000000 8" << endl;
     exit(1);
-  } else if (argc == 4) {
+  }
+  if (argc >= 4) {
     quantum_usecs = atoi(argv[3]);
   }
+  // Default to a single kernel thread
+  int workers = 1;
+  if (argc >= 5) {
+    workers = atoi(argv[4]);
+  }
   unsigned long totalpoints = atol(argv[1]);
   int thread_count = atoi(argv[2]);
 
-  int *threads = new int[thread_count];
-  int points_per_thread = totalpoints / thread_count;
+  points_per_thread = totalpoints / thread_count;
 
   // Init user thread library
-  int ret = uthread_init(quantum_usecs);
+  int ret = uthread_init_workers(quantum_usecs, workers);
   if (ret != 0) {
     cerr << "uthread_init FAIL!\n" << endl;
     exit(1);
   } // if
 
   srand(time(NULL));
+  results = new unsigned long[thread_count];
+  uthread_wg_init(&done, thread_count);
 
-  // Create threads
-  for (int i = 0; i < thread_count; i++) {
-    int tid = uthread_create(worker, &points_per_thread);
-    threads[i] = tid;
-  } // for
+  // Create threads. Nothing joins them, they are reclaimed as they finish
+  uthread_attr_t attr;
+  uthread_attr_init(&attr);
+  uthread_attr_setdetachstate(&attr, UTHREAD_CREATE_DETACHED);
+  for (int i = 0; i < thread_count; i++)
+    uthread_create_attr(worker, &results[i], &attr);
 
-  // Wait for all threads to complete
+  // Wake up once, when every worker has stored its result
+  uthread_wg_wait(&done);
   unsigned long g_cnt = 0;
-  for (int i = 0; i < thread_count; i++) {
-    // Add thread result to global total
-    unsigned long *local_cnt;
-    uthread_join(threads[i], (void**)&local_cnt);
-    g_cnt += *local_cnt;
-
-    // Deallocate thread result
-    delete local_cnt;
-  } // for
+  for (int i = 0; i < thread_count; i++)
+    g_cnt += results[i];
 
-  delete[] threads;
+  uthread_wg_destroy(&done);
+  delete[] results;
 
   cout << "Pi: " << (4. * (double)g_cnt) / ((double)points_per_thread * thread_count) << endl;
 
@@ -0,0 +1,1368 @@
+#include "uthread.h"
+#include "Channel.h"
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cassert>
+#include <cstring>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <initializer_list>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+using namespace std;
+
+// Helpers ---------------------------------------------------------------------
+
+// Monotonic wall clock in nanoseconds
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+} // now_ns()
+
+// With --json every result is also written to stdout as one JSON object per
+// line, for tracking results across versions. Each line is flushed as it is
+// written, so the children that run some benchmarks do not repeat it
+static bool json_output = false;
+
+static void json_line(const string& name, const char* impl, const char* unit,
+                      initializer_list<pair<const char*, double> > fields) {
+  if (!json_output)
+    return;
+  cout << "{\"name\": \"" << name << "\", \"impl\": \"" << impl
+       << "\", \"unit\": \"" << unit << "\"";
+  for (auto& field : fields) {
+    cout << ", \"" << field.first << "\": ";
+    if (field.second == (long long) field.second)
+      cout << (long long) field.second;
+    else
+      cout << fixed << setprecision(3) << field.second;
+  } // for
+  cout << "}" << endl;
+} // json_line()
+
+static void report(const char* name, long long ops, long long elapsed_ns,
+                   const char* impl = "uthread") {
+  cerr << left << setw(32) << setfill(' ') << name
+       << right << setw(12) << ops << " ops"
+       << setw(12) << fixed << setprecision(1)
+       << (double) elapsed_ns / ops << " ns/op" << endl;
+  json_line(name, impl, "ns/op", {{"ops", (double) ops}, {"mean", (double) elapsed_ns / ops}});
+} // report()
+
+// Report the min, median and p99 of samples, each the result of one run (or
+// batch) of a benchmark
+static void report_stats(const string& name, const char* impl,
+                         vector<double>& samples, const char* unit = "ns/op") {
+  sort(samples.begin(), samples.end());
+  size_t n = samples.size();
+  double min = samples[0];
+  double median = samples[n / 2];
+  double p99 = samples[(n - 1) * 99 / 100];
+  cerr << left << setw(32) << setfill(' ') << name << setw(8) << impl
+       << right << fixed << setprecision(1)
+       << " min" << setw(10) << min << "  median" << setw(10) << median
+       << "  p99" << setw(10) << p99 << " " << unit << endl;
+  json_line(name, impl, unit, {{"samples", (double) n}, {"min", min}, {"median", median}, {"p99", p99}});
+} // report_stats()
+
+// Attributes that pin a pthread to the cpu of the caller, so a pthread
+// baseline shares one cpu the way the uthreads of one worker do
+static void pinned_attr(pthread_attr_t* attr) {
+  pthread_attr_init(attr);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(sched_getcpu(), &set);
+  pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+} // pinned_attr()
+
+// System cpu time of the process in nanoseconds
+static long long sys_ns() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_stime.tv_sec * 1000000000LL + usage.ru_stime.tv_usec * 1000LL;
+} // sys_ns()
+
+// Resident set size of the process in KB
+static long rss_kb() {
+  long pages = 0, resident = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr)
+    return -1;
+  if (fscanf(statm, "%ld %ld", &pages, &resident) != 2)
+    resident = -1;
+  fclose(statm);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+} // rss_kb()
+
+// Part of the resident set the kernel may reclaim without swapping, such as
+// stacks trimmed with MADV_FREE, in KB
+static long lazyfree_kb() {
+  long lazyfree = -1;
+  char line[128];
+  FILE* smaps = fopen("/proc/self/smaps_rollup", "r");
+  if (smaps == nullptr)
+    return -1;
+  while (fgets(line, sizeof(line), smaps) != nullptr) {
+    if (sscanf(line, "LazyFree: %ld kB", &lazyfree) == 1)
+      break;
+  } // while
+  fclose(smaps);
+  return lazyfree;
+} // lazyfree_kb()
+
+// Yield ping-pong -------------------------------------------------------------
+
+void* pingpong(void* arg) {
+  long iterations = *(long*) arg;
+  for (long i = 0; i < iterations; i++)
+    uthread_yield();
+  return nullptr;
+} // pingpong()
+
+// Two threads yield back and forth; every uthread_yield is one switch.
+// Each of BENCH_SAMPLES runs times its own pair of threads. Also reports
+// the system time per switch, which is the kernel's share
+static const int BENCH_SAMPLES = 100;
+
+static void bench_yield_pingpong(long iterations, const char* name = "yield ping-pong") {
+  long per_run = max(iterations / BENCH_SAMPLES, 1L);
+  vector<double> samples;
+  long long sys_start = sys_ns();
+  for (int s = 0; s < BENCH_SAMPLES; s++) {
+    int tids[2];
+    long long start = now_ns();
+    tids[0] = uthread_create(pingpong, &per_run);
+    tids[1] = uthread_create(pingpong, &per_run);
+    for (int i = 0; i < 2; i++) {
+      void* res;
+      uthread_join(tids[i], &res);
+    } // for
+    samples.push_back((double) (now_ns() - start) / (2 * per_run));
+  } // for
+  long long sys = sys_ns() - sys_start;
+  report_stats(name, "uthread", samples);
+  double sys_per_switch = (double) sys / (2 * per_run * BENCH_SAMPLES);
+  cerr << left << setw(32) << "  system time/switch" << right << setw(12)
+       << fixed << setprecision(1) << sys_per_switch << " ns" << endl;
+  json_line(string(name) + ": system time/switch", "uthread", "ns", {{"mean", sys_per_switch}});
+} // bench_yield_pingpong()
+
+typedef struct handoff {
+  sem_t sems[2];
+  long iterations;
+} handoff_t;
+
+// Waits for its turn on its own semaphore, then gives the turn to the other
+// side, so every wait is a switch between the two kernel threads
+void* pthread_pingpong(void* arg) {
+  handoff_t* h = (handoff_t*) ((void**) arg)[0];
+  int side = (int) (long) ((void**) arg)[1];
+  for (long i = 0; i < h->iterations; i++) {
+    sem_wait(&h->sems[side]);
+    sem_post(&h->sems[1 - side]);
+  } // for
+  return nullptr;
+} // pthread_pingpong()
+
+// The pthread baseline: two pthreads on the cpu of the caller hand a turn
+// back and forth through semaphores, as sched_yield does not reliably
+// switch to the other one
+static void bench_pthread_pingpong(long iterations) {
+  handoff_t h;
+  h.iterations = max(iterations / BENCH_SAMPLES, 1L);
+  pthread_attr_t attr;
+  pinned_attr(&attr);
+  vector<double> samples;
+  for (int s = 0; s < BENCH_SAMPLES; s++) {
+    sem_init(&h.sems[0], 0, 1);
+    sem_init(&h.sems[1], 0, 0);
+    void* args[2][2] = {{&h, (void*) 0}, {&h, (void*) 1}};
+    pthread_t threads[2];
+    long long start = now_ns();
+    for (int i = 0; i < 2; i++)
+      pthread_create(&threads[i], &attr, pthread_pingpong, args[i]);
+    for (int i = 0; i < 2; i++)
+      pthread_join(threads[i], NULL);
+    samples.push_back((double) (now_ns() - start) / (2 * h.iterations));
+    sem_destroy(&h.sems[0]);
+    sem_destroy(&h.sems[1]);
+  } // for
+  pthread_attr_destroy(&attr);
+  report_stats("yield ping-pong", "pthread", samples);
+} // bench_pthread_pingpong()
+
+// Create/join churn ----------------------------------------------------------
+
+void* noop(void* arg) {
+  return arg;
+} // noop()
+
+// Create batches of threads and join them all, as a fan-out job would. A
+// sample is the time per thread of one batch
+static void bench_create_join(long iterations) {
+  const int batch = 64;
+  int tids[batch];
+  long rounds = iterations / batch;
+  vector<double> samples;
+  long long start = now_ns();
+  for (long r = 0; r < rounds; r++) {
+    long long round_start = now_ns();
+    for (int i = 0; i < batch; i++)
+      tids[i] = uthread_create(noop, nullptr);
+    for (int i = 0; i < batch; i++) {
+      void* res;
+      uthread_join(tids[i], &res);
+    } // for
+    samples.push_back((double) (now_ns() - round_start) / batch);
+  } // for
+  long long elapsed = now_ns() - start;
+  report("create+join", rounds * batch, elapsed);
+  report_stats("create+join", "uthread", samples);
+  cerr << left << setw(32) << "  rss after churn" << right << setw(12)
+       << rss_kb() << " KB" << endl;
+  json_line("create+join: rss after churn", "uthread", "KB", {{"value", (double) rss_kb()}});
+
+  // the pthread baseline, on the cpu of the caller. Its batches are ten
+  // times fewer, a kernel thread costs that much more
+  pthread_attr_t attr;
+  pinned_attr(&attr);
+  pthread_t threads[batch];
+  samples.clear();
+  for (long r = 0; r < max(rounds / 10, 1L); r++) {
+    long long round_start = now_ns();
+    for (int i = 0; i < batch; i++)
+      pthread_create(&threads[i], &attr, noop, nullptr);
+    for (int i = 0; i < batch; i++)
+      pthread_join(threads[i], NULL);
+    samples.push_back((double) (now_ns() - round_start) / batch);
+  } // for
+  pthread_attr_destroy(&attr);
+  report_stats("create+join", "pthread", samples);
+} // bench_create_join()
+
+// Stack memory under churn ----------------------------------------------------
+
+static const int CHURN_WAVE = 512;
+static const int CHURN_TOUCH = 32 * 1024;    // bytes of stack each thread uses
+static int churn_touched;
+static uthread_sem_t churn_go;
+static sem_t churn_go_pthread;
+
+// Uses CHURN_TOUCH bytes of its stack, then waits for the rest of the wave
+void* churn_thread(void* arg) {
+  volatile char buf[CHURN_TOUCH];
+  memset((char*) buf, 1, sizeof(buf));
+  __atomic_fetch_add(&churn_touched, 1, __ATOMIC_RELAXED);
+  if (arg == nullptr)
+    uthread_sem_wait(&churn_go);
+  else
+    sem_wait(&churn_go_pthread);
+  return (void*) (long) buf[0];
+} // churn_thread()
+
+// Waves of threads that each use part of their stack, all live at once, then
+// joined. Reports the resident memory with a wave live and once it is gone,
+// after the last of the rounds: stacks going back to the pool must not pile
+// up resident memory. Cached stacks over the pool's watermark are trimmed
+// with MADV_FREE, which leaves their pages resident until the kernel needs
+// them, so the part of the resident set that is lazily freed is reported too
+static void bench_stack_churn(int rounds) {
+  int tids[CHURN_WAVE];
+  long live = 0, after = 0, lazyfree = 0;
+  uthread_sem_init(&churn_go, 0);
+  for (int r = 0; r < rounds; r++) {
+    churn_touched = 0;
+    for (int i = 0; i < CHURN_WAVE; i++)
+      tids[i] = uthread_create(churn_thread, nullptr);
+    while (__atomic_load_n(&churn_touched, __ATOMIC_RELAXED) < CHURN_WAVE)
+      uthread_yield();
+    live = max(live, rss_kb());
+    for (int i = 0; i < CHURN_WAVE; i++)
+      uthread_sem_post(&churn_go);
+    for (int i = 0; i < CHURN_WAVE; i++) {
+      void* res;
+      uthread_join(tids[i], &res);
+    } // for
+    after = rss_kb();
+    lazyfree = lazyfree_kb();
+  } // for
+  cerr << left << setw(32) << "stack churn: rss live/after" << right << setw(12)
+       << live << " KB" << setw(12) << after << " KB" << setw(12) << lazyfree
+       << " KB lazily freed" << endl;
+  json_line("stack churn", "uthread", "KB", {{"rss_live", (double) live},
+            {"rss_after", (double) after}, {"lazyfree_after", (double) lazyfree}});
+
+  // the pthread baseline, with stacks of the same size
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, STACK_SIZE);
+  pthread_t threads[CHURN_WAVE];
+  sem_init(&churn_go_pthread, 0, 0);
+  live = after = 0;
+  for (int r = 0; r < rounds; r++) {
+    churn_touched = 0;
+    for (int i = 0; i < CHURN_WAVE; i++)
+      pthread_create(&threads[i], &attr, churn_thread, (void*) 1);
+    while (__atomic_load_n(&churn_touched, __ATOMIC_RELAXED) < CHURN_WAVE)
+      sched_yield();
+    live = max(live, rss_kb());
+    for (int i = 0; i < CHURN_WAVE; i++)
+      sem_post(&churn_go_pthread);
+    for (int i = 0; i < CHURN_WAVE; i++)
+      pthread_join(threads[i], NULL);
+    after = rss_kb();
+  } // for
+  sem_destroy(&churn_go_pthread);
+  pthread_attr_destroy(&attr);
+  cerr << left << setw(32) << "stack churn: rss live/after" << right << setw(12)
+       << live << " KB" << setw(12) << after << " KB (pthread)" << endl;
+  json_line("stack churn", "pthread", "KB", {{"rss_live", (double) live}, {"rss_after", (double) after}});
+} // bench_stack_churn()
+
+// Create batches of tasks on the thread pool and wait for them all, the same
+// fan-out as bench_create_join
+static void bench_submit_wait(long iterations) {
+  const int batch = 64;
+  uthread_future_t futures[batch];
+  long rounds = iterations / batch;
+  long long start = now_ns();
+  for (long r = 0; r < rounds; r++) {
+    for (int i = 0; i < batch; i++)
+      uthread_submit(&futures[i], noop, nullptr);
+    for (int i = 0; i < batch; i++) {
+      void* res;
+      uthread_future_wait(&futures[i], &res);
+    } // for
+  } // for
+  long long elapsed = now_ns() - start;
+  report("submit+wait", rounds * batch, elapsed);
+} // bench_submit_wait()
+
+// Scatter/gather ---------------------------------------------------------------
+
+static const int GATHER_BATCH = 64;
+static uthread_sem_t gather_go;
+
+typedef struct gather {
+  int mode;
+  int index;
+  Channel<long>* results;
+  uthread_wg_t* wg;
+  long* slots;
+} gather_t;
+
+// Lets the workers of a batch go one at a time, like replies coming in
+void* gather_releaser(void* arg) {
+  for (int i = 0; i < GATHER_BATCH; i++) {
+    uthread_sem_post(&gather_go);
+    uthread_yield();
+  } // for
+  return nullptr;
+} // gather_releaser()
+
+// Waits for its turn, then reports its result the way the mode says: on a
+// channel, as its return value, or in a slot followed by a wait group
+// count down
+void* gather_worker(void* arg) {
+  gather_t* g = (gather_t*) arg;
+  uthread_sem_wait(&gather_go);
+  if (g->mode == 0)
+    g->results->send(g->index);
+  else if (g->mode == 2) {
+    g->slots[g->index] = g->index;
+    uthread_wg_done(g->wg);
+  } // else if
+  return (void*) (long) g->index;
+} // gather_worker()
+
+// Fan out GATHER_BATCH threads that finish one after the other, and collect
+// their results: receiving each from a channel, joining each, or waiting
+// once on a wait group. The first two wake the collector for every result.
+// Reports the time per thread, the context switches per batch and the p99
+// time of a batch
+static void bench_gather(long iterations, int mode) {
+  static const char* names[] = {"gather: channel", "gather: join", "gather: wait group"};
+  Channel<long> results(GATHER_BATCH);
+  uthread_wg_t wg;
+  long slots[GATHER_BATCH];
+  gather_t args[GATHER_BATCH];
+  int tids[GATHER_BATCH];
+  uthread_sem_init(&gather_go, 0);
+  uthread_attr_t detached;
+  uthread_attr_init(&detached);
+  uthread_attr_setdetachstate(&detached, UTHREAD_CREATE_DETACHED);
+  long rounds = iterations / GATHER_BATCH;
+  long long* round_ns = new long long[rounds];
+  int quantums = uthread_get_total_quantums();
+  long long start = now_ns();
+  for (long r = 0; r < rounds; r++) {
+    long long round_start = now_ns();
+    uthread_wg_init(&wg, GATHER_BATCH);
+    for (int i = 0; i < GATHER_BATCH; i++) {
+      args[i] = {mode, i, &results, &wg, slots};
+      tids[i] = uthread_create_attr(gather_worker, &args[i],
+                                    mode == 2 ? &detached : nullptr);
+    } // for
+    uthread_create_attr(gather_releaser, nullptr, &detached);
+    long sum = 0;
+    if (mode == 0) {
+      for (int i = 0; i < GATHER_BATCH; i++) {
+        long value;
+        results.recv(value);
+        sum += value;
+      } // for
+      for (int i = 0; i < GATHER_BATCH; i++) {
+        void* res;
+        uthread_join(tids[i], &res);
+      } // for
+    } else if (mode == 1) {
+      for (int i = 0; i < GATHER_BATCH; i++) {
+        void* res;
+        uthread_join(tids[i], &res);
+        sum += (long) res;
+      } // for
+    } else {
+      uthread_wg_wait(&wg);
+      for (int i = 0; i < GATHER_BATCH; i++)
+        sum += slots[i];
+    } // else
+    assert(sum == GATHER_BATCH * (GATHER_BATCH - 1) / 2);
+    round_ns[r] = now_ns() - round_start;
+  } // for
+  long long elapsed = now_ns() - start;
+  int switches = uthread_get_total_quantums() - quantums;
+  report(names[mode], rounds * GATHER_BATCH, elapsed);
+  sort(round_ns, round_ns + rounds);
+  cerr << left << setw(32) << "  switches/batch, batch p99" << right << setw(12)
+       << setprecision(1) << (double) switches / rounds << setw(12)
+       << round_ns[rounds * 99 / 100] / 1000 << " us" << endl;
+  json_line(names[mode], "uthread", "us", {{"switches_per_batch", (double) switches / rounds},
+                                           {"batch_p99", round_ns[rounds * 99 / 100] / 1000.0}});
+  delete [] round_ns;
+  uthread_sem_destroy(&gather_go);
+} // bench_gather()
+
+// Request/response -------------------------------------------------------------
+
+static const int RPC_BYSTANDERS = 8;
+static uthread_sem_t rpc_request;
+static uthread_sem_t rpc_response;
+static volatile bool rpc_stop = false;
+static int rpc_server_tid;
+static int rpc_client_tid;
+
+// Ready threads that only yield, queued ahead of any thread woken
+void* rpc_bystander(void* arg) {
+  while (!rpc_stop)
+    uthread_yield();
+  return nullptr;
+} // rpc_bystander()
+
+// Answers requests until it gets a negative one. In mode 2 it yields
+// straight to the client
+void* rpc_server(void* arg) {
+  int mode = (long) arg;
+  while (1) {
+    uthread_sem_wait(&rpc_request);
+    if (rpc_stop)
+      return nullptr;
+    uthread_sem_post(&rpc_response);
+    if (mode == 2)
+      uthread_yield_to(rpc_client_tid);
+  } // while
+} // rpc_server()
+
+// A client and a server trade requests and responses through semaphores
+// while RPC_BYSTANDERS threads keep the ready queue busy. Woken the usual
+// way, each message waits behind the bystanders. The run next slot (mode
+// 1) and uthread_yield_to (mode 2) should get each one across in a single
+// switch. Reports the time and context switches per round trip
+static void bench_request_response(long rounds, int mode) {
+  static const char* names[] = {"request/response", "request/response: run next",
+                                "request/response: yield_to"};
+  uthread_sem_init(&rpc_request, 0);
+  uthread_sem_init(&rpc_response, 0);
+  uthread_set_runnext(mode == 1);
+  rpc_stop = false;
+  rpc_client_tid = uthread_self();
+  rpc_server_tid = uthread_create(rpc_server, (void*) (long) mode);
+  int tids[RPC_BYSTANDERS];
+  for (int i = 0; i < RPC_BYSTANDERS; i++)
+    tids[i] = uthread_create(rpc_bystander, nullptr);
+  // let everyone start
+  uthread_yield();
+  int quantums = uthread_get_total_quantums();
+  long long start = now_ns();
+  for (long r = 0; r < rounds; r++) {
+    uthread_sem_post(&rpc_request);
+    if (mode == 2)
+      uthread_yield_to(rpc_server_tid);
+    uthread_sem_wait(&rpc_response);
+  } // for
+  long long elapsed = now_ns() - start;
+  int switches = uthread_get_total_quantums() - quantums;
+  rpc_stop = true;
+  uthread_sem_post(&rpc_request);
+  void* res;
+  uthread_join(rpc_server_tid, &res);
+  for (int i = 0; i < RPC_BYSTANDERS; i++)
+    uthread_join(tids[i], &res);
+  uthread_set_runnext(0);
+  report(names[mode], rounds, elapsed);
+  cerr << left << setw(32) << "  switches/round trip" << right << setw(12)
+       << setprecision(1) << (double) switches / rounds << endl;
+  json_line(string(names[mode]) + ": switches/round trip", "uthread", "switches",
+            {{"mean", (double) switches / rounds}});
+  uthread_sem_destroy(&rpc_request);
+  uthread_sem_destroy(&rpc_response);
+} // bench_request_response()
+
+// Per-thread operation scaling -------------------------------------------------
+
+// Operations timed together in one sample, as a single one is not much
+// longer than reading the clock
+static const int OPS_PER_SAMPLE = 16;
+
+// Report the time per operation of op on each of n threads
+static void bench_each(const char* what, int n, int* tids, int (*op)(int)) {
+  vector<double> samples;
+  for (int i = 0; i < n; i += OPS_PER_SAMPLE) {
+    long long start = now_ns();
+    for (int j = i; j < i + OPS_PER_SAMPLE && j < n; j++)
+      op(tids[j]);
+    samples.push_back((double) (now_ns() - start) / min(OPS_PER_SAMPLE, n - i));
+  } // for
+  char name[64];
+  snprintf(name, sizeof(name), "%s (%d threads)", what, n);
+  report_stats(name, "uthread", samples);
+} // bench_each()
+
+static int join_one(int tid) {
+  void* res;
+  return uthread_join(tid, &res);
+} // join_one()
+
+// Suspend, resume and join n ready threads, and read the total quantum
+// count while they are all alive. Each operation should cost the same
+// whatever the number of threads. There is no pthread equivalent of these
+static void bench_suspend_resume_join(int n) {
+  int* tids = new int[n];
+  for (int i = 0; i < n; i++)
+    tids[i] = uthread_create(noop, nullptr);
+  vector<double> samples;
+  for (int s = 0; s < BENCH_SAMPLES; s++) {
+    long long start = now_ns();
+    for (int i = 0; i < OPS_PER_SAMPLE; i++)
+      uthread_get_total_quantums();
+    samples.push_back((double) (now_ns() - start) / OPS_PER_SAMPLE);
+  } // for
+  char name[64];
+  snprintf(name, sizeof(name), "total quantums (%d threads)", n);
+  report_stats(name, "uthread", samples);
+  bench_each("suspend", n, tids, uthread_suspend);
+  bench_each("resume", n, tids, uthread_resume);
+  bench_each("join", n, tids, join_one);
+  delete [] tids;
+} // bench_suspend_resume_join()
+
+// Statistics ------------------------------------------------------------------
+
+// Take a snapshot of the scheduler statistics, and format it for a scrape
+static void bench_stats(long iterations) {
+  uthread_stats_t stats;
+  long long start = now_ns();
+  for (long i = 0; i < iterations; i++)
+    uthread_stats(&stats);
+  report("uthread_stats", iterations, now_ns() - start);
+  char text[8192];
+  start = now_ns();
+  for (long i = 0; i < iterations; i++)
+    uthread_stats_format(&stats, text, sizeof(text));
+  report("uthread_stats_format", iterations, now_ns() - start);
+} // bench_stats()
+
+// Mutex contention ------------------------------------------------------------
+
+// Lock and unlock a mutex nobody else uses
+static void bench_mutex_uncontended(long iterations) {
+  uthread_mutex_t mutex;
+  uthread_mutex_init(&mutex);
+  long long start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    uthread_mutex_lock(&mutex);
+    uthread_mutex_unlock(&mutex);
+  } // for
+  report("uthread_mutex uncontended", iterations, now_ns() - start);
+
+  pthread_mutex_t pmutex = PTHREAD_MUTEX_INITIALIZER;
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    pthread_mutex_lock(&pmutex);
+    pthread_mutex_unlock(&pmutex);
+  } // for
+  report("pthread_mutex uncontended", iterations, now_ns() - start, "pthread");
+} // bench_mutex_uncontended()
+
+// Threads that yield while holding the lock, so every acquisition after the
+// first of a round finds it taken and has to block
+static const int CONTENDERS = 4;
+
+typedef struct contention {
+  long iterations;
+  long counter;
+  uthread_mutex_t mutex;
+  pthread_mutex_t pmutex;
+} contention_t;
+
+void* uthread_contender(void* arg) {
+  contention_t* c = (contention_t*) arg;
+  for (long i = 0; i < c->iterations; i++) {
+    uthread_mutex_lock(&c->mutex);
+    c->counter++;
+    uthread_yield();
+    uthread_mutex_unlock(&c->mutex);
+  } // for
+  return nullptr;
+} // uthread_contender()
+
+void* pthread_contender(void* arg) {
+  contention_t* c = (contention_t*) arg;
+  for (long i = 0; i < c->iterations; i++) {
+    pthread_mutex_lock(&c->pmutex);
+    c->counter++;
+    sched_yield();
+    pthread_mutex_unlock(&c->pmutex);
+  } // for
+  return nullptr;
+} // pthread_contender()
+
+static void bench_mutex_contended(long iterations) {
+  contention_t c;
+  c.iterations = iterations / CONTENDERS;
+  c.counter = 0;
+  uthread_mutex_init(&c.mutex);
+  int tids[CONTENDERS];
+  long long start = now_ns();
+  for (int i = 0; i < CONTENDERS; i++)
+    tids[i] = uthread_create(uthread_contender, &c);
+  for (int i = 0; i < CONTENDERS; i++) {
+    void* res;
+    uthread_join(tids[i], &res);
+  } // for
+  report("uthread_mutex contended", c.counter, now_ns() - start);
+
+  // the pthreads all run on the cpu of the caller, as the uthreads do
+  c.counter = 0;
+  pthread_mutex_init(&c.pmutex, NULL);
+  pthread_attr_t attr;
+  pinned_attr(&attr);
+  pthread_t threads[CONTENDERS];
+  start = now_ns();
+  for (int i = 0; i < CONTENDERS; i++)
+    pthread_create(&threads[i], &attr, pthread_contender, &c);
+  for (int i = 0; i < CONTENDERS; i++)
+    pthread_join(threads[i], NULL);
+  report("pthread_mutex contended", c.counter, now_ns() - start, "pthread");
+  pthread_attr_destroy(&attr);
+  pthread_mutex_destroy(&c.pmutex);
+} // bench_mutex_contended()
+
+// Loopback echo server --------------------------------------------------------
+
+static const int ECHO_CONNECTIONS = 64;
+static const int ECHO_MESSAGE = 64;
+
+typedef struct echo {
+  int listen_fd;
+  struct sockaddr_in addr;
+  long requests;            // per connection
+  long long* latencies;     // ns, one per request
+} echo_t;
+
+// Echo everything read on a connection until the client closes it
+void* echo_handler(void* arg) {
+  int fd = (int) (long) arg;
+  char buf[ECHO_MESSAGE];
+  ssize_t n;
+  while ((n = uthread_read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t done = 0; done < n; ) {
+      ssize_t w = uthread_write(fd, buf + done, n - done);
+      if (w <= 0)
+        break;
+      done += w;
+    } // for
+  } // while
+  uthread_close(fd);
+  return nullptr;
+} // echo_handler()
+
+// Accept every client connection, each served by its own thread
+void* echo_server(void* arg) {
+  echo_t* e = (echo_t*) arg;
+  int tids[ECHO_CONNECTIONS];
+  for (int i = 0; i < ECHO_CONNECTIONS; i++) {
+    int fd = uthread_accept(e->listen_fd, nullptr, nullptr);
+    if (fd == -1) {
+      cerr << "uthread_accept failed" << endl;
+      exit(1);
+    } // if
+    tids[i] = uthread_create(echo_handler, (void*) (long) fd);
+  } // for
+  for (int i = 0; i < ECHO_CONNECTIONS; i++) {
+    void* res;
+    uthread_join(tids[i], &res);
+  } // for
+  return nullptr;
+} // echo_server()
+
+// Send requests one at a time and time each round trip
+void* echo_client(void* arg) {
+  echo_t* e = (echo_t*) ((void**) arg)[0];
+  long long* latencies = (long long*) ((void**) arg)[1];
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1 || uthread_connect(fd, (struct sockaddr*) &e->addr, sizeof(e->addr)) == -1) {
+    cerr << "uthread_connect failed" << endl;
+    exit(1);
+  } // if
+  char buf[ECHO_MESSAGE] = {0};
+  for (long r = 0; r < e->requests; r++) {
+    long long start = now_ns();
+    if (uthread_write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+      cerr << "uthread_write failed" << endl;
+      exit(1);
+    } // if
+    for (ssize_t got = 0; got < (ssize_t) sizeof(buf); ) {
+      ssize_t n = uthread_read(fd, buf + got, sizeof(buf) - got);
+      if (n <= 0) {
+        cerr << "uthread_read failed" << endl;
+        exit(1);
+      } // if
+      got += n;
+    } // for
+    latencies[r] = now_ns() - start;
+  } // for
+  uthread_close(fd);
+  return nullptr;
+} // echo_client()
+
+// ECHO_CONNECTIONS clients and their server threads, all on one kernel thread
+static void bench_echo(long requests) {
+  echo_t e;
+  e.requests = requests / ECHO_CONNECTIONS;
+  e.latencies = new long long[ECHO_CONNECTIONS * e.requests];
+  e.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  memset(&e.addr, 0, sizeof(e.addr));
+  e.addr.sin_family = AF_INET;
+  e.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(e.addr);
+  if (e.listen_fd == -1 || bind(e.listen_fd, (struct sockaddr*) &e.addr, len) == -1 ||
+      listen(e.listen_fd, ECHO_CONNECTIONS) == -1 ||
+      getsockname(e.listen_fd, (struct sockaddr*) &e.addr, &len) == -1) {
+    cerr << "failed to set up the echo server socket" << endl;
+    exit(1);
+  } // if
+  void* args[ECHO_CONNECTIONS][2];
+  int tids[ECHO_CONNECTIONS];
+  long long start = now_ns();
+  int server = uthread_create(echo_server, &e);
+  for (int i = 0; i < ECHO_CONNECTIONS; i++) {
+    args[i][0] = &e;
+    args[i][1] = e.latencies + i * e.requests;
+    tids[i] = uthread_create(echo_client, args[i]);
+  } // for
+  void* res;
+  for (int i = 0; i < ECHO_CONNECTIONS; i++)
+    uthread_join(tids[i], &res);
+  uthread_join(server, &res);
+  long long elapsed = now_ns() - start;
+  uthread_close(e.listen_fd);
+
+  long total = ECHO_CONNECTIONS * e.requests;
+  sort(e.latencies, e.latencies + total);
+  cerr << left << setw(32) << "echo (64 connections)" << right << setw(12) << total
+       << " req" << setw(12) << fixed << setprecision(0)
+       << total / (elapsed / 1e9) << " req/s" << endl;
+  cerr << left << setw(32) << "  latency p50/p99" << right << setw(12)
+       << e.latencies[total / 2] / 1000 << " us" << setw(12)
+       << e.latencies[total * 99 / 100] / 1000 << " us" << endl;
+  json_line("echo (64 connections)", "uthread", "req/s",
+            {{"value", total / (elapsed / 1e9)}, {"latency_p50_us", e.latencies[total / 2] / 1000.0},
+             {"latency_p99_us", e.latencies[total * 99 / 100] / 1000.0}});
+  delete [] e.latencies;
+} // bench_echo()
+
+// Sleepers --------------------------------------------------------------------
+
+static uthread_sem_t sleepers_go;
+
+// Each sleeper records how late it woke up past its deadline
+void* sleeper(void* arg) {
+  long long* lateness = (long long*) arg;
+  long long duration = *lateness;
+  uthread_sem_wait(&sleepers_go);
+  long long deadline = now_ns() + duration;
+  uthread_sleep_ns(duration);
+  *lateness = now_ns() - deadline;
+  return nullptr;
+} // sleeper()
+
+// n threads sleeping 1-1000 ms at once. They use small unguarded stacks: a
+// guarded stack takes two memory mappings and the kernel limits a process
+// to about 65k of them. All sleepers start (and fault in their stacks)
+// before any goes to sleep. The process CPU time shows whether the
+// scheduler slept or spun while waiting for the deadlines
+static void bench_sleepers(int n) {
+  uthread_attr_t attr;
+  uthread_attr_init(&attr);
+  uthread_attr_setstacksize(&attr, 32 * 1024);
+  uthread_attr_setguardsize(&attr, 0);
+  long long* lateness = new long long[n];
+  int* tids = new int[n];
+  uthread_sem_init(&sleepers_go, 0);
+  for (int i = 0; i < n; i++) {
+    lateness[i] = (i % 1000 + 1) * 1000000LL;
+    tids[i] = uthread_create_attr(sleeper, lateness + i, &attr);
+    if (tids[i] == -1) {
+      cerr << "uthread_create failed after " << i << " threads" << endl;
+      exit(1);
+    } // if
+  } // for
+  // a sleep of our own lets every sleeper run up to the semaphore. The
+  // sleepers released first wait behind the rest of the wave when they
+  // wake, which is what the tail of the lateness shows
+  uthread_sleep_ns(1000000LL);
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  long long start = now_ns();
+  for (int i = 0; i < n; i++)
+    uthread_sem_post(&sleepers_go);
+  void* res;
+  for (int i = 0; i < n; i++)
+    uthread_join(tids[i], &res);
+  long long elapsed = now_ns() - start;
+  getrusage(RUSAGE_SELF, &after);
+  long long cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec +
+                   after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000LL +
+                  after.ru_utime.tv_usec - before.ru_utime.tv_usec +
+                  after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+
+  sort(lateness, lateness + n);
+  cerr << left << setw(32) << "sleepers (1-1000 ms)" << right << setw(12) << n
+       << " thr" << setw(12) << elapsed / 1000000 << " ms wall"
+       << setw(10) << cpu / 1000 << " ms cpu" << endl;
+  cerr << left << setw(32) << "  lateness p50/p99/max" << right << setw(12)
+       << lateness[n / 2] / 1000 << " us" << setw(12)
+       << lateness[(long) n * 99 / 100] / 1000 << " us" << setw(12)
+       << lateness[n - 1] / 1000 << " us" << endl;
+  json_line("sleepers (1-1000 ms)", "uthread", "us",
+            {{"lateness_p50", lateness[n / 2] / 1000.0},
+             {"lateness_p99", lateness[(long) n * 99 / 100] / 1000.0},
+             {"lateness_max", lateness[n - 1] / 1000.0}, {"cpu_ms", cpu / 1000.0}});
+  delete [] tids;
+  delete [] lateness;
+} // bench_sleepers()
+
+// Channel pipeline ------------------------------------------------------------
+
+static const int PIPELINE_STAGES = 4;
+
+typedef struct stage {
+  Channel<long>* in;
+  Channel<long>* out;
+  long messages;
+} stage_t;
+
+void* pipeline_source(void* arg) {
+  stage_t* s = (stage_t*) arg;
+  for (long i = 0; i < s->messages; i++)
+    s->out->send(i);
+  s->out->close();
+  return nullptr;
+} // pipeline_source()
+
+void* pipeline_stage(void* arg) {
+  stage_t* s = (stage_t*) arg;
+  long value;
+  while (s->in->recv(value))
+    s->out->send(value + 1);
+  s->out->close();
+  return nullptr;
+} // pipeline_stage()
+
+// A source, PIPELINE_STAGES stages and this thread as the sink, connected
+// by channels of the given capacity. Counts messages out of the sink
+static void bench_pipeline(long messages, size_t capacity) {
+  Channel<long>* chans[PIPELINE_STAGES + 1];
+  for (int i = 0; i <= PIPELINE_STAGES; i++)
+    chans[i] = new Channel<long>(capacity);
+  stage_t stages[PIPELINE_STAGES + 1];
+  int tids[PIPELINE_STAGES + 1];
+  long long start = now_ns();
+  for (int i = 0; i <= PIPELINE_STAGES; i++) {
+    stages[i].in = i > 0 ? chans[i - 1] : nullptr;
+    stages[i].out = chans[i];
+    stages[i].messages = messages;
+    tids[i] = uthread_create(i == 0 ? pipeline_source : pipeline_stage, &stages[i]);
+  } // for
+  long value, sum = 0;
+  while (chans[PIPELINE_STAGES]->recv(value))
+    sum += value;
+  long long elapsed = now_ns() - start;
+  void* res;
+  for (int i = 0; i <= PIPELINE_STAGES; i++)
+    uthread_join(tids[i], &res);
+  if (sum != messages * (messages - 1) / 2 + messages * PIPELINE_STAGES) {
+    cerr << "pipeline lost messages" << endl;
+    exit(1);
+  } // if
+  for (int i = 0; i <= PIPELINE_STAGES; i++)
+    delete chans[i];
+  string name = "pipeline (" + to_string(PIPELINE_STAGES) + " stages, cap " +
+                to_string(capacity) + ")";
+  cerr << left << setw(32) << name << right << setw(12) << messages
+       << " msg" << setw(12) << fixed << setprecision(0)
+       << messages / (elapsed / 1e9) << " msg/s" << endl;
+  json_line(name, "uthread", "msg/s", {{"value", messages / (elapsed / 1e9)}});
+} // bench_pipeline()
+
+// External wakeups -----------------------------------------------------------
+
+typedef struct wakeup {
+  uthread_sem_t sem;
+  long rounds;
+  long long* posted;        // when each post was made
+} wakeup_t;
+
+// A kernel thread outside the library posts once a millisecond
+void* wakeup_poster(void* arg) {
+  wakeup_t* w = (wakeup_t*) arg;
+  for (long r = 0; r < w->rounds; r++) {
+    usleep(1000);
+    w->posted[r] = now_ns();
+    uthread_sem_post(&w->sem);
+  } // for
+  return nullptr;
+} // wakeup_poster()
+
+// A thread woken by a kernel thread that runs no uthreads, with nothing else
+// to run in between: the worker sleeps, so the CPU time should stay far
+// below the wall time while the wake-up latency stays low
+static void bench_external_wakeup(long rounds) {
+  wakeup_t w;
+  uthread_sem_init(&w.sem, 0);
+  w.rounds = rounds;
+  w.posted = new long long[rounds];
+  long long* latencies = new long long[rounds];
+  struct rusage before, after;
+  getrusage(RUSAGE_SELF, &before);
+  long long start = now_ns();
+  pthread_t poster;
+  pthread_create(&poster, NULL, wakeup_poster, &w);
+  for (long r = 0; r < rounds; r++) {
+    uthread_sem_wait(&w.sem);
+    latencies[r] = now_ns() - w.posted[r];
+  } // for
+  pthread_join(poster, NULL);
+  long long elapsed = now_ns() - start;
+  getrusage(RUSAGE_SELF, &after);
+  long long cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec +
+                   after.ru_stime.tv_sec - before.ru_stime.tv_sec) * 1000000LL +
+                  after.ru_utime.tv_usec - before.ru_utime.tv_usec +
+                  after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+
+  sort(latencies, latencies + rounds);
+  cerr << left << setw(32) << "external wakeup (every 1 ms)" << right << setw(12) << rounds
+       << " ops" << setw(12) << elapsed / 1000000 << " ms wall"
+       << setw(10) << cpu / 1000 << " ms cpu" << endl;
+  cerr << left << setw(32) << "  latency p50/p99" << right << setw(12)
+       << latencies[rounds / 2] / 1000 << " us" << setw(12)
+       << latencies[rounds * 99 / 100] / 1000 << " us" << endl;
+  json_line("external wakeup (every 1 ms)", "uthread", "us",
+            {{"latency_p50", latencies[rounds / 2] / 1000.0},
+             {"latency_p99", latencies[rounds * 99 / 100] / 1000.0}, {"cpu_ms", cpu / 1000.0}});
+  delete [] latencies;
+  delete [] w.posted;
+} // bench_external_wakeup()
+
+// Mixed workload --------------------------------------------------------------
+
+static const int MIXED_BATCH = 4;
+static const int MIXED_INTERACTIVE = 4;
+static const long MIXED_WAKEUPS = 1000;       // per interactive thread
+static volatile bool mixed_stop = false;
+
+// Spins until told to stop, counting units of work
+void* batch_thread(void* arg) {
+  long* units = (long*) arg;
+  while (!mixed_stop) {
+    for (volatile int i = 0; i < 1000; i++)
+      ;
+    (*units)++;
+  } // while
+  return nullptr;
+} // batch_thread()
+
+// Sleeps 1 ms at a time, recording how late it woke up each time. Asks
+// for the highest priority, which only UTHREAD_SCHED_PRIO looks at
+void* interactive_thread(void* arg) {
+  long long* lateness = (long long*) arg;
+  uthread_setprio(uthread_self(), 0);
+  for (long i = 0; i < MIXED_WAKEUPS; i++) {
+    long long deadline = now_ns() + 1000000;
+    uthread_sleep_ns(1000000);
+    lateness[i] = now_ns() - deadline;
+  } // for
+  return nullptr;
+} // interactive_thread()
+
+// MIXED_BATCH cpu bound threads share one worker with MIXED_INTERACTIVE
+// threads that wake up every millisecond, preempted every millisecond.
+// Reports the wake-up lateness of the interactive threads and the work
+// done by the batch threads meanwhile
+static void bench_mixed(const char* name) {
+  long units[MIXED_BATCH] = {0};
+  long long* lateness = new long long[MIXED_INTERACTIVE * MIXED_WAKEUPS];
+  int batch_tids[MIXED_BATCH];
+  int interactive_tids[MIXED_INTERACTIVE];
+  long long start = now_ns();
+  for (int i = 0; i < MIXED_BATCH; i++)
+    batch_tids[i] = uthread_create(batch_thread, &units[i]);
+  for (int i = 0; i < MIXED_INTERACTIVE; i++)
+    interactive_tids[i] = uthread_create(interactive_thread, &lateness[i * MIXED_WAKEUPS]);
+  for (int i = 0; i < MIXED_INTERACTIVE; i++) {
+    void* res;
+    uthread_join(interactive_tids[i], &res);
+  } // for
+  mixed_stop = true;
+  long long elapsed = now_ns() - start;
+  long total = 0;
+  for (int i = 0; i < MIXED_BATCH; i++) {
+    void* res;
+    uthread_join(batch_tids[i], &res);
+    total += units[i];
+  } // for
+  long n = MIXED_INTERACTIVE * MIXED_WAKEUPS;
+  sort(lateness, lateness + n);
+  cerr << left << setw(32) << name << right << setw(12)
+       << total * 1000000000LL / elapsed << " units/s (batch)" << endl;
+  cerr << left << setw(32) << "  wakeup lateness p50/p99" << right << setw(12)
+       << lateness[n / 2] / 1000 << " us" << setw(12)
+       << lateness[n * 99 / 100] / 1000 << " us" << endl;
+  json_line(name, "uthread", "us", {{"batch_units_per_s", (double) total * 1000000000LL / elapsed},
+                                    {"lateness_p50", lateness[n / 2] / 1000.0},
+                                    {"lateness_p99", lateness[n * 99 / 100] / 1000.0}});
+  delete [] lateness;
+} // bench_mixed()
+
+// Run bench_mixed under each scheduling policy, each in a child process as
+// the policy is fixed once the library is initialized
+static void bench_policies() {
+  const int policies[] = {UTHREAD_SCHED_RR, UTHREAD_SCHED_PRIO, UTHREAD_SCHED_MLFQ};
+  const char* names[] = {"mixed: round robin", "mixed: priorities", "mixed: mlfq"};
+  for (int i = 0; i < 3; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (uthread_init_sched(1000, 1, policies[i]) != 0) {
+        cerr << "uthread_init_sched failed" << endl;
+        exit(1);
+      } // if
+      bench_mixed(names[i]);
+      exit(0);
+    } // if
+    waitpid(pid, nullptr, 0);
+  } // for
+} // bench_policies()
+
+// CPU quotas ------------------------------------------------------------------
+
+// A noisy tenant of MIXED_BATCH cpu bound threads shares a worker with a
+// tenant of as many, for one second, with and without a quota of 10 ms
+// every 50 ms on the noisy one. Reports the work each tenant got done and
+// the noisy tenant's share of the cpu time. In a child process, as the
+// benchmarks otherwise run without preemption
+static void bench_quota() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (uthread_init(1000) != 0) {
+      cerr << "uthread_init failed" << endl;
+      exit(1);
+    } // if
+    for (int capped = 0; capped < 2; capped++) {
+      long units[2][MIXED_BATCH] = {{0}};
+      int tids[2][MIXED_BATCH];
+      uthread_quota_t quota;
+      uthread_quota_init(&quota, 10000000, 50000000);
+      mixed_stop = false;
+      for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < MIXED_BATCH; i++) {
+          tids[t][i] = uthread_create(batch_thread, &units[t][i]);
+          if (t == 0 && capped)
+            uthread_setquota(tids[t][i], &quota);
+        } // for
+      } // for
+      uthread_sleep_ns(1000000000);
+      mixed_stop = true;
+      long total[2] = {0, 0};
+      long long cputime[2] = {0, 0};
+      for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < MIXED_BATCH; i++) {
+          cputime[t] += uthread_get_cputime(tids[t][i]);
+          void* res;
+          uthread_join(tids[t][i], &res);
+          total[t] += units[t][i];
+        } // for
+      } // for
+      cerr << left << setw(32) << (capped ? "quota: noisy tenant capped" : "quota: no cap")
+           << right << setw(12) << total[0] << setw(12) << total[1] << " units (noisy/other)" << endl;
+      cerr << left << setw(32) << "  noisy share of cpu time" << right << setw(12)
+           << fixed << setprecision(1) << 100.0 * cputime[0] / (cputime[0] + cputime[1]) << " %" << endl;
+      json_line(capped ? "quota: noisy tenant capped" : "quota: no cap", "uthread", "%",
+                {{"noisy_share", 100.0 * cputime[0] / (cputime[0] + cputime[1])}});
+      uthread_quota_destroy(&quota);
+    } // for
+    exit(0);
+  } // if
+  waitpid(pid, nullptr, 0);
+} // bench_quota()
+
+// Cooperative scheduling ------------------------------------------------------
+
+// Switch cost of the uthread library with cooperative scheduling, next to
+// the preemptive yield ping-pong (in a child process, as the quantum is
+// fixed once the library is initialized)
+static void bench_cooperative(long iterations) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (uthread_init(0) != 0) {
+      cerr << "uthread_init failed" << endl;
+      exit(1);
+    } // if
+    bench_yield_pingpong(iterations, "uthread_yield, cooperative");
+    exit(0);
+  } // if
+  waitpid(pid, nullptr, 0);
+} // bench_cooperative()
+
+// Preemption overhead ---------------------------------------------------------
+
+static const int PREEMPT_THREADS = 4;
+static const long PREEMPT_WORK = 5000000;     // loop iterations per thread
+static const int PREEMPT_RUNS = 10;
+
+// A fixed amount of cpu bound work, the same for a uthread or a pthread
+void* fixed_work(void* arg) {
+  for (volatile long i = 0; i < PREEMPT_WORK; i++)
+    ;
+  return nullptr;
+} // fixed_work()
+
+// PREEMPT_THREADS threads share one worker for PREEMPT_WORK each, with no
+// preemption and preempted every 10 ms, 1 ms and 100 us, each in a child
+// process as the quantum is fixed once the library is initialized. Run
+// times above the cooperative ones are what preemption costs. The baseline
+// runs the same threads as pthreads on one cpu, preempted by the kernel.
+// The kernel checks cpu time timers on its scheduler tick, so a quantum
+// shorter than a tick preempts once a tick, as switches/run shows
+static void bench_preemption() {
+  const int quantums[] = {0, 10000, 1000, 100};
+  for (int q = 0; q < 4; q++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      if (uthread_init(quantums[q]) != 0) {
+        cerr << "uthread_init failed" << endl;
+        exit(1);
+      } // if
+      vector<double> samples;
+      int quantums_start = uthread_get_total_quantums();
+      for (int r = 0; r < PREEMPT_RUNS; r++) {
+        int tids[PREEMPT_THREADS];
+        long long start = now_ns();
+        for (int i = 0; i < PREEMPT_THREADS; i++)
+          tids[i] = uthread_create(fixed_work, nullptr);
+        for (int i = 0; i < PREEMPT_THREADS; i++) {
+          void* res;
+          uthread_join(tids[i], &res);
+        } // for
+        samples.push_back((now_ns() - start) / 1e6);
+      } // for
+      double switches = (double) (uthread_get_total_quantums() - quantums_start) / PREEMPT_RUNS;
+      string name = quantums[q] == 0 ? string("preemption: none") :
+                    "preemption: quantum " + to_string(quantums[q]) + " us";
+      report_stats(name, "uthread", samples, "ms/run");
+      cerr << left << setw(32) << "  switches/run" << right << setw(12)
+           << fixed << setprecision(1) << switches << endl;
+      json_line(name + ": switches/run", "uthread", "switches", {{"mean", switches}});
+      exit(0);
+    } // if
+    waitpid(pid, nullptr, 0);
+  } // for
+
+  pthread_attr_t attr;
+  pinned_attr(&attr);
+  vector<double> samples;
+  for (int r = 0; r < PREEMPT_RUNS; r++) {
+    pthread_t threads[PREEMPT_THREADS];
+    long long start = now_ns();
+    for (int i = 0; i < PREEMPT_THREADS; i++)
+      pthread_create(&threads[i], &attr, fixed_work, nullptr);
+    for (int i = 0; i < PREEMPT_THREADS; i++)
+      pthread_join(threads[i], NULL);
+    samples.push_back((now_ns() - start) / 1e6);
+  } // for
+  pthread_attr_destroy(&attr);
+  report_stats("preemption: kernel", "pthread", samples, "ms/run");
+} // bench_preemption()
+
+// Pi workload -----------------------------------------------------------------
+
+static const long PI_POINTS = 2000000;
+static const int PI_THREADS = 8;
+static const int PI_RUNS = 10;
+
+typedef struct pi {
+  unsigned int seed;
+  unsigned long inside;
+} pi_t;
+
+// The loop of the pi example (main.cpp), over PI_POINTS / PI_THREADS points
+void* pi_worker(void* arg) {
+  pi_t* p = (pi_t*) arg;
+  unsigned long local_cnt = 0;
+  unsigned int rand_state = p->seed;
+  for (long i = 0; i < PI_POINTS / PI_THREADS; i++) {
+    double x = rand_r(&rand_state) / ((double)RAND_MAX + 1) * 2.0 - 1.0;
+    double y = rand_r(&rand_state) / ((double)RAND_MAX + 1) * 2.0 - 1.0;
+    if (x * x + y * y < 1)
+      local_cnt++;
+  } // for
+  p->inside = local_cnt;
+  return nullptr;
+} // pi_worker()
+
+// Estimate pi with PI_THREADS uthreads or pthreads, returning the run time
+// in ms. The estimate is checked, so the work cannot be skipped
+static double pi_run(bool pthreads, pthread_attr_t* attr) {
+  pi_t parts[PI_THREADS];
+  int tids[PI_THREADS];
+  pthread_t threads[PI_THREADS];
+  long long start = now_ns();
+  for (int i = 0; i < PI_THREADS; i++) {
+    parts[i].seed = i + 1;
+    if (pthreads)
+      pthread_create(&threads[i], attr, pi_worker, &parts[i]);
+    else
+      tids[i] = uthread_create(pi_worker, &parts[i]);
+  } // for
+  unsigned long inside = 0;
+  for (int i = 0; i < PI_THREADS; i++) {
+    void* res;
+    if (pthreads)
+      pthread_join(threads[i], NULL);
+    else
+      uthread_join(tids[i], &res);
+    inside += parts[i].inside;
+  } // for
+  double elapsed = (now_ns() - start) / 1e6;
+  double pi = 4.0 * inside / (PI_POINTS / PI_THREADS * PI_THREADS);
+  if (pi < 3.1 || pi > 3.2) {
+    cerr << "pi estimate " << pi << " is off" << endl;
+    exit(1);
+  } // if
+  return elapsed;
+} // pi_run()
+
+// The pi example as ./pi runs it by default: a 1 ms quantum on one worker,
+// in a child process. The baseline runs the same loop on as many pthreads
+// on one cpu
+static void bench_pi() {
+  string name = "pi (" + to_string(PI_THREADS) + " threads)";
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (uthread_init(1000) != 0) {
+      cerr << "uthread_init failed" << endl;
+      exit(1);
+    } // if
+    vector<double> samples;
+    for (int r = 0; r < PI_RUNS; r++)
+      samples.push_back(pi_run(false, nullptr));
+    report_stats(name, "uthread", samples, "ms/run");
+    exit(0);
+  } // if
+  waitpid(pid, nullptr, 0);
+
+  pthread_attr_t attr;
+  pinned_attr(&attr);
+  vector<double> samples;
+  for (int r = 0; r < PI_RUNS; r++)
+    samples.push_back(pi_run(true, &attr));
+  pthread_attr_destroy(&attr);
+  report_stats(name, "pthread", samples, "ms/run");
+} // bench_pi()
+
+int main(int argc, char *argv[]) {
+  // Use a long quantum so preemption does not interfere with the measurement
+  int quantum_usecs = 1000000;
+  long iterations = 1000000;
+
+  // ./uthread-bench [--json] [iterations] [quantum_usecs]
+  int positional = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0)
+      json_output = true;
+    else if (positional++ == 0)
+      iterations = atol(argv[i]);
+    else
+      quantum_usecs = atoi(argv[i]);
+  } // for
+
+  // before this process starts any user threads. The pthread baselines
+  // have all been joined by the time a benchmark forks
+  bench_policies();
+  bench_quota();
+  bench_cooperative(iterations);
+  bench_preemption();
+  bench_pi();
+  bench_pthread_pingpong(iterations / 10);
+
+  if (uthread_init(quantum_usecs) != 0) {
+    cerr << "uthread_init failed" << endl;
+    exit(1);
+  } // if
+
+  bench_yield_pingpong(iterations);
+  // the same with every switch recorded, when tracing is compiled in
+  if (uthread_trace_start(65536) == 0) {
+    bench_yield_pingpong(iterations, "yield ping-pong, traced");
+    uthread_trace_stop();
+  } // if
+  bench_create_join(iterations / 10);
+  bench_stack_churn(10);
+  bench_submit_wait(iterations);
+  for (int mode = 0; mode < 3; mode++)
+    bench_gather(iterations / 10, mode);
+  for (int mode = 0; mode < 3; mode++)
+    bench_request_response(iterations / 10, mode);
+  for (int n = 256; n <= 65536; n *= 16)
+    bench_suspend_resume_join(n);
+  bench_stats(iterations / 100);
+  bench_mutex_uncontended(iterations);
+  bench_mutex_contended(iterations / 10);
+  bench_echo(iterations / 10);
+  bench_pipeline(iterations, 0);
+  bench_pipeline(iterations, 64);
+  bench_sleepers(100000);
+  bench_external_wakeup(1000);
+
+  return 0;
+} // main()
@@ -0,0 +1,187 @@
+#include "uthread.h"
+#include <iostream>
+#include <iomanip>
+#include <cassert>
+#include <cstdlib>
+#include <time.h>
+#include <unistd.h>
+#include <cstdio>
+#include <sys/resource.h>
+
+using namespace std;
+
+// Stress test: create a large number of threads that are all alive at once,
+// then join them. Stacks are only allocated once a thread runs, and go back
+// to the pool when it finishes, so memory stays proportional to the number
+// of threads rather than to the number of stacks.
+
+static double seconds_since(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+} // seconds_since()
+
+static long max_rss_mb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024;
+} // max_rss_mb()
+
+// Resident memory now, in MB
+static double rss_mb() {
+  long size, pages = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm != nullptr) {
+    if (fscanf(statm, "%ld %ld", &size, &pages) != 2)
+      pages = 0;
+    fclose(statm);
+  } // if
+  return pages * (double) sysconf(_SC_PAGESIZE) / (1024 * 1024);
+} // rss_mb()
+
+void* identity(void* arg) {
+  return arg;
+} // identity()
+
+uthread_sem_t detached_done;
+uthread_sem_t deep_blocked;
+uthread_sem_t deep_release;
+
+static void __attribute__((noinline)) go_deep() {
+  volatile char buf[32768];
+  for (size_t i = 0; i < sizeof(buf); i++)
+    buf[i] = (char) i;
+} // go_deep()
+
+// goes 32 KB deep, then blocks until released
+void* deep_blocker(void* arg) {
+  go_deep();
+  uthread_sem_post(&deep_blocked);
+  uthread_sem_wait(&deep_release);
+  return arg;
+} // deep_blocker()
+
+void* detached(void* arg) {
+  uthread_sem_post(&detached_done);
+  return arg;
+} // detached()
+
+int main(int argc, char *argv[]) {
+  long num_threads = 1000000;
+  if (argc >= 2)
+    num_threads = atol(argv[1]);
+
+  int res = uthread_init(100000);
+  if (res != 0) {
+    cerr << "uthread_init failed" << endl;
+    exit(1);
+  } // if
+
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Creating and joining " << num_threads << " threads\n" << endl;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int* tids = new int[num_threads];
+  for (long i = 0; i < num_threads; i++) {
+    tids[i] = uthread_create(identity, (void*) i);
+    if (tids[i] == -1) {
+      cerr << "uthread_create failed after " << i << " threads" << endl;
+      exit(1);
+    } // if
+  } // for
+  cerr << "Created " << num_threads << " threads in "
+       << seconds_since(&start) << " s" << endl;
+
+  for (long i = 0; i < num_threads; i++) {
+    void* ret = nullptr;
+    res = uthread_join(tids[i], &ret);
+    if (res != 0 || (long) ret != i) {
+      cerr << "uthread_join failed for thread " << tids[i] << endl;
+      exit(1);
+    } // if
+  } // for
+  cerr << "Created and joined " << num_threads << " threads in "
+       << seconds_since(&start) << " s, max RSS " << max_rss_mb() << " MB" << endl;
+
+  // The joined tids are stale now. Create threads until one reuses the slot
+  // of the first tid: a join through the stale tid must not touch it
+  cerr << "\nChecking that a stale tid does not reach a reused slot" << endl;
+  int stale = tids[0];
+  int reused = -1;
+  for (long i = 0; reused == -1; i++) {
+    int tid = uthread_create(identity, nullptr);
+    if (tid % MAX_THREAD_NUM == stale % MAX_THREAD_NUM)
+      reused = tid;
+    else
+      tids[i] = tid;
+    if (reused != -1) {
+      // join the threads created before the one that reused the slot
+      for (long j = 0; j < i; j++) {
+        void* ret;
+        uthread_join(tids[j], &ret);
+      } // for
+    } // if
+  } // for
+  void* ret = (void*) -1;
+  assert(uthread_get_quantums(stale) == -1);
+  assert(uthread_join(stale, &ret) == 0 && ret == (void*) -1);
+  assert(uthread_join(reused, &ret) == 0 && ret == nullptr);
+  cerr << "Stale tid " << stale << " and reused tid " << reused << " are distinct" << endl;
+
+  // Detached threads are reclaimed as they exit, nothing is left to join
+  cerr << "\nCreating " << num_threads << " detached threads" << endl;
+  uthread_sem_init(&detached_done, 0);
+  uthread_attr_t attr;
+  uthread_attr_init(&attr);
+  uthread_attr_setdetachstate(&attr, UTHREAD_CREATE_DETACHED);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < num_threads; i++) {
+    if (uthread_create_attr(detached, nullptr, &attr) == -1) {
+      cerr << "uthread_create_attr failed after " << i << " threads" << endl;
+      exit(1);
+    } // if
+  } // for
+  for (long i = 0; i < num_threads; i++)
+    uthread_sem_wait(&detached_done);
+  cerr << "Ran " << num_threads << " detached threads in "
+       << seconds_since(&start) << " s, max RSS " << max_rss_mb() << " MB" << endl;
+  uthread_sem_destroy(&detached_done);
+
+  // Threads that block after a deep call keep its pages resident, unless
+  // their stacks are trimmed
+  long num_deep = num_threads < 2000 ? num_threads : 2000;
+  cerr << "\nBlocking " << num_deep << " threads that went 32 KB deep" << endl;
+  uthread_sem_init(&deep_blocked, 0);
+  uthread_sem_init(&deep_release, 0);
+  int* deep_tids = new int[num_deep];
+  double deep_mb[2];
+  for (int trim = 1; trim >= 0; trim--) {
+    uthread_attr_init(&attr);
+    uthread_attr_setstacktrim(&attr, trim);
+    double before = rss_mb();
+    for (long i = 0; i < num_deep; i++)
+      deep_tids[i] = uthread_create_attr(deep_blocker, nullptr, &attr);
+    for (long i = 0; i < num_deep; i++)
+      uthread_sem_wait(&deep_blocked);
+    // the last threads to post may not have blocked yet
+    uthread_yield();
+    deep_mb[trim] = rss_mb() - before;
+    for (long i = 0; i < num_deep; i++)
+      uthread_sem_post(&deep_release);
+    for (long i = 0; i < num_deep; i++) {
+      void* ret;
+      uthread_join(deep_tids[i], &ret);
+    } // for
+  } // for
+  cerr << "Resident memory while blocked: +" << deep_mb[0] << " MB, with stack trimming +"
+       << deep_mb[1] << " MB" << endl;
+  assert(deep_mb[1] < deep_mb[0]);
+  delete [] deep_tids;
+  uthread_sem_destroy(&deep_blocked);
+  uthread_sem_destroy(&deep_release);
+
+  delete [] tids;
+  cerr << setw(80) << setfill('-') << "" << endl;
+  return 0;
+} // main()
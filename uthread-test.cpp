@@ -1,9 +1,23 @@
 #include "uthread.h"
+#include "Channel.h"
+#include "ThreadTable.h"
 #include <iostream>
 #include <iomanip>
 #include <cassert>
 #include <unistd.h>
 #include <time.h>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fstream>
+#include <sstream>
 
 using namespace std;
 
@@ -63,16 +77,10 @@ void* suspend_test(void* arg) {
 
 void* resume_test(void* arg) {
   int sus_tid = *(int*) arg;
-  // loop for 2 seconds before resuming suspended thread 
+  // sleep for 2 seconds before resuming suspended thread
   cerr << "\nThread ID: " << uthread_self()  
-       << " will loop for 2 seconds before resuming thread " << sus_tid << endl;
-  time_t time_s, time_c;
-  time(&time_s);
-  while(1) {
-    time(&time_c);
-    if (time_c - time_s >= 2)
-      break;
-  } // while
+       << " will sleep for 2 seconds before resuming thread " << sus_tid << endl;
+  uthread_sleep_ns(2000000000LL);
   // resume suspended thread
   cerr << "\nThread ID: " << uthread_self()
        << " is resuming thread " << sus_tid << endl;
@@ -91,27 +99,450 @@ void* exit_test(void* arg) {
   return new bool(false);
 } // yield_test()
 
+// shared state for the synchronization tests
+uthread_mutex_t counter_mutex;
+int counter = 0;
+
+void* mutex_test(void* arg) {
+  int increments = *(int*) arg;
+  for (int i = 0; i < increments; i++) {
+    uthread_mutex_lock(&counter_mutex);
+    // yield inside the critical section so other threads contend for it
+    int value = counter;
+    uthread_yield();
+    counter = value + 1;
+    uthread_mutex_unlock(&counter_mutex);
+  } // for
+  return nullptr;
+} // mutex_test()
+
+// one slot buffer passed between a producer and a consumer
+uthread_cond_t slot_cond;
+bool slot_full = false;
+int slot_value = 0;
+
+void* producer_test(void* arg) {
+  int items = *(int*) arg;
+  for (int i = 1; i <= items; i++) {
+    uthread_mutex_lock(&counter_mutex);
+    while (slot_full)
+      uthread_cond_wait(&slot_cond, &counter_mutex);
+    slot_value = i;
+    slot_full = true;
+    uthread_cond_broadcast(&slot_cond);
+    uthread_mutex_unlock(&counter_mutex);
+  } // for
+  return nullptr;
+} // producer_test()
+
+void* consumer_test(void* arg) {
+  int items = *(int*) arg;
+  long sum = 0;
+  for (int i = 0; i < items; i++) {
+    uthread_mutex_lock(&counter_mutex);
+    while (!slot_full)
+      uthread_cond_wait(&slot_cond, &counter_mutex);
+    sum += slot_value;
+    slot_full = false;
+    uthread_cond_broadcast(&slot_cond);
+    uthread_mutex_unlock(&counter_mutex);
+  } // for
+  return new long(sum);
+} // consumer_test()
+
+uthread_sem_t order_sem;
+int wake_order[5];
+int wake_count = 0;
+
+void* sem_test(void* arg) {
+  uthread_sem_wait(&order_sem);
+  uthread_mutex_lock(&counter_mutex);
+  wake_order[wake_count++] = uthread_self();
+  uthread_mutex_unlock(&counter_mutex);
+  return nullptr;
+} // sem_test()
+
+uthread_rwlock_t rwlock;
+// readers run concurrently with several workers
+atomic<bool> writing(false);
+atomic<int> readers_inside(0);
+atomic<int> overlaps(0);
+
+void* reader_test(void* arg) {
+  for (int i = 0; i < 100; i++) {
+    uthread_rwlock_rdlock(&rwlock);
+    readers_inside++;
+    uthread_yield();
+    if (writing)
+      overlaps++;
+    readers_inside--;
+    uthread_rwlock_unlock(&rwlock);
+  } // for
+  return nullptr;
+} // reader_test()
+
+void* writer_test(void* arg) {
+  for (int i = 0; i < 100; i++) {
+    uthread_rwlock_wrlock(&rwlock);
+    writing = true;
+    if (readers_inside > 0)
+      overlaps++;
+    uthread_yield();
+    writing = false;
+    uthread_rwlock_unlock(&rwlock);
+  } // for
+  return nullptr;
+} // writer_test()
+
+uthread_wg_t wg;
+atomic<int> wg_finished(0);
+
+void* wg_test(void* arg) {
+  uthread_yield();
+  wg_finished++;
+  uthread_wg_done(&wg);
+  return nullptr;
+} // wg_test()
+
+uthread_barrier_t barrier;
+const int barrier_rounds = 3;
+atomic<int> barrier_arrivals(0);
+atomic<int> barrier_serials(0);
+atomic<int> barrier_early(0);
+
+// every thread must see all arrivals of a round once the barrier lets it go
+void* barrier_test(void* arg) {
+  int num_threads = *(int*) arg;
+  for (int round = 1; round <= barrier_rounds; round++) {
+    barrier_arrivals++;
+    if (uthread_barrier_wait(&barrier) == UTHREAD_BARRIER_SERIAL_THREAD)
+      barrier_serials++;
+    if (barrier_arrivals < round * num_threads)
+      barrier_early++;
+    // nobody may start the next round before everyone has checked this one
+    uthread_barrier_wait(&barrier);
+  } // for
+  return nullptr;
+} // barrier_test()
+
+// reads a message from a pipe, parking until the writer sends it
+void* read_test(void* arg) {
+  int fd = *(int*) arg;
+  char buf[32] = {0};
+  ssize_t n = uthread_read(fd, buf, sizeof(buf) - 1);
+  cerr << "Thread ID: " << uthread_self() << " read " << n << " bytes: " << buf << endl;
+  return new string(buf);
+} // read_test()
+
+// reads from a pipe that is closed while it waits, returns the errno
+void* close_read_test(void* arg) {
+  char buf[8];
+  if (uthread_read(*(int*) arg, buf, sizeof(buf)) != -1)
+    return (void*) 0L;
+  return (void*) (long) errno;
+} // close_read_test()
+
+// waits on a pipe with uthread_poll
+void* poll_test(void* arg) {
+  struct pollfd pfd;
+  pfd.fd = *(int*) arg;
+  pfd.events = POLLIN;
+  int n = uthread_poll(&pfd, 1, -1);
+  cerr << "Thread ID: " << uthread_self() << " polled " << n << " ready fd" << endl;
+  return new bool(n == 1 && (pfd.revents & POLLIN));
+} // poll_test()
+
+// sends 1..1000 on an unbuffered channel, then closes it
+void* chan_producer_test(void* arg) {
+  Channel<int>* numbers = (Channel<int>*) arg;
+  for (int i = 1; i <= 1000; i++)
+    numbers->send(i);
+  numbers->close();
+  return nullptr;
+} // chan_producer_test()
+
+// squares what it receives until the input is closed
+void* chan_square_test(void* arg) {
+  Channel<int>* numbers = ((Channel<int>**) arg)[0];
+  Channel<long>* squares = ((Channel<long>**) arg)[1];
+  int n;
+  while (numbers->recv(n))
+    squares->send((long) n * n);
+  squares->close();
+  return nullptr;
+} // chan_square_test()
+
+// sends the int in arg on the channel in select_chan
+uthread_chan_t select_chan;
+
+void* chan_select_test(void* arg) {
+  uthread_chan_send(&select_chan, arg);
+  return nullptr;
+} // chan_select_test()
+
+// records the pool thread it runs on and returns the square of arg
+int task_tids[100];
+
+void* task_test(void* arg) {
+  long i = (long) arg;
+  task_tids[i] = uthread_self();
+  if (i % 10 == 0)
+    uthread_yield();
+  return (void*) (i * i);
+} // task_test()
+
+// sleeps for the number of ms in arg
+void* sleep_test(void* arg) {
+  uthread_sleep_ns(*(int*) arg * 1000000LL);
+  return nullptr;
+} // sleep_test()
+
+// holds counter_mutex for the number of ms in arg
+void* hold_mutex_test(void* arg) {
+  uthread_mutex_lock(&counter_mutex);
+  uthread_sleep_ns(*(int*) arg * 1000000LL);
+  uthread_mutex_unlock(&counter_mutex);
+  return nullptr;
+} // hold_mutex_test()
+
+static long long elapsed_ms(struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+} // elapsed_ms()
+
+// CPU time used by the process so far, in ms
+static long long cpu_ms() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000LL +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+} // cpu_ms()
+
+uthread_sem_t external_sem;
+
+// A kernel thread that runs no uthreads: resumes the uthread whose tid is
+// in arg after 100 ms, then posts external_sem after another 100 ms
+void* external_waker(void* arg) {
+  usleep(100000);
+  uthread_resume(*(int*) arg);
+  usleep(100000);
+  uthread_sem_post(&external_sem);
+  return nullptr;
+} // external_waker()
+
+void* suspend_self_test(void* arg) {
+  uthread_suspend(uthread_self());
+  return arg;
+} // suspend_self_test()
+
+uthread_sem_t detach_started;
+uthread_sem_t detach_release;
+
+// posts detach_started, then waits for detach_release
+void* detach_test(void* arg) {
+  uthread_sem_post(&detach_started);
+  uthread_sem_wait(&detach_release);
+  return arg;
+} // detach_test()
+
+// joins the thread whose tid is in arg, returning its result
+void* joiner_test(void* arg) {
+  void* res = nullptr;
+  uthread_join(*(int*) arg, &res);
+  return res;
+} // joiner_test()
+
+uthread_sem_t prio_sem;
+int prio_order[3];
+atomic<int> prio_count(0);
+
+// records the order in which the threads run once the semaphore lets them
+void* prio_test(void* arg) {
+  uthread_sem_wait(&prio_sem);
+  prio_order[prio_count++] = uthread_getprio(uthread_self());
+  return nullptr;
+} // prio_test()
+
+atomic<bool> low_prio_ran(false);
+
+void* low_prio_test(void* arg) {
+  low_prio_ran = true;
+  return nullptr;
+} // low_prio_test()
+
+int handoff_order[4];
+atomic<int> handoff_count(0);
+
+// records its index in the order the threads run
+void* handoff_test(void* arg) {
+  handoff_order[handoff_count++] = (long) arg;
+  return nullptr;
+} // handoff_test()
+
+// yields back to the thread in arg
+void* handoff_back_test(void* arg) {
+  uthread_yield_to((int) (long) arg);
+  return nullptr;
+} // handoff_back_test()
+
+// yields until handoff_stop is set
+volatile bool handoff_stop = false;
+void* handoff_looper_test(void* arg) {
+  while (!handoff_stop)
+    uthread_yield();
+  return nullptr;
+} // handoff_looper_test()
+
+uthread_sem_t handoff_sem;
+
+void* handoff_waiter_test(void* arg) {
+  uthread_sem_wait(&handoff_sem);
+  return handoff_test(arg);
+} // handoff_waiter_test()
+
+struct timespec quota_start;
+
+// spins for 500 ms of wall time, however much of it it gets to run
+void* quota_test(void* arg) {
+  while (elapsed_ms(&quota_start) < 500)
+    ;
+  return nullptr;
+} // quota_test()
+
+// yields a few times, then sleeps for 1 ms
+void* trace_test(void* arg) {
+  for (int i = 0; i < 3; i++)
+    uthread_yield();
+  uthread_sleep_ns(1000000);
+  return nullptr;
+} // trace_test()
+
+volatile unsigned long prof_sink = 0;
+
+void prof_work() {
+  for (int i = 0; i < 1000; i++)
+    prof_sink += i;
+} // prof_work()
+
+// burns 200 ms of cpu in prof_work, for the profiler to find
+void* prof_test(void* arg) {
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    prof_work();
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while ((now.tv_sec - start.tv_sec) * 1000000000LL + now.tv_nsec - start.tv_nsec < 200000000);
+  return nullptr;
+} // prof_test()
+
+uthread_sem_t stack_sem;
+
+// uses arg bytes of stack, then waits on stack_sem
+void* stack_test(void* arg) {
+  long bytes = (long) arg;
+  volatile char buf[bytes];
+  for (long i = 0; i < bytes; i++)
+    buf[i] = 0;
+  uthread_sem_wait(&stack_sem);
+  return (void*) (long) buf[0];
+} // stack_test()
+
+uthread_sem_t trim_sem;
+char* trim_deep[2];     // bounds of the deepest buffer of the last trim_deeper
+
+// touches 24 KB of stack below the caller's frame, and records where
+void __attribute__((noinline)) trim_deeper() {
+  volatile char buf[24576];
+  for (size_t i = 0; i < sizeof(buf); i++)
+    buf[i] = (char) i;
+  trim_deep[0] = (char*) buf;
+  trim_deep[1] = (char*) buf + sizeof(buf);
+} // trim_deeper()
+
+// goes deep, blocks on trim_sem with 8 KB of its own on the stack, then
+// goes deep again. Returns whether its own data survived the block
+void* trim_test(void* arg) {
+  volatile char data[8192];
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = (char) (i * 7);
+  trim_deeper();
+  uthread_sem_wait(&trim_sem);
+  bool intact = true;
+  for (size_t i = 0; i < sizeof(data); i++)
+    intact = intact && data[i] == (char) (i * 7);
+  trim_deeper();
+  return (void*) intact;
+} // trim_test()
+
+// pages of the region that trim_deeper touched last, well below where the
+// blocked thread's frames end, that are resident
+static int trim_resident_pages() {
+  long page = sysconf(_SC_PAGESIZE);
+  uintptr_t lo = ((uintptr_t) trim_deep[0] + page - 1) & ~(page - 1);
+  uintptr_t hi = ((uintptr_t) trim_deep[1] - 8192) & ~(page - 1);
+  unsigned char vec[16];
+  assert(hi > lo && (hi - lo) / page <= 16);
+  assert(mincore((void*) lo, hi - lo, vec) == 0);
+  int resident = 0;
+  for (uintptr_t i = 0; i < (hi - lo) / page; i++)
+    resident += vec[i] & 1;
+  return resident;
+} // trim_resident_pages()
+
+uthread_sem_t stats_sem;
+
+// blocks on stats_sem, or suspends itself if arg is set
+void* stats_test(void* arg) {
+  if (arg != nullptr)
+    uthread_suspend(uthread_self());
+  else
+    uthread_sem_wait(&stats_sem);
+  return nullptr;
+} // stats_test()
+
+static long stats_count(const long* buckets) {
+  long count = 0;
+  for (int b = 0; b < UTHREAD_STATS_BUCKETS; b++)
+    count += buckets[b];
+  return count;
+} // stats_count()
+
 int main(int argc, char *argv[]) {
   // Default to 1 ms time quantum
   int quantum_usecs = 1000;
 
   if (argc < 3) {
-    cerr << "Usage: ./uthread-test <fib offset> <threads> [quantum_usecs]" << endl;
+    cerr << "Usage: ./uthread-test <fib offset> <threads> [quantum_usecs] [workers] [rr|prio|mlfq]" << endl;
     exit(1);
-  } else if (argc == 4) {
+  } // if
+  if (argc >= 4) {
     quantum_usecs = atoi(argv[3]);
-  } // else if
+  } // if
+  // Default to a single kernel thread
+  int num_workers = 1;
+  if (argc >= 5) {
+    num_workers = atoi(argv[4]);
+  } // if
+  // Default to round robin
+  int policy = UTHREAD_SCHED_RR;
+  if (argc >= 6) {
+    string name = argv[5];
+    policy = name == "prio" ? UTHREAD_SCHED_PRIO :
+             name == "mlfq" ? UTHREAD_SCHED_MLFQ : UTHREAD_SCHED_RR;
+  } // if
   
   int* fib_offset = new int(atoi(argv[1]));
   int num_threads = atoi(argv[2]);
-  fibs = new unsigned long long int[*fib_offset + MAX_THREAD_NUM];
-  gen_fibs(*fib_offset + MAX_THREAD_NUM);
+  // the fib threads get tids 1 to num_threads
+  fibs = new unsigned long long int[*fib_offset + num_threads + 1];
+  gen_fibs(*fib_offset + num_threads + 1);
 
   /* Testing uthread_init, uthread_self ------------------------------ */
   cerr << setw(80) << setfill('+') << "" << endl;
   cerr << "Testing uthread_init and uthread_self\n" << endl;
 
-  int res = uthread_init(quantum_usecs);
+  int res = uthread_init_sched(quantum_usecs, num_workers, policy);
   if (res != 0) {
     cerr << "uthread_init failed" << endl;
     exit(1);
@@ -192,6 +623,130 @@ int main(int argc, char *argv[]) {
 
   cerr << left << setw(80) << setfill('-') << "" << endl;
 
+  /* Testing uthread_detach ----------------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_detach\n" << endl;
+
+  uthread_sem_init(&detach_started, 0);
+  uthread_sem_init(&detach_release, 0);
+  uthread_attr_t detach_attr;
+  uthread_attr_init(&detach_attr);
+  uthread_attr_setdetachstate(&detach_attr, UTHREAD_CREATE_DETACHED);
+  int detached_ids[10];
+  for (int i = 0; i < 10; i++) {
+    // half start detached, the other half are detached while they run
+    if (i % 2 == 0)
+      detached_ids[i] = uthread_create_attr(detach_test, nullptr, &detach_attr);
+    else
+      detached_ids[i] = uthread_create(detach_test, nullptr);
+    uthread_sem_wait(&detach_started);
+    if (i % 2 == 1)
+      assert(uthread_detach(detached_ids[i]) == 0);
+  } // for
+  void* detach_ret;
+  res = uthread_join(detached_ids[0], &detach_ret);
+  cerr << "Join of a running detached thread: " << res << "\t\tExpected: -1" << endl;
+  assert(res == -1);
+  res = uthread_detach(detached_ids[1]);
+  cerr << "Second detach of a thread: " << res << "\t\tExpected: -1" << endl;
+  assert(res == -1);
+  for (int i = 0; i < 10; i++)
+    uthread_sem_post(&detach_release);
+  // nothing joins them, their tids go stale once they have exited
+  int live = 10;
+  for (int tries = 0; live > 0 && tries < 1000; tries++) {
+    uthread_sleep_ns(1000000);
+    live = 0;
+    for (int i = 0; i < 10; i++)
+      if (uthread_get_quantums(detached_ids[i]) != -1)
+        live++;
+  } // for
+  cerr << "Detached threads not reclaimed: " << live << "\t\tExpected: 0" << endl;
+  assert(live == 0);
+  // detaching a thread that has finished but was not joined reclaims it
+  int finished_tid = uthread_create(detach_test, nullptr);
+  uthread_sem_wait(&detach_started);
+  uthread_sem_post(&detach_release);
+  uthread_sleep_ns(10000000);
+  res = uthread_detach(finished_tid);
+  cerr << "Detach of a finished thread: " << res << ", quantums "
+       << uthread_get_quantums(finished_tid) << "\t\tExpected: 0, quantums -1" << endl;
+  assert(res == 0 && uthread_get_quantums(finished_tid) == -1);
+
+  // a stale tid keeps missing its slot until the generation wraps, 2048
+  // reuses later. With every other slot of the chunk taken, the freed slot
+  // is the only one on the free list and comes straight back
+  ThreadTable table;
+  int first_tid = table.allocate();
+  for (int i = 1; i < ThreadTable::CHUNK_SLOTS; i++)
+    table.allocate();
+  TCB* marker = (TCB*) &table;
+  int reuses = 0;
+  int tid = first_tid;
+  do {
+    table.release(tid);
+    tid = table.allocate();
+    table.set(tid, marker);
+    reuses++;
+    assert(tid % ThreadTable::MAX_SLOTS == first_tid);
+    assert(tid == first_tid || table.lookup(first_tid) == nullptr);
+  } while (tid != first_tid);
+  cerr << "Reuses of a slot before its stale tid matches: " << reuses
+       << "\t\tExpected: " << ThreadTable::GENERATION_MASK + 1 << endl;
+  assert(reuses == ThreadTable::GENERATION_MASK + 1);
+  assert(table.lookup(first_tid) == marker);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing multiple joiners and uthread_join_any ------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing multiple joiners and uthread_join_any\n" << endl;
+
+  // three threads and main join the same thread, all get its result
+  int joined_tid = uthread_create(detach_test, (void*) 42L);
+  uthread_sem_wait(&detach_started);
+  int joiner_ids[3];
+  for (int i = 0; i < 3; i++)
+    joiner_ids[i] = uthread_create(joiner_test, &joined_tid);
+  // give the joiners time to block on it
+  uthread_sleep_ns(20000000);
+  uthread_sem_post(&detach_release);
+  void* joined_res = nullptr;
+  res = uthread_join(joined_tid, &joined_res);
+  int same_result = joined_res == (void*) 42L;
+  for (int i = 0; i < 3; i++) {
+    uthread_join(joiner_ids[i], &joined_res);
+    same_result += joined_res == (void*) 42L;
+  } // for
+  cerr << "Joiners that got the result: " << same_result << "\t\tExpected: 4" << endl;
+  assert(res == 0 && same_result == 4);
+  assert(uthread_get_quantums(joined_tid) == -1);
+
+  // threads sleeping 300, 100 and 200 ms are joined as they finish
+  int naps[3] = {300, 100, 200};
+  int nap_ids[3];
+  for (int i = 0; i < 3; i++)
+    nap_ids[i] = uthread_create(sleep_test, &naps[i]);
+  cerr << "uthread_join_any order:";
+  int remaining = 3;
+  int any_order[3];
+  for (int i = 0; i < 3; i++) {
+    int index = uthread_join_any(nap_ids, remaining, &joined_res);
+    assert(index != -1);
+    any_order[i] = naps[index];
+    cerr << " " << naps[index] << " ms";
+    // the joined tid is stale now, drop it from the set
+    nap_ids[index] = nap_ids[remaining - 1];
+    naps[index] = naps[remaining - 1];
+    remaining--;
+  } // for
+  cerr << "\t\tExpected: 100 ms 200 ms 300 ms" << endl;
+  assert(any_order[0] == 100 && any_order[1] == 200 && any_order[2] == 300);
+  uthread_sem_destroy(&detach_started);
+  uthread_sem_destroy(&detach_release);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
   /* Testing uthread_yield ------------------------------------------ */
   cerr << setw(80) << setfill('+') << "" << endl;
   cerr << "Testing uthread_yield\n" << endl;
@@ -228,6 +783,249 @@ int main(int argc, char *argv[]) {
 
   cerr << setw(80) << setfill('-') << "" << endl;
 
+  /* Testing uthread_yield_to and uthread_set_runnext --------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_yield_to and uthread_set_runnext\n" << endl;
+
+  // three ready threads: yielding to the last runs it ahead of the others
+  int handoff_ids[4];
+  for (long i = 0; i < 3; i++)
+    handoff_ids[i] = uthread_create(handoff_test, (void*) i);
+  assert(uthread_yield_to(handoff_ids[2]) == 0);
+  for (int i = 0; i < 3; i++) {
+    void* handoff_res;
+    uthread_join(handoff_ids[i], &handoff_res);
+  } // for
+  cerr << "Run order after uthread_yield_to(2): " << handoff_order[0] << " "
+       << handoff_order[1] << " " << handoff_order[2];
+  if (num_workers == 1) {
+    cerr << "\tExpected: 2 0 1" << endl;
+    assert(handoff_order[0] == 2 && handoff_order[1] == 0 && handoff_order[2] == 1);
+  } else {
+    cerr << "\tExpected: any order" << endl;
+  } // else
+  // yielding to the caller or a joined thread is a plain yield
+  assert(uthread_yield_to(main_tid) == 0);
+  assert(uthread_yield_to(handoff_ids[0]) == 0);
+  assert(uthread_yield_to(-1) == -1);
+  // a thread yielded to leaves its ready queue entry behind. Joining it
+  // before the entry is popped must not leave the entry dangling
+  handoff_ids[0] = uthread_create(handoff_looper_test, nullptr);
+  handoff_ids[1] = uthread_create(handoff_back_test, (void*) (long) main_tid);
+  assert(uthread_yield_to(handoff_ids[1]) == 0);
+  void* handoff_back_res;
+  assert(uthread_join(handoff_ids[1], &handoff_back_res) == 0);
+  for (int i = 0; i < 3; i++)
+    uthread_yield();
+  handoff_stop = true;
+  assert(uthread_join(handoff_ids[0], &handoff_back_res) == 0);
+
+  // thread 3 is woken behind three ready threads. With the run next slot it
+  // runs first, without it last
+  for (int runnext = 1; runnext >= 0; runnext--) {
+    uthread_set_runnext(runnext);
+    uthread_sem_init(&handoff_sem, 0);
+    handoff_count = 0;
+    handoff_ids[3] = uthread_create(handoff_waiter_test, (void*) 3);
+    // let it reach the semaphore
+    uthread_sleep_ns(10000000);
+    for (long i = 0; i < 3; i++)
+      handoff_ids[i] = uthread_create(handoff_test, (void*) i);
+    uthread_sem_post(&handoff_sem);
+    for (int i = 0; i < 4; i++) {
+      void* handoff_res;
+      uthread_join(handoff_ids[i], &handoff_res);
+    } // for
+    cerr << "Run order, run next " << (runnext ? "on: " : "off: ") << handoff_order[0]
+         << " " << handoff_order[1] << " " << handoff_order[2] << " " << handoff_order[3];
+    if (num_workers == 1) {
+      int expected[2][4] = {{0, 1, 2, 3}, {3, 0, 1, 2}};
+      cerr << (runnext ? "\tExpected: 3 0 1 2" : "\tExpected: 0 1 2 3") << endl;
+      for (int i = 0; i < 4; i++)
+        assert(handoff_order[i] == expected[runnext][i]);
+    } else {
+      cerr << "\tExpected: any order" << endl;
+    } // else
+    uthread_sem_destroy(&handoff_sem);
+  } // for
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing scheduling policies ------------------------------------ */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_setprio and the scheduling policy\n" << endl;
+
+  assert(uthread_getprio(main_tid) == UTHREAD_PRIO_DEFAULT);
+  assert(uthread_setprio(main_tid, UTHREAD_PRIO_LEVELS) == -1);
+  // threads of priority 6, 2 and 4 are woken in that order while main
+  // keeps running, then main blocks. Under UTHREAD_SCHED_PRIO they run in
+  // priority order, otherwise in the order they were woken
+  int prios[3] = {6, 2, 4};
+  int prio_ids[3];
+  uthread_sem_init(&prio_sem, 0);
+  for (int i = 0; i < 3; i++) {
+    prio_ids[i] = uthread_create(prio_test, nullptr);
+    uthread_setprio(prio_ids[i], prios[i]);
+  } // for
+  // let them all reach the semaphore
+  uthread_sleep_ns(10000000);
+  for (int i = 0; i < 3; i++)
+    uthread_sem_post(&prio_sem);
+  for (int i = 0; i < 3; i++) {
+    void* prio_res;
+    uthread_join(prio_ids[i], &prio_res);
+  } // for
+  cerr << "Priorities in run order: " << prio_order[0] << " " << prio_order[1]
+       << " " << prio_order[2];
+  if (policy == UTHREAD_SCHED_PRIO && num_workers == 1) {
+    cerr << "\t\tExpected: 2 4 6" << endl;
+    assert(prio_order[0] == 2 && prio_order[1] == 4 && prio_order[2] == 6);
+  } else {
+    cerr << "\t\tExpected: any order" << endl;
+  } // else
+  uthread_sem_destroy(&prio_sem);
+
+  // main spins at the highest priority, a thread of the lowest still gets to
+  // run thanks to aging
+  uthread_setprio(main_tid, 0);
+  int low_tid = uthread_create(low_prio_test, nullptr);
+  uthread_setprio(low_tid, UTHREAD_PRIO_LEVELS - 1);
+  struct timespec spin_start;
+  clock_gettime(CLOCK_MONOTONIC, &spin_start);
+  while (!low_prio_ran && elapsed_ms(&spin_start) < 2000)
+    ;
+  cerr << "Lowest priority thread ran while main spun: " << low_prio_ran
+       << "\t\tExpected: 1" << endl;
+  assert(low_prio_ran);
+  void* low_res;
+  uthread_join(low_tid, &low_res);
+  uthread_setprio(main_tid, UTHREAD_PRIO_DEFAULT);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing cpu time and quotas ------------------------------------ */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_get_cputime and cpu quotas\n" << endl;
+
+  // spinning counts as cpu time, sleeping does not
+  struct timespec cpu_start;
+  long long cputime = uthread_get_cputime(main_tid);
+  clock_gettime(CLOCK_MONOTONIC, &cpu_start);
+  while (elapsed_ms(&cpu_start) < 50)
+    ;
+  long long spun_ms = (uthread_get_cputime(main_tid) - cputime) / 1000000;
+  cputime = uthread_get_cputime(main_tid);
+  uthread_sleep_ns(50000000);
+  long long slept_ms = (uthread_get_cputime(main_tid) - cputime) / 1000000;
+  cerr << "CPU time of a 50 ms spin: " << spun_ms << " ms, of a 50 ms sleep: "
+       << slept_ms << " ms\tExpected: about 50 and 0" << endl;
+  assert(spun_ms >= 50 && slept_ms < 10);
+  assert(uthread_get_cputime(-1) == -1);
+
+  // two threads spinning for 500 ms share a quota of 10 ms every 50 ms
+  uthread_quota_t quota;
+  assert(uthread_quota_init(&quota, 0, 50000000) == -1);
+  uthread_quota_init(&quota, 10000000, 50000000);
+  int quota_ids[2];
+  clock_gettime(CLOCK_MONOTONIC, &quota_start);
+  for (int i = 0; i < 2; i++) {
+    quota_ids[i] = uthread_create(quota_test, nullptr);
+    uthread_setquota(quota_ids[i], &quota);
+  } // for
+  assert(uthread_quota_destroy(&quota) == -1);
+  for (int i = 0; i < 2; i++) {
+    void* quota_res;
+    uthread_join(quota_ids[i], &quota_res);
+  } // for
+  long long quota_ms = quota.used_ns / 1000000;
+  cerr << "CPU time of the quota group: " << quota_ms << " ms, waited "
+       << quota.throttled << " times";
+  // run time is wall time on the worker, which on a machine with fewer cpus
+  // than workers includes time the worker waited for a cpu
+  if (num_workers <= sysconf(_SC_NPROCESSORS_ONLN)) {
+    cerr << "\tExpected: about 100 ms" << endl;
+    assert(quota_ms >= 50 && quota_ms <= 200);
+  } else {
+    cerr << "\tExpected: 100 ms or more" << endl;
+  } // else
+  assert(quota.throttled > 0);
+  assert(uthread_quota_destroy(&quota) == 0);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing tracing ------------------------------------------------ */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_trace_start and uthread_trace_dump\n" << endl;
+
+  if (uthread_trace_start(4096) == -1 && errno == ENOSYS) {
+    cerr << "Tracing is compiled out" << endl;
+  } else {
+    int trace_ids[2];
+    for (int i = 0; i < 2; i++)
+      trace_ids[i] = uthread_create(trace_test, nullptr);
+    for (int i = 0; i < 2; i++) {
+      void* trace_res;
+      uthread_join(trace_ids[i], &trace_res);
+    } // for
+    uthread_trace_stop();
+    string trace_path = "/tmp/uthread-trace-" + to_string(getpid()) + ".json";
+    assert(uthread_trace_dump(trace_path.c_str()) == 0);
+    ifstream trace_file(trace_path);
+    stringstream trace_json;
+    trace_json << trace_file.rdbuf();
+    string trace = trace_json.str();
+    unlink(trace_path.c_str());
+    cerr << "Trace of 2 threads that yield and sleep: " << trace.size() << " bytes" << endl;
+    // both threads were created, ran, slept and exited
+    assert(trace.find("\"name\": \"create\"") != string::npos);
+    for (int i = 0; i < 2; i++) {
+      string tid = to_string(trace_ids[i]);
+      assert(trace.find("\"args\": {\"tid\": " + tid + "}}") != string::npos);
+      assert(trace.find("\"name\": \"uthread " + tid + "\", \"cat\": \"run\"") != string::npos);
+      assert(trace.find("\"tid\": " + tid + ", \"left\": \"blocked: sleep\"") != string::npos);
+      assert(trace.find("\"tid\": " + tid + ", \"left\": \"exited\"") != string::npos);
+    } // for
+    assert(trace.compare(0, 17, "{\"displayTimeUnit") == 0);
+    assert(trace.compare(trace.size() - 3, 3, "]}\n") == 0);
+    assert(uthread_trace_start(0) == -1);
+  } // else
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing profiling ---------------------------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_prof_start and uthread_prof_dump\n" << endl;
+
+  assert(uthread_prof_start(0, 1024) == -1);
+  assert(uthread_prof_start(1000, 1024) == 0);
+  int prof_tid = uthread_create(prof_test, nullptr);
+  void* prof_res;
+  uthread_join(prof_tid, &prof_res);
+  uthread_prof_stop();
+  string prof_path = "/tmp/uthread-prof-" + to_string(getpid()) + ".txt";
+  assert(uthread_prof_dump(prof_path.c_str()) == 0);
+  ifstream prof_file(prof_path);
+  string prof_line;
+  long prof_samples = 0;
+  long prof_hits = 0;
+  while (getline(prof_file, prof_line)) {
+    size_t space = prof_line.rfind(' ');
+    long count = atol(prof_line.c_str() + space + 1);
+    prof_samples += count;
+    // the spinning thread's samples, in prof_work called by prof_test
+    if (prof_line.compare(0, 9 + to_string(prof_tid).size(),
+                          "uthread " + to_string(prof_tid) + ";") == 0 &&
+        prof_line.find(";prof_test(void*);prof_work()") != string::npos)
+      prof_hits += count;
+  } // while
+  unlink(prof_path.c_str());
+  // the timers fire on the kernel tick, so there may be fewer than 200
+  cerr << "Samples: " << prof_samples << ", in prof_work of thread " << prof_tid
+       << ": " << prof_hits << "\t\tExpected: some" << endl;
+  assert(prof_hits > 0);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
   /* Testing uthread_suspend and uthread_resume ----------------------------- */
   cerr << setw(80) << setfill('+') << "" << endl;
   cerr << "Testing uthread_suspend and uthread_resume" << endl;
@@ -256,11 +1054,491 @@ int main(int argc, char *argv[]) {
     } // if
   } // for
 
+  // a thread suspended while it waits in a ready queue leaves its entry
+  // there, and resuming it puts it in the run next slot as well. It is
+  // joined before the stale entry is popped, which must not touch the freed
+  // thread
+  uthread_set_runnext(1);
+  handoff_count = 0;
+  sus_tids[0] = uthread_create(handoff_test, (void*) 0);
+  uthread_suspend(sus_tids[0]);
+  sus_tids[1] = uthread_create(handoff_test, (void*) 1);
+  uthread_resume(sus_tids[0]);
+  for (int i = 0; i < 2; i++) {
+    void* sus_res = nullptr;
+    assert(uthread_join(sus_tids[i], &sus_res) == 0);
+  } // for
+  for (int i = 0; i < 3; i++)
+    uthread_yield();
+  uthread_set_runnext(0);
+  cerr << "\nSuspended, resumed and joined with run next on: " << handoff_count
+       << " threads ran\tExpected: 2" << endl;
+  assert(handoff_count == 2);
+
   // cleanup
   delete [] sus_tids;
   
   cerr << setw(80) << setfill('-') << "" << endl;
   
+  /* Testing synchronization ---------------------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_mutex, uthread_cond, uthread_sem and uthread_rwlock\n" << endl;
+
+  // each thread increments a shared counter, yielding between reading and
+  // writing it. Without the mutex increments would be lost
+  const int sync_threads = 5;
+  int increments = 200;
+  uthread_mutex_init(&counter_mutex);
+  thread_ids = new int[sync_threads];
+  for (int i = 0; i < sync_threads; i++)
+    thread_ids[i] = uthread_create(mutex_test, &increments);
+  for (int i = 0; i < sync_threads; i++) {
+    void* sync_res = nullptr;
+    uthread_join(thread_ids[i], &sync_res);
+  } // for
+  cerr << "Mutex counter: " << counter
+       << "\t\tExpected: " << sync_threads * increments << endl;
+  assert(counter == sync_threads * increments);
+
+  // a producer hands the numbers 1 to 100 to a consumer through a one slot
+  // buffer guarded by a mutex and condition variable
+  int items = 100;
+  uthread_cond_init(&slot_cond);
+  thread_ids[0] = uthread_create(consumer_test, &items);
+  thread_ids[1] = uthread_create(producer_test, &items);
+  long* sum = nullptr;
+  uthread_join(thread_ids[0], (void**) &sum);
+  void* sync_res = nullptr;
+  uthread_join(thread_ids[1], &sync_res);
+  cerr << "Consumed sum: " << *sum << "\t\tExpected: " << items * (items + 1) / 2 << endl;
+  assert(*sum == items * (items + 1) / 2);
+  delete sum;
+
+  // threads wait on a semaphore and are woken in the order they waited
+  uthread_sem_init(&order_sem, 0);
+  for (int i = 0; i < sync_threads; i++)
+    thread_ids[i] = uthread_create(sem_test, nullptr);
+  // let every thread reach the semaphore
+  uthread_yield();
+  for (int i = 0; i < sync_threads; i++)
+    uthread_sem_post(&order_sem);
+  for (int i = 0; i < sync_threads; i++)
+    uthread_join(thread_ids[i], &sync_res);
+  cerr << "Semaphore wake order:";
+  for (int i = 0; i < sync_threads; i++)
+    cerr << " " << wake_order[i];
+  cerr << "\t\tExpected:";
+  for (int i = 0; i < sync_threads; i++)
+    cerr << " " << thread_ids[i];
+  cerr << endl;
+
+  // readers share the lock and yield while holding it, a writer must
+  // never overlap with them
+  uthread_rwlock_init(&rwlock);
+  for (int i = 0; i < sync_threads; i++)
+    thread_ids[i] = uthread_create(i == 2 ? writer_test : reader_test, nullptr);
+  for (int i = 0; i < sync_threads; i++)
+    uthread_join(thread_ids[i], &sync_res);
+  cerr << "Reader-writer overlaps: " << overlaps << "\t\tExpected: 0" << endl;
+  assert(overlaps == 0);
+
+  // a wait group releases main once, after every thread counted down
+  uthread_wg_init(&wg, sync_threads);
+  for (int i = 0; i < sync_threads; i++)
+    uthread_create_attr(wg_test, nullptr, &detach_attr);
+  uthread_wg_wait(&wg);
+  cerr << "Threads finished at wait group release: " << wg_finished
+       << "\t\tExpected: " << sync_threads << endl;
+  assert(wg_finished == sync_threads);
+  assert(uthread_wg_done(&wg) == -1);
+  uthread_wg_destroy(&wg);
+
+  // a barrier reused for several rounds
+  int barrier_threads = sync_threads;
+  uthread_barrier_init(&barrier, barrier_threads);
+  for (int i = 0; i < barrier_threads; i++)
+    thread_ids[i] = uthread_create(barrier_test, &barrier_threads);
+  for (int i = 0; i < barrier_threads; i++)
+    uthread_join(thread_ids[i], &sync_res);
+  cerr << "Barrier rounds: " << barrier_serials << ", early releases "
+       << barrier_early << "\t\tExpected: " << barrier_rounds << ", early releases 0" << endl;
+  assert(barrier_serials == barrier_rounds && barrier_early == 0);
+  uthread_barrier_destroy(&barrier);
+
+  // cleanup
+  delete [] thread_ids;
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing channels ------------------------------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing channels\n" << endl;
+
+  // a producer feeds a squaring stage over an unbuffered channel, which
+  // feeds this thread over a buffered one
+  Channel<int> numbers;
+  Channel<long> squares(16);
+  void* stage_args[2] = {&numbers, &squares};
+  int stage_tids[2];
+  stage_tids[0] = uthread_create(chan_producer_test, &numbers);
+  stage_tids[1] = uthread_create(chan_square_test, stage_args);
+  long square_sum = 0;
+  long square;
+  while (squares.recv(square))
+    square_sum += square;
+  void* stage_res;
+  for (int i = 0; i < 2; i++)
+    uthread_join(stage_tids[i], &stage_res);
+  cerr << "Sum of squares through the pipeline: " << square_sum
+       << "\t\tExpected: 333833500" << endl;
+  assert(square_sum == 333833500);
+
+  // buffered values come out in order, and can be drained after a close
+  Channel<int> buffered(4);
+  for (int i = 0; i < 4; i++)
+    buffered.send(i);
+  buffered.close();
+  int value;
+  for (int i = 0; i < 4; i++)
+    assert(buffered.recv(value) && value == i);
+  assert(!buffered.recv(value) && errno == EPIPE);
+  assert(!buffered.send(value) && errno == EPIPE);
+  cerr << "Buffered values drained in order after close" << endl;
+
+  // select waits on two channels and completes the one that is sent to
+  uthread_chan_t idle_chan;
+  uthread_chan_init(&idle_chan, sizeof(int), 0);
+  uthread_chan_init(&select_chan, sizeof(int), 0);
+  int idle_value, select_value;
+  uthread_chan_case_t cases[2] = {
+    {&idle_chan, UTHREAD_CHAN_RECV, &idle_value, 0},
+    {&select_chan, UTHREAD_CHAN_RECV, &select_value, 0},
+  };
+  res = uthread_chan_select(cases, 2, 0);
+  assert(res == -1 && errno == EAGAIN);
+  int sent = 42;
+  int select_tid = uthread_create(chan_select_test, &sent);
+  res = uthread_chan_select(cases, 2, 1);
+  cerr << "Select completed case " << res << " with " << select_value
+       << "\t\tExpected: case 1 with 42" << endl;
+  assert(res == 1 && cases[1].ok && select_value == 42);
+  uthread_join(select_tid, &stage_res);
+  assert(uthread_chan_destroy(&idle_chan) == 0);
+  assert(uthread_chan_destroy(&select_chan) == 0);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing uthread_submit ------------------------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_submit\n" << endl;
+
+  // two rounds of 100 tasks, the second reuses the threads of the first
+  uthread_future_t futures[100];
+  int round_tids[2][100];
+  for (int round = 0; round < 2; round++) {
+    for (long i = 0; i < 100; i++)
+      assert(uthread_submit(&futures[i], task_test, (void*) i) == 0);
+    for (long i = 0; i < 100; i++) {
+      void* square;
+      assert(uthread_future_wait(&futures[i], &square) == 0);
+      assert((long) square == i * i);
+      assert(uthread_future_done(&futures[i]));
+    } // for
+    copy(task_tids, task_tids + 100, round_tids[round]);
+  } // for
+  cerr << "Results of 200 tasks as expected" << endl;
+  bool reused = find(round_tids[0], round_tids[0] + 100, round_tids[1][0]) != round_tids[0] + 100;
+  sort(&round_tids[0][0], &round_tids[0][0] + 200);
+  long pool_threads = unique(&round_tids[0][0], &round_tids[0][0] + 200) - &round_tids[0][0];
+  cerr << "Pool threads used: " << pool_threads << "\t\tExpected: at most 64" << endl;
+  cerr << "Second round reused a pool thread: " << reused << "\t\tExpected: 1" << endl;
+  assert(pool_threads <= 64 && reused);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing uthread_sleep_ns and timeouts --------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_sleep_ns and timeouts\n" << endl;
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  uthread_sleep_ns(100000000LL);
+  long long slept = elapsed_ms(&start);
+  cerr << "Slept for " << slept << " ms\t\tExpected: 100 ms" << endl;
+  assert(slept >= 100);
+
+  // joining a thread that sleeps 200 ms times out after 50 ms, and a
+  // second join with a longer timeout gets it
+  int sleep_ms = 200;
+  int timed_tid = uthread_create(sleep_test, &sleep_ms);
+  void* timed_res;
+  res = uthread_join_timed(timed_tid, &timed_res, 50000000LL);
+  cerr << "Join with a 50 ms timeout: " << res << " (" << (errno == ETIMEDOUT ? "ETIMEDOUT" : "?")
+       << ")\t\tExpected: -1 (ETIMEDOUT)" << endl;
+  assert(res == -1 && errno == ETIMEDOUT);
+  res = uthread_join_timed(timed_tid, &timed_res, 1000000000LL);
+  cerr << "Join with a 1 s timeout: " << res << "\t\tExpected: 0" << endl;
+  assert(res == 0);
+
+  // the mutex is held for 200 ms, longer than the waits below
+  timed_tid = uthread_create(hold_mutex_test, &sleep_ms);
+  uthread_yield();
+  res = uthread_mutex_timedlock(&counter_mutex, 20000000LL);
+  cerr << "Mutex timed lock: " << res << "\t\tExpected: -1" << endl;
+  assert(res == -1 && errno == ETIMEDOUT);
+  uthread_sem_init(&order_sem, 0);
+  res = uthread_sem_timedwait(&order_sem, 20000000LL);
+  cerr << "Semaphore timed wait: " << res << "\t\tExpected: -1" << endl;
+  assert(res == -1 && errno == ETIMEDOUT);
+  // a timed out condition wait holds the mutex again when it returns
+  uthread_join(timed_tid, &timed_res);
+  uthread_mutex_lock(&counter_mutex);
+  res = uthread_cond_timedwait(&slot_cond, &counter_mutex, 20000000LL);
+  cerr << "Condition timed wait: " << res << "\t\tExpected: -1" << endl;
+  assert(res == -1 && errno == ETIMEDOUT);
+  assert(uthread_mutex_unlock(&counter_mutex) == 0);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing idle workers and external wakeups ----------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing idle workers and external wakeups\n" << endl;
+  cerr << "A kernel thread that is not a worker resumes a suspended thread" << endl;
+  cerr << "while main joins it, then posts a semaphore main waits on. No other" << endl;
+  cerr << "thread is ready meanwhile, so the workers sleep\n" << endl;
+
+  uthread_sem_init(&external_sem, 0);
+  int suspended_tid = uthread_create(suspend_self_test, &sleep_ms);
+  pthread_t waker;
+  long long cpu_before = cpu_ms();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  assert(pthread_create(&waker, NULL, external_waker, &suspended_tid) == 0);
+  void* suspended_res;
+  res = uthread_join(suspended_tid, &suspended_res);
+  assert(res == 0 && suspended_res == &sleep_ms);
+  res = uthread_sem_wait(&external_sem);
+  assert(res == 0);
+  long long waited = elapsed_ms(&start);
+  long long idle_cpu = cpu_ms() - cpu_before;
+  pthread_join(waker, NULL);
+  cerr << "Woken after " << waited << " ms\t\tExpected: 200 ms" << endl;
+  cerr << "CPU time while waiting: " << idle_cpu << " ms\t\tExpected: close to 0 ms" << endl;
+  assert(waited >= 200 && idle_cpu < waited / 2);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing I/O ------------------------------------------------------------ */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_read, uthread_write and uthread_poll\n" << endl;
+
+  // a thread reads from an empty pipe: it parks instead of blocking the
+  // kernel thread, so the main thread keeps running and writes to the pipe
+  int pipe_fds[2];
+  if (pipe(pipe_fds) == -1) {
+    cerr << "pipe failed" << endl;
+    exit(1);
+  } // if
+  int io_tid = uthread_create(read_test, &pipe_fds[0]);
+  uthread_yield();
+  cerr << "Main thread is still running, writing to the pipe" << endl;
+  uthread_write(pipe_fds[1], "hello", 5);
+  string* read_res = nullptr;
+  uthread_join(io_tid, (void**) &read_res);
+  cerr << "Read: " << *read_res << "\t\tExpected: hello" << endl;
+  assert(*read_res == "hello");
+  delete read_res;
+
+  io_tid = uthread_create(poll_test, &pipe_fds[0]);
+  uthread_yield();
+  uthread_write(pipe_fds[1], "x", 1);
+  bool* poll_res = nullptr;
+  uthread_join(io_tid, (void**) &poll_res);
+  cerr << "Poll saw the pipe readable: " << *poll_res << "\t\tExpected: 1" << endl;
+  assert(*poll_res);
+  delete poll_res;
+  uthread_close(pipe_fds[0]);
+  uthread_close(pipe_fds[1]);
+
+  // closing the pipe under a parked reader wakes it with EBADF
+  if (pipe(pipe_fds) == -1) {
+    cerr << "pipe failed" << endl;
+    exit(1);
+  } // if
+  io_tid = uthread_create(close_read_test, &pipe_fds[0]);
+  uthread_sleep_ns(10000000);
+  uthread_close(pipe_fds[0]);
+  void* close_res = nullptr;
+  uthread_join(io_tid, &close_res);
+  cerr << "Reader woken by close with errno " << (long) close_res << "\tExpected: "
+       << EBADF << " (EBADF)" << endl;
+  assert((long) close_res == EBADF);
+  uthread_close(pipe_fds[1]);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing stack painting ---------------------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_stack_highwater and uthread_stack_report\n" << endl;
+
+  uthread_sem_init(&stack_sem, 0);
+  int unpainted_tid = uthread_create(stack_test, (void*) 1024);
+  assert(uthread_stack_paint(1) == 0);
+  int stack_tids[2];
+  stack_tids[0] = uthread_create(stack_test, (void*) 4096);
+  stack_tids[1] = uthread_create(stack_test, (void*) 12288);
+  assert(uthread_stack_paint(0) == 0);
+  // let all three use their stacks and block
+  uthread_sleep_ns(10000000);
+  long highwater[2];
+  for (int i = 0; i < 2; i++)
+    highwater[i] = uthread_stack_highwater(stack_tids[i]);
+  cerr << "High-water marks: " << highwater[0] << " and " << highwater[1]
+       << " bytes\t\tExpected: a little over 4096 and 12288" << endl;
+  assert(highwater[0] >= 4096 && highwater[0] < 12288);
+  assert(highwater[1] >= 12288 && highwater[1] < 20480);
+  assert(uthread_stack_highwater(unpainted_tid) == -1);
+  for (int i = 0; i < 3; i++)
+    uthread_sem_post(&stack_sem);
+  void* stack_res;
+  uthread_join(unpainted_tid, &stack_res);
+  for (int i = 0; i < 2; i++)
+    uthread_join(stack_tids[i], &stack_res);
+  uthread_sem_destroy(&stack_sem);
+  string stack_path = "/tmp/uthread-stacks-" + to_string(getpid()) + ".txt";
+  assert(uthread_stack_report(stack_path.c_str()) == 0);
+  ifstream stack_file(stack_path);
+  string stack_line;
+  bool stack_found = false;
+  while (getline(stack_file, stack_line)) {
+    cerr << stack_line << endl;
+    if (stack_line.find("  stack_test(void*)") == string::npos)
+      continue;
+    // both painted threads, on 64 KB stacks. Waking up and exiting may
+    // have taken them a little deeper
+    long threads, size, mean, max_used, suggested;
+    istringstream fields(stack_line);
+    fields >> threads >> size >> mean >> max_used >> suggested;
+    assert(threads == 2 && size == STACK_SIZE);
+    assert(max_used >= highwater[1] && max_used < 20480);
+    assert(suggested > max_used && suggested < STACK_SIZE);
+    stack_found = true;
+  } // while
+  unlink(stack_path.c_str());
+  assert(stack_found);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing stack trimming ---------------------------------------------- */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_attr_setstacktrim\n" << endl;
+
+  // a thread that went 24 KB deep then blocked keeps those pages resident,
+  // unless its stack is trimmed
+  uthread_sem_init(&trim_sem, 0);
+  uthread_attr_t trim_attr;
+  uthread_attr_init(&trim_attr);
+  int trim_resident[2];
+  for (int trim = 0; trim < 2; trim++) {
+    uthread_attr_setstacktrim(&trim_attr, trim);
+    int trim_tid = uthread_create_attr(trim_test, nullptr, &trim_attr);
+    uthread_sleep_ns(10000000);
+    trim_resident[trim] = trim_resident_pages();
+    uthread_sem_post(&trim_sem);
+    void* trim_res = nullptr;
+    uthread_join(trim_tid, &trim_res);
+    assert(trim_res == (void*) true);
+  } // for
+  cerr << "Resident pages below the blocked thread: " << trim_resident[0]
+       << ", trimmed " << trim_resident[1] << "\t\tExpected: 3 or more, trimmed 0" << endl;
+  assert(trim_resident[0] >= 3 && trim_resident[1] == 0);
+
+  // a thread that suspends itself is trimmed as it blocks, and runs on
+  uthread_attr_setstacktrim(&trim_attr, 1);
+  int trim_tid = uthread_create_attr(suspend_test, nullptr, &trim_attr);
+  uthread_sleep_ns(10000000);
+  uthread_resume(trim_tid);
+  void* trim_res;
+  assert(uthread_join(trim_tid, &trim_res) == 0);
+  uthread_sem_destroy(&trim_sem);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
+  /* Testing uthread_stats ------------------------------------------------ */
+  cerr << setw(80) << setfill('+') << "" << endl;
+  cerr << "Testing uthread_stats and uthread_stats_serve\n" << endl;
+
+  // two threads block and one suspends itself. Earlier tests leave threads
+  // behind (the task pool), so only the differences are checked
+  uthread_stats_t stats0, stats1, stats2;
+  assert(uthread_stats(&stats0) == 0);
+  uthread_sem_init(&stats_sem, 0);
+  int stats_tids[3];
+  for (int i = 0; i < 3; i++)
+    stats_tids[i] = uthread_create(stats_test, i == 2 ? (void*) 1 : nullptr);
+  uthread_sleep_ns(20000000);
+  assert(uthread_stats(&stats1) == 0);
+  cerr << "Live, blocked, suspended: +" << stats1.live - stats0.live << " +"
+       << stats1.blocked - stats0.blocked << " +" << stats1.suspended - stats0.suspended
+       << "\t\tExpected: +3 +2 +1" << endl;
+  assert(stats1.live - stats0.live == 3);
+  assert(stats1.blocked - stats0.blocked == 2);
+  assert(stats1.suspended - stats0.suspended == 1);
+  uthread_sem_post(&stats_sem);
+  uthread_sem_post(&stats_sem);
+  uthread_resume(stats_tids[2]);
+  for (int i = 0; i < 3; i++) {
+    void* stats_res;
+    uthread_join(stats_tids[i], &stats_res);
+  } // for
+  uthread_sem_destroy(&stats_sem);
+  assert(uthread_stats(&stats2) == 0);
+  assert(stats2.live == stats0.live && stats2.blocked == stats0.blocked &&
+         stats2.suspended == stats0.suspended);
+  // each thread was switched to at least twice, and away from as often
+  cerr << "Switches: " << stats2.voluntary_switches << " voluntary, "
+       << stats2.involuntary_switches << " involuntary, run queue max "
+       << stats2.run_queue_max << endl;
+  assert(stats2.voluntary_switches - stats0.voluntary_switches >= 6);
+  assert(stats_count(stats2.ready_latency) - stats_count(stats0.ready_latency) >= 6);
+  assert(stats_count(stats2.slices) - stats_count(stats0.slices) >= 6);
+  assert(stats2.run_queue_max >= 1);
+
+  char stats_text[8192];
+  int stats_len = uthread_stats_format(&stats2, stats_text, sizeof(stats_text));
+  assert(stats_len > 0 && stats_len < (int) sizeof(stats_text));
+  assert(uthread_stats_format(&stats2, stats_text, 16) == stats_len);
+  assert(strlen(stats_text) == 15);
+
+  // scrape the statistics over a loopback socket
+  int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in stats_addr = {};
+  stats_addr.sin_family = AF_INET;
+  stats_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t stats_addr_len = sizeof(stats_addr);
+  assert(listen_fd != -1);
+  assert(bind(listen_fd, (struct sockaddr*) &stats_addr, sizeof(stats_addr)) == 0);
+  assert(listen(listen_fd, 16) == 0);
+  assert(getsockname(listen_fd, (struct sockaddr*) &stats_addr, &stats_addr_len) == 0);
+  assert(uthread_stats_serve(listen_fd) != -1);
+  int scrape_fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(uthread_connect(scrape_fd, (struct sockaddr*) &stats_addr, sizeof(stats_addr)) == 0);
+  const char* scrape_request = "GET /metrics HTTP/1.0\r\n\r\n";
+  assert(uthread_write(scrape_fd, scrape_request, strlen(scrape_request)) > 0);
+  string scrape;
+  char scrape_buf[4096];
+  ssize_t scrape_n;
+  while ((scrape_n = uthread_read(scrape_fd, scrape_buf, sizeof(scrape_buf))) > 0)
+    scrape.append(scrape_buf, scrape_n);
+  uthread_close(scrape_fd);
+  cerr << "Scraped " << scrape.size() << " bytes" << endl;
+  assert(scrape.compare(0, 15, "HTTP/1.0 200 OK") == 0);
+  assert(scrape.find("\nuthread_threads{state=\"live\"} ") != string::npos);
+  assert(scrape.find("\nuthread_switches_total{kind=\"voluntary\"} ") != string::npos);
+  assert(scrape.find("\nuthread_ready_latency_seconds_bucket{le=\"+Inf\"} ") != string::npos);
+  assert(scrape.find("\nuthread_slice_seconds_count ") != string::npos);
+
+  cerr << setw(80) << setfill('-') << "" << endl;
+
   /* Testing uthread_exit --------------------------------------------------- */
   cerr << setw(80) << setfill('+') << "" << endl;
   cerr << "Testing uthread_exit\n" << endl;
@@ -1,148 +1,1181 @@
 #include "uthread.h"
 #include "TCB.h"
+#include "WSDeque.h"
+#include "ThreadTable.h"
+#include "IoPoller.h"
+#include "TimerWheel.h"
+#include "Trace.h"
+#include "Profiler.h"
+#include "StackPool.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <cstdarg>
+#include <climits>
+#include <cstring>
 #include <deque>
 #include <map>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <ucontext.h>
 
 using namespace std;
 
+// A kernel thread that runs uthreads
+typedef struct worker {
+  int id;
+  pthread_t kthread;
+  int cpu;                  // cpu the kernel thread is pinned to, -1 if none
+  // threads made ready on this worker, one queue per level (see TCB::_level)
+  WSDeque ready_queues[UTHREAD_PRIO_LEVELS];
+  // thread woken last by the thread running here, served ahead of the
+  // others of its level (see uthread_set_runnext)
+  atomic<TCB*> run_next;
+  long long next_aging;     // when the worker next serves its lowest level first
+  atomic<long> quantums;    // quantums of the threads run on this worker
+  TCB* idle;                // runs when no thread is ready, never migrates
+  unsigned int yields;      // yields since I/O readiness was last polled
+  long long run_start;      // when the running thread was last charged
+  long long quantum_start;  // when the running thread's quantum started
+  timer_t timer;            // preemption ticks, on the worker's cpu time
+  atomic<pid_t> ktid;       // kernel thread id, set once the worker started
+  timer_t prof_timer;       // profiling samples, see uthread_prof_start
+  atomic<bool> ticking;     // timer is armed, see setTicking()
+  atomic_flag tick_lock;
+  // left by switchThreads() for the next thread, see finishSwitch()
+  TCB* prev;
+  bool requeue_prev;
+  bool unlock_after_switch;
+  // statistics for uthread_stats, only written by the worker's kernel
+  // thread (see addCounter)
+  long long switched_at;    // when the running thread was switched in
+  long run_queue_max;       // most entries the ready queues held
+  long voluntary;           // switches away from threads that gave up the cpu
+  long involuntary;         // switches away from preempted threads
+  long ready_latency[UTHREAD_STATS_BUCKETS];
+  long long ready_latency_sum;
+  long slices[UTHREAD_STATS_BUCKETS];
+  long long slices_sum;
+} worker_t;
+
 typedef struct uthread_info {
-  int num_threads;
   int quantum_usecs;
-  int running_tid;
-  bool interrupts_enabled;
+  int preempt_signo;        // signal of the preemption timers
+  int num_workers;
+  int policy;               // UTHREAD_SCHED_RR, _PRIO or _MLFQ
+  int num_levels;           // ready queue levels in use, 1 for round robin
+  long long aging_ns;       // interval between two aging picks
   struct sigaction sig_act;
-  TCB* threads[MAX_THREAD_NUM];
+  ThreadTable* threads;
+  worker_t* workers;
+  IoPoller* poller;         // fds that blocked threads wait on
+  TimerWheel* timers;       // deadlines of timed waits
 } uthread_info_t;
 
+// A running thread polls for I/O readiness every this many yields, so that
+// threads waiting on fds are woken even when the ready queues never drain
+static const unsigned int IO_POLL_INTERVAL = 16;
+// Maximum number of fd events handled per poll
+static const int IO_POLL_EVENTS = 64;
+// Most pool threads running submitted tasks at once
+static const int TASK_POOL_MAX = 64;
+// Rounds an idle worker looks for a ready thread before it goes to sleep
+static const int IDLE_SPINS = 64;
+// Preemption timer ticks per quantum. A thread is preempted at the first
+// tick after its quantum is over, so it runs for at most this many plus one
+// ticks
+static const int TICKS_PER_QUANTUM = 2;
+// Levels of the multilevel feedback queue
+static const int MLFQ_LEVELS = 4;
+// With levels, a worker serves its lowest level first once every this many
+// quantums, so that threads stuck below busy levels still run
+static const int AGING_QUANTUMS = 100;
+
 
 // Book-keeping structures ----------------------------------------------------
 
 // global uthread library info
 static uthread_info_t uthread_info;
-static deque<int> available_tids;
 
-static deque<TCB*> ready_queue;
+// The scheduler lock protects uthread_info.threads, the timer wheel and the
+// wait state kept in the TCBs (joiner, return value, suspended flag). Ready
+// queues are per worker and lock-free. The lock is only taken inside a
+// critical section
+static atomic_flag sched_lock = ATOMIC_FLAG_INIT;
+
+// number of timers in the wheel, readable without the lock
+static atomic<int> pending_timers(0);
+
+// whether threads woken by the running thread go to the run_next slot
+static atomic<bool> runnext_enabled(false);
+
+// Thread counts for uthread_stats, guarded by the scheduler lock
+static long num_live = 0;
+static long num_blocked = 0;       // waiting on anything but uthread_resume
+static long num_suspended = 0;
+
+#ifndef UTHREAD_NO_TRACE
+// Scheduler events, a ring per worker and one for the other kernel threads.
+// Allocated by the first uthread_trace_start and kept until exit
+static TraceRing** trace_rings = nullptr;
+static atomic<bool> trace_enabled(false);
+#endif
+
+// CPU profile samples, a buffer per worker. Allocated, along with the
+// workers' profiling timers, by the first uthread_prof_start and kept until
+// exit
+static ProfBuffer** prof_buffers = nullptr;
+static atomic<bool> prof_enabled(false);
+
+// Stack use of the threads that finished with a painted stack, by start
+// routine, for uthread_stack_report. Guarded by the scheduler lock, as is
+// whether threads created from now on get painted stacks
+typedef struct stack_usage {
+  long threads;
+  size_t stack_size;        // largest stack one of them had
+  long max_used;
+  long long total_used;
+} stack_usage_t;
+static map<void*, stack_usage_t> stack_usage;
+static bool stack_paint = false;
+
+// Stack of the main thread, which does not come from the stack pool
+static char* main_stack_lo = nullptr;
+static char* main_stack_hi = nullptr;
+
+// Tasks submitted with uthread_submit wait in a FIFO queue for one of the
+// pool threads, which park on pool_waiters when it is empty. The pool
+// grows by one thread whenever a task finds no thread parked and none
+// about to look at the queue, up to TASK_POOL_MAX, and a pool thread that
+// leaves tasks behind in the queue gets another one going while fewer
+// pool threads than workers are busy. Guarded by the scheduler lock
+static uthread_future_t* task_head = nullptr;
+static uthread_future_t* task_tail = nullptr;
+static uthread_waitq_t pool_waiters = {nullptr, nullptr};
+static int pool_size = 0;
+static int pool_pending = 0;      // created or woken, not yet at the queue
+static int pool_busy = 0;         // running a task
+
+// Threads made ready by kernel threads that are not workers (see
+// uthread_resume). Only its owner may push to a worker's ready queue, so
+// they wait here until a worker takes them
+static deque<TCB*> injected;
+static atomic_flag inject_lock = ATOMIC_FLAG_INIT;
+static atomic<int> num_injected(0);
+
+// Idle workers. A worker that runs out of threads spins for a while, then
+// parks: the first to park sleeps in epoll, which also ends at the next
+// timer deadline, the others sleep on the idle_seq futex. Making a thread
+// ready wakes a parked worker unless one is still spinning
+static atomic<int> idle_spinning(0);
+static atomic<int> idle_parked(0);
+static atomic<unsigned int> idle_seq(0);            // bumped by every wakeup
+static atomic<bool> epoll_sleeper(false);           // a worker sleeps in epoll
+// when the worker sleeping in epoll wakes up on its own (LLONG_MAX if
+// never, LLONG_MIN if no worker sleeps there)
+static atomic<long long> epoll_sleep_until(LLONG_MIN);
+
+// worker and thread running on the calling kernel thread
+static thread_local worker_t* tls_worker;
+static thread_local TCB* tls_current;
+
+// Per kernel thread state -----------------------------------------------------
+
+// A thread may be resumed on another kernel thread after a switch, so the
+// TLS address must never be cached across one: always go through these.
+// The worker is only stable inside a critical section, the current thread
+// is always the caller itself
+static __attribute__((noinline)) worker_t* thisWorker() {
+  return tls_worker;
+} // thisWorker()
+
+static __attribute__((noinline)) TCB* currentThread() {
+  return tls_current;
+} // currentThread()
+
+// Pin the calling kernel thread to the worker's cpu
+static void pinWorker(worker_t* worker) {
+  if (worker->cpu < 0)
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(worker->cpu, &set);
+  int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (res != 0)
+    cerr << "Error - failed to pin worker " << worker->id << endl;
+} // pinWorker()
+
+// Scheduler lock --------------------------------------------------------------
+
+static void lockScheduler() {
+  int spins = 0;
+  while (sched_lock.test_and_set(memory_order_acquire)) {
+    // the holder may have been descheduled by the kernel
+    if (++spins % 64 == 0)
+      sched_yield();
+  } // while
+} // lockScheduler()
+
+static void unlockScheduler() {
+  sched_lock.clear(memory_order_release);
+} // unlockScheduler()
+
+static long long nowNs();
+
+// Tracing ---------------------------------------------------------------------
+
+// Record an event in the calling kernel thread's ring while tracing is on,
+// at ts if the caller read the clock already. Called inside critical
+// sections, and by the timer handler outside of them, so a worker's events
+// are never interleaved. Compiled out with UTHREAD_NO_TRACE (make NOTRACE=1)
+static inline __attribute__((always_inline))
+void trace(int type, int tid, int reason = TRACE_NONE, long long ts = -1) {
+#ifndef UTHREAD_NO_TRACE
+  // the rings are allocated before tracing is first turned on
+  if (!trace_enabled.load(memory_order_acquire))
+    return;
+  if (ts < 0)
+    ts = nowNs();
+  worker_t* worker = thisWorker();
+  if (worker != nullptr)
+    trace_rings[worker->id]->record(ts, tid, type, reason);
+  else
+    trace_rings[uthread_info.num_workers]->recordShared(ts, tid, type, reason);
+#endif
+} // trace()
+
+// Statistics ------------------------------------------------------------------
+
+// Add to a worker's statistic. Only the worker itself writes it, so a plain
+// load and store will do, while uthread_stats reads it from any kernel thread
+template <typename T>
+static inline void addCounter(T* counter, T n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+} // addCounter()
+
+// Histogram bucket of a time: floor(log2(ns)), the last bucket taking
+// everything longer
+static int statsBucket(long long ns) {
+  if (ns <= 1)
+    return 0;
+  int bucket = 63 - __builtin_clzll(ns);
+  return bucket < UTHREAD_STATS_BUCKETS ? bucket : UTHREAD_STATS_BUCKETS - 1;
+} // statsBucket()
+
+// Count a switch at now on the calling worker: the slice tcb_old ran for,
+// unless it is the idle thread, and the time tcb_new waited in the ready
+// queue, unless it did not come from one
+static void countSwitch(TCB* tcb_old, TCB* tcb_new, bool preempted, long long now) {
+  worker_t* worker = thisWorker();
+  if (tcb_old->getId() >= 0) {
+    long long slice = now - worker->switched_at;
+    addCounter(preempted ? &worker->involuntary : &worker->voluntary, 1L);
+    addCounter(&worker->slices[statsBucket(slice)], 1L);
+    addCounter(&worker->slices_sum, slice);
+  } // if
+  worker->switched_at = now;
+  if (tcb_new->_ready_since >= 0) {
+    long long waited = now - tcb_new->_ready_since;
+    addCounter(&worker->ready_latency[statsBucket(waited)], 1L);
+    addCounter(&worker->ready_latency_sum, waited);
+    tcb_new->_ready_since = -1;
+  } // if
+} // countSwitch()
 
-// key for finished_map is the finished thread's tid
-// value is the threads return pointer
-static map<int, void*> finished_map;
+// Profiling -------------------------------------------------------------------
 
-// key is the tid of the thread that join_map member is waiting for
-static map<int, TCB*> join_map;
+// Fill a sample with the thread's tid and its frames, innermost first: pc,
+// then the return addresses found by following the frame pointers from fp.
+// A frame must lie within the thread's stack, above the one before it, so
+// that code built without frame pointers ends the walk instead of faulting
+static void unwindStack(TCB* tcb, uintptr_t pc, uintptr_t fp, ProfSample* sample) {
+  uintptr_t lo = (uintptr_t) tcb->getStack();
+  uintptr_t hi = lo + tcb->getStackSize();
+  if (tcb->getStack() == nullptr) {
+    lo = (uintptr_t) main_stack_lo;
+    hi = (uintptr_t) main_stack_hi;
+  } // if
+  sample->tid = tcb->getId();
+  sample->pcs[0] = (void*) pc;
+  int depth = 1;
+  // a frame holds the caller's frame pointer, then the return address
+  while (depth < PROF_MAX_DEPTH && fp >= lo && fp + 2 * sizeof(uintptr_t) <= hi &&
+         fp % sizeof(uintptr_t) == 0) {
+    uintptr_t* frame = (uintptr_t*) fp;
+    if (frame[1] == 0)
+      break;
+    sample->pcs[depth++] = (void*) frame[1];
+    if (frame[0] <= fp)
+      break;
+    fp = frame[0];
+  } // while
+  sample->depth = depth;
+} // unwindStack()
 
-// key is tid of suspended thread
-static map<int, TCB*> suspend_map;
+// Sample the thread the worker was running when its profiling timer fired.
+// The preemption signal is blocked meanwhile, so no other thread of the
+// worker can take a sample before this one is committed
+static void prof_handler(int signo, siginfo_t* info, void* context) {
+  int saved_errno = errno;
+  worker_t* worker = thisWorker();
+  TCB* tcb = currentThread();
+  if (prof_enabled.load(memory_order_relaxed) && worker != nullptr && tcb != nullptr) {
+    ucontext_t* uc = (ucontext_t*) context;
+#if defined(__x86_64__)
+    uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+    uintptr_t pc = uc->uc_mcontext.pc;
+    uintptr_t fp = uc->uc_mcontext.regs[29];
+#else
+    // no unwinding, only the tid is recorded
+    uintptr_t pc = 0;
+    uintptr_t fp = 0;
+#endif
+    ProfBuffer* buffer = prof_buffers[worker->id];
+    unwindStack(tcb, pc, fp, buffer->next());
+    buffer->commit();
+  } // if
+  errno = saved_errno;
+} // prof_handler()
 
 // Interrupt Management --------------------------------------------------------
 
-// Start a countdown timer to fire an interrupt
-static void startInterruptTimer() {
-  // initialize itmerval structs needed for setitimer call
-  struct itimerval it;
-  it.it_value.tv_sec = uthread_info.quantum_usecs / 1000000;
-  it.it_value.tv_usec = uthread_info.quantum_usecs % 1000000;
-  it.it_interval = it.it_value;
-  int res = setitimer(ITIMER_VIRTUAL, &it, NULL);  
-  if (res == -1)
-    cerr << "Error - failed to set interrupt timer" << endl;
-} // startInterruptTimer()
-
-// Block signals from firing timer interrupt
+static void setTicking(worker_t* worker, bool on);
+
+// Create and arm the preemption timer of the worker running on the calling
+// kernel thread. It counts that kernel thread's cpu time and signals it
+// alone, so workers do not share a timer and a sleeping worker gets no
+// ticks. Switches make no system call: they only note when the quantum
+// started, which the signal handler checks
+// Returns 0 on success, -1 on failure
+static int createTimer(worker_t* worker) {
+  // cooperative scheduling: no timer at all
+  if (uthread_info.quantum_usecs <= 0)
+    return 0;
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = uthread_info.preempt_signo;
+  sev._sigev_un._tid = syscall(SYS_gettid);
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &worker->timer) == -1) {
+    cerr << "Error - failed to create the preemption timer of worker " << worker->id << endl;
+    return -1;
+  } // if
+  // other kernel threads leave the timer alone until now
+  worker->ticking = false;
+  setTicking(worker, true);
+  return 0;
+} // createTimer()
+
+// Arm or stop a worker's preemption timer, unless it is in that state
+// already. A worker ticks while its running thread has others to give way
+// to, and stops when it runs alone (tickless, see uthread_yield). May be
+// called by other kernel threads than the worker's
+// NOTE: assumes interrupts are disabled
+static void setTicking(worker_t* worker, bool on) {
+  if (uthread_info.quantum_usecs <= 0 || worker->ticking.load(memory_order_relaxed) == on)
+    return;
+  while (worker->tick_lock.test_and_set(memory_order_acquire))
+    sched_yield();
+  if (worker->ticking != on) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (on) {
+      long long tick_ns = uthread_info.quantum_usecs * 1000LL / TICKS_PER_QUANTUM;
+      its.it_value.tv_sec = tick_ns / 1000000000;
+      its.it_value.tv_nsec = tick_ns % 1000000000;
+      its.it_interval = its.it_value;
+    } // if
+    if (timer_settime(worker->timer, 0, &its, NULL) == -1)
+      cerr << "Error - failed to set the preemption timer" << endl;
+    worker->ticking = on;
+  } // if
+  worker->tick_lock.clear(memory_order_release);
+} // setTicking()
+
+// Is the calling thread outside of a critical section. A kernel thread that
+// is not a worker (see uthread_resume) runs no thread and is never preempted
+static bool interruptsEnabled() {
+  TCB* tcb = currentThread();
+  return tcb == nullptr || ! tcb->_critical;
+} // interruptsEnabled()
+
+// Enter a critical section. No system call is made: a timer interrupt that
+// fires inside the section is deferred until enableInterrupts()
 static void disableInterrupts() {
-  assert(uthread_info.interrupts_enabled);
-  uthread_info.interrupts_enabled = false;
-  sigset_t imask;
-  if (sigemptyset(&imask) == -1)
-    cerr << "Error - failed to create empty signal mask" << endl;
-  else if (sigaddset(&imask, SIGVTALRM) == -1)
-    cerr << "Error - failed to add SIGVTALRM to signal mask" << endl;
-  else if (sigprocmask(SIG_BLOCK, &imask, NULL) == -1)
-    cerr << "Error - failed to disable SIGVTALRM" << endl;
+  TCB* tcb = currentThread();
+  if (tcb == nullptr)
+    return;
+  assert(! tcb->_critical);
+  tcb->_critical = true;
+  // keep the compiler from hoisting library state accesses above the flag
+  atomic_signal_fence(memory_order_seq_cst);
 } // disableInterrupts()
 
-// Unblock signals to re-enable timer interrupt
+// Leave a critical section, honoring any preemption deferred while inside it
 static void enableInterrupts() {
-  assert(! uthread_info.interrupts_enabled);
-  uthread_info.interrupts_enabled = true;
-  sigset_t imask;
-  if (sigemptyset(&imask) == -1)
-    cerr << "Error - failed to create empty signal mask" << endl;
-  else if (sigaddset(&imask, SIGVTALRM) == -1)
-    cerr << "Error - failed to add SIGVTALRM to signal mask" << endl;
-  else if (sigprocmask(SIG_UNBLOCK, &imask, NULL) == -1)
-    cerr << "Error - failed to enable SIGVTALRM" << endl;
+  TCB* tcb = currentThread();
+  if (tcb == nullptr)
+    return;
+  assert(tcb->_critical);
+  atomic_signal_fence(memory_order_seq_cst);
+  tcb->_critical = false;
+  atomic_signal_fence(memory_order_seq_cst);
+  if (tcb->_preempt_pending) {
+    // other threads run in between, keep the caller's errno
+    int saved_errno = errno;
+    uthread_yield();
+    errno = saved_errno;
+  } // if
 } // enableInterrupts()
 
 static void timer_handler(int signo) {
-  // preempt current running thread, and switch to next thread in ready queue
-  uthread_yield();
+  int saved_errno = errno;
+  TCB* tcb = currentThread();
+  long long now = nowNs();
+  if (tcb == nullptr) {
+    // kernel thread is not running uthreads yet
+  } else if (now - thisWorker()->quantum_start < uthread_info.quantum_usecs * 1000LL) {
+    // the thread is still within its quantum
+  } else if (tcb->_critical) {
+    // the thread is in a critical section, preempt when it is left
+    tcb->_preempt_pending = true;
+  } else {
+    // preempt current running thread, and switch to next thread in ready
+    // queue. The flag tells uthread_yield the thread used its whole quantum
+    tcb->_preempt_pending = true;
+    trace(TRACE_PREEMPT, tcb->getId(), TRACE_NONE, now);
+    uthread_yield();
+  } // else
+  errno = saved_errno;
 } // timer_handler()
 
+// Idle workers ----------------------------------------------------------------
+
+static void futexWait(atomic<unsigned int>* word, unsigned int expected) {
+  syscall(SYS_futex, (unsigned int*) word, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+} // futexWait()
+
+// Returns the number of kernel threads woken
+static int futexWake(atomic<unsigned int>* word, int count) {
+  return syscall(SYS_futex, (unsigned int*) word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+} // futexWake()
+
+// Wake a parked worker after a thread was made ready. A spinning worker
+// will find the thread on its own, so none is woken while one spins. A
+// worker about to park counts as parked before it stops spinning, and looks
+// at the ready queues once more after that, so the thread is never missed
+static void wakeIdleWorker() {
+  // order the push of the thread before the reads of the idle counts
+  atomic_thread_fence(memory_order_seq_cst);
+  if (idle_spinning.load(memory_order_relaxed) > 0 ||
+      idle_parked.load(memory_order_relaxed) == 0)
+    return;
+  idle_seq.fetch_add(1);
+  if (futexWake(&idle_seq, 1) == 0 && epoll_sleeper)
+    uthread_info.poller->interrupt();
+} // wakeIdleWorker()
+
 // Queue Management ------------------------------------------------------------
 
-// Add TCB to the back of the ready queue
-void addToReadyQueue(TCB *tcb) {
-  ready_queue.push_back(tcb);
+static void lockInjected() {
+  while (inject_lock.test_and_set(memory_order_acquire))
+    sched_yield();
+} // lockInjected()
+
+static void unlockInjected() {
+  inject_lock.clear(memory_order_release);
+} // unlockInjected()
+
+// Drop a reference to a TCB (see TCB::_refs), freeing it if it was the last
+static void dropThread(TCB* tcb) {
+  if (tcb->_refs.fetch_sub(1, memory_order_acq_rel) == 1)
+    delete tcb;
+} // dropThread()
+
+// Reclaim a finished thread that is off its stack: its tid is released, and
+// its TCB freed once no ready queue entry refers to it any more
+// NOTE: assumes the scheduler lock is held
+static void releaseThread(TCB* tcb) {
+  uthread_info.threads->release(tcb->getId());
+  dropThread(tcb);
+} // releaseThread()
+
+// Add TCB to the back of the calling worker's ready queue, or to the
+// injected threads if the caller is not a worker. With run_next set, and
+// uthread_set_runnext enabled, the TCB takes the worker's run_next slot
+// instead, and the thread it displaces goes to the back of the queue. The
+// TCB is ready since now, if the caller read the clock already
+void addToReadyQueue(TCB *tcb, bool run_next = false, long long now = -1) {
+  tcb->_ready_since = now >= 0 ? now : nowNs();
+  // the entry holds a reference until it is popped, even if the thread is
+  // claimed elsewhere meanwhile
+  tcb->_refs.fetch_add(1, memory_order_relaxed);
+  worker_t* worker = thisWorker();
+  if (worker == nullptr) {
+    lockInjected();
+    injected.push_back(tcb);
+    num_injected++;
+    unlockInjected();
+    wakeIdleWorker();
+    // a worker running a thread alone does not tick (see uthread_yield),
+    // and would never give way to this one
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int i = 0; i < uthread_info.num_workers; i++)
+      setTicking(&uthread_info.workers[i], true);
+    return;
+  } // if
+  // the thread running here has company now, it may be preempted
+  setTicking(worker, true);
+  if (run_next && runnext_enabled.load(memory_order_relaxed)) {
+    // the caller usually blocks or yields soon, and the thread runs next
+    // on this worker with the data it was given still in cache
+    tcb = worker->run_next.exchange(tcb);
+    if (tcb == nullptr)
+      return;
+  } // if
+  worker->ready_queues[tcb->_level].push(tcb);
+  long queued = 0;
+  for (int level = 0; level < uthread_info.num_levels; level++)
+    queued += worker->ready_queues[level].size();
+  if (queued > worker->run_queue_max)
+    __atomic_store_n(&worker->run_queue_max, queued, __ATOMIC_RELAXED);
+  // a lone worker is busy running the caller, it cannot be idle
+  if (uthread_info.num_workers > 1)
+    wakeIdleWorker();
 } // addToReadyQueue()
 
-// Removes and returns the first TCB on the ready queue
-// NOTE: Assumes at least one thread on the ready queue
-TCB* popFromReadyQueue() {
-  assert(!ready_queue.empty());
-  TCB *ready_queue_head = ready_queue.front();
-  ready_queue.pop_front();
-  return ready_queue_head;
-} // popFromReadyQueue()
+// Claim the first injected thread that is still ready
+static TCB* popInjected() {
+  lockInjected();
+  while (!injected.empty()) {
+    TCB* tcb = injected.front();
+    injected.pop_front();
+    num_injected--;
+    bool claimed = tcb->casState(READY, RUNNING);
+    dropThread(tcb);
+    if (claimed) {
+      unlockInjected();
+      return tcb;
+    } // if
+  } // while
+  unlockInjected();
+  return nullptr;
+} // popInjected()
 
-// Removes the thread specified by the TID provided from the ready queue
-// Returns 0 on success, and -1 on failure (thread not in ready queue)
-int removeFromReadyQueue(int tid) {
-  for (deque<TCB*>::iterator iter = ready_queue.begin(); iter != ready_queue.end(); ++iter) {
-    if (tid == (*iter)->getId()) {
-      ready_queue.erase(iter);
-      return 0;
+// Take the TCB in a worker's run_next slot if it is of the given level.
+// Returns nullptr if there is none, or its thread was suspended meanwhile
+static TCB* popRunNext(worker_t* worker, int level) {
+  if (worker->run_next.load(memory_order_relaxed) == nullptr)
+    return nullptr;
+  // only the slot's reference keeps the TCB alive, so it is taken out
+  // before its level is looked at
+  TCB* tcb = worker->run_next.exchange(nullptr);
+  if (tcb == nullptr)
+    return nullptr;
+  if (tcb->_level != level) {
+    // put it back, or if the worker filled the slot meanwhile, have it wait
+    // with the injected threads
+    TCB* empty = nullptr;
+    if (!worker->run_next.compare_exchange_strong(empty, tcb)) {
+      lockInjected();
+      injected.push_back(tcb);
+      num_injected++;
+      unlockInjected();
     } // if
+    return nullptr;
+  } // if
+  bool claimed = tcb->casState(READY, RUNNING);
+  dropThread(tcb);
+  return claimed ? tcb : nullptr;
+} // popRunNext()
+
+// Removes and returns the first ready TCB of a level, looking at the calling
+// worker's run_next slot and queue first, then stealing from the other
+// workers, their run_next slots last. The TCB is claimed by moving it from
+// READY to RUNNING: entries whose thread was suspended while queued are
+// skipped
+static TCB* popFromLevel(worker_t* self, int level) {
+  TCB* tcb = popRunNext(self, level);
+  if (tcb != nullptr)
+    return tcb;
+  for (int i = 0; i < uthread_info.num_workers; i++) {
+    worker_t* worker = &uthread_info.workers[(self->id + i) % uthread_info.num_workers];
+    int res;
+    while ((res = worker->ready_queues[level].steal(&tcb)) != 0) {
+      if (res == 1) {
+        bool claimed = tcb->casState(READY, RUNNING);
+        dropThread(tcb);
+        if (claimed)
+          return tcb;
+      } // if
+    } // while
+    if (i > 0 && (tcb = popRunNext(worker, level)) != nullptr)
+      return tcb;
   } // for
-  // Thread not found
-  return -1;
-} // removeFromReadyQueue()
+  return nullptr;
+} // popFromLevel()
+
+// Removes and returns the first ready TCB of the first level up to
+// max_level that has one, and finally an injected thread. Every aging_ns
+// the lowest level that has a thread goes first instead, whatever
+// max_level; under MLFQ that thread starts over at the top
+// Returns nullptr if no thread is ready
+TCB* popFromReadyQueue(int max_level = UTHREAD_PRIO_LEVELS - 1) {
+  worker_t* self = thisWorker();
+  TCB* tcb;
+  if (uthread_info.num_levels > 1) {
+    long long now = nowNs();
+    if (now >= self->next_aging) {
+      self->next_aging = now + uthread_info.aging_ns;
+      for (int level = uthread_info.num_levels - 1; level > 0; level--) {
+        if ((tcb = popFromLevel(self, level)) != nullptr) {
+          if (uthread_info.policy == UTHREAD_SCHED_MLFQ)
+            tcb->_level = 0;
+          return tcb;
+        } // if
+      } // for
+    } // if
+  } // if
+  for (int level = 0; level < uthread_info.num_levels && level <= max_level; level++) {
+    if ((tcb = popFromLevel(self, level)) != nullptr)
+      return tcb;
+  } // for
+  if (num_injected.load(memory_order_relaxed) > 0)
+    return popInjected();
+  return nullptr;
+} // popFromReadyQueue()
+
+// Whether any ready queue holds an entry, possibly of a suspended thread
+static bool anyQueued() {
+  for (int i = 0; i < uthread_info.num_workers; i++) {
+    if (uthread_info.workers[i].run_next.load() != nullptr)
+      return true;
+    for (int level = 0; level < uthread_info.num_levels; level++) {
+      if (uthread_info.workers[i].ready_queues[level].size() > 0)
+        return true;
+    } // for
+  } // for
+  return num_injected.load() > 0;
+} // anyQueued()
+
+// Level a thread is queued at when it starts, and after uthread_setprio
+static int initialLevel(TCB* tcb) {
+  return uthread_info.policy == UTHREAD_SCHED_PRIO ? tcb->_prio : 0;
+} // initialLevel()
+
+// Under MLFQ, move the calling thread down a level if it used up its
+// quantum, up one if it gave up the cpu before
+static void feedback(TCB* tcb, bool used_quantum) {
+  if (uthread_info.policy != UTHREAD_SCHED_MLFQ)
+    return;
+  if (used_quantum && tcb->_level < MLFQ_LEVELS - 1)
+    tcb->_level++;
+  else if (!used_quantum && tcb->_level > 0)
+    tcb->_level--;
+} // feedback()
+
+// Wait queues of blocked threads (see uthread_waitq_t). A thread is on at
+// most one, and knows which, so a timed out wait can leave it in O(1)
+// NOTE: assume the scheduler lock is held
+
+static void waitqPush(uthread_waitq_t* q, TCB* tcb) {
+  tcb->_wait_queue = q;
+  tcb->_wait_next = nullptr;
+  tcb->_wait_prev = (TCB*) q->tail;
+  if (q->tail != nullptr)
+    ((TCB*) q->tail)->_wait_next = tcb;
+  else
+    q->head = tcb;
+  q->tail = tcb;
+} // waitqPush()
+
+static void waitqRemove(TCB* tcb) {
+  uthread_waitq_t* q = tcb->_wait_queue;
+  if (tcb->_wait_prev != nullptr)
+    tcb->_wait_prev->_wait_next = tcb->_wait_next;
+  else
+    q->head = tcb->_wait_next;
+  if (tcb->_wait_next != nullptr)
+    tcb->_wait_next->_wait_prev = tcb->_wait_prev;
+  else
+    q->tail = tcb->_wait_prev;
+  tcb->_wait_queue = nullptr;
+  tcb->_wait_next = nullptr;
+  tcb->_wait_prev = nullptr;
+} // waitqRemove()
+
+static TCB* waitqPop(uthread_waitq_t* q) {
+  TCB* tcb = (TCB*) q->head;
+  if (tcb != nullptr)
+    waitqRemove(tcb);
+  return tcb;
+} // waitqPop()
+
+// Drop the thread's timer if it has one pending
+// NOTE: assumes the scheduler lock is held
+static void cancelTimer(TCB* tcb) {
+  if (TimerWheel::pending(&tcb->_timer)) {
+    uthread_info.timers->cancel(&tcb->_timer);
+    pending_timers--;
+  } // if
+} // cancelTimer()
+
+// Drop the registrations of a thread blocked in uthread_poll on all its fds,
+// so that only the first event (or its timeout) wakes it
+// NOTE: assumes the scheduler lock is held
+static void dropPollFds(TCB* tcb) {
+  for (nfds_t i = 0; i < tcb->_poll_nfds; i++) {
+    if (tcb->_poll_fds[i].fd >= 0)
+      uthread_info.poller->disarm(tcb->_poll_fds[i].fd, tcb);
+  } // for
+  tcb->_poll_fds = nullptr;
+  tcb->_poll_nfds = 0;
+} // dropPollFds()
+
+// Make a blocked thread runnable again, cancelling the timeout of its wait.
+// Does nothing if the thread was already made ready (e.g. by its timeout),
+// or if it is suspended: only uthread_resume makes it ready then. A thread
+// the running thread woke may run right after it (run_next), one woken by a
+// timer or an fd event waits its turn
+// NOTE: assumes the scheduler lock is held
+static bool readyThread(TCB* tcb, bool run_next = true) {
+  if (tcb->_suspended)
+    return false;
+  cancelTimer(tcb);
+  if (!tcb->casState(BLOCK, READY))
+    return false;
+  num_blocked--;
+  if (tcb->_poll_fds != nullptr)
+    dropPollFds(tcb);
+  addToReadyQueue(tcb, run_next);
+  return true;
+} // readyThread()
+
+// I/O and timer polling -------------------------------------------------------
+
+// Monotonic clock in nanoseconds
+static long long nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+} // nowNs()
+
+// Make the threads waiting on fds that became ready runnable, waiting up to
+// timeout_ns for one (-1 waits indefinitely). With no fd waited on, this only
+// sleeps for the timeout. An interrupt of the poller ends the wait early.
+// Returns the number of threads woken.
+// NOTE: assumes interrupts are disabled and the scheduler lock is not held
+static int pollIo(long long timeout_ns) {
+  if (uthread_info.poller->waiting() == 0 && timeout_ns == 0)
+    return 0;
+  struct epoll_event events[IO_POLL_EVENTS];
+  int n = uthread_info.poller->wait(events, IO_POLL_EVENTS, timeout_ns);
+  if (n == 0)
+    return 0;
+  int woken = 0;
+  lockScheduler();
+  for (int i = 0; i < n; i++) {
+    TCB* tcb[2];
+    int k = uthread_info.poller->dispatch(&events[i], tcb);
+    // a thread in uthread_poll may wait on several fds that fire together
+    for (int j = 0; j < k; j++)
+      woken += readyThread(tcb[j], false);
+  } // for
+  unlockScheduler();
+  return woken;
+} // pollIo()
+
+// Start the timeout of the calling thread's next wait
+// NOTE: assumes the scheduler lock is held
+static void armTimer(TCB* tcb, long long deadline) {
+  tcb->_timer.deadline = deadline;
+  uthread_info.timers->add(&tcb->_timer);
+  pending_timers++;
+  // a worker sleeping in epoll would oversleep an earlier deadline
+  if (deadline < epoll_sleep_until.load())
+    uthread_info.poller->interrupt();
+} // armTimer()
+
+// Wake the threads whose timed waits expired. A thread that was queued on a
+// synchronization object leaves the queue, so it cannot be handed the
+// object any more. Returns the number of threads woken
+// NOTE: assumes the scheduler lock is held
+static int expireTimersLocked() {
+  int woken = 0;
+  Timer* timer = uthread_info.timers->advance(nowNs());
+  while (timer != nullptr) {
+    Timer* next = timer->next;
+    TCB* tcb = (TCB*) timer->owner;
+    pending_timers--;
+    tcb->_timed_out = true;
+    if (tcb->_wait_queue != nullptr)
+      waitqRemove(tcb);
+    woken += readyThread(tcb, false);
+    timer = next;
+  } // while
+  return woken;
+} // expireTimersLocked()
+
+// NOTE: assumes interrupts are disabled and the scheduler lock is not held
+static int expireTimers() {
+  if (pending_timers == 0)
+    return 0;
+  lockScheduler();
+  int woken = expireTimersLocked();
+  unlockScheduler();
+  return woken;
+} // expireTimers()
+
+// Sleep in epoll until an fd event, the next timer deadline or an interrupt
+// NOTE: assumes interrupts are disabled and the scheduler lock is not held
+static void sleepInEpoll() {
+  lockScheduler();
+  long long next = pending_timers > 0 ? uthread_info.timers->nextExpiry() : -1;
+  // set under the lock, so a timer armed from now on sees it
+  epoll_sleep_until = next == -1 ? LLONG_MAX : next;
+  unlockScheduler();
+  long long timeout = -1;
+  if (next != -1) {
+    timeout = next - nowNs();
+    if (timeout < 0)
+      timeout = 0;
+  } // if
+  pollIo(timeout);
+  epoll_sleep_until = LLONG_MIN;
+} // sleepInEpoll()
 
 // Helper functions ------------------------------------------------------------
 
-// Switch to the next ready thread
-static void switchThreads(TCB* tcb_old, TCB* tcb_new) {
+// Count a quantum for the thread and the library total
+static void countQuantum(TCB* tcb) {
+  tcb->increaseQuantum();
+  if (tcb->getId() >= 0) // not an idle thread
+    thisWorker()->quantums.fetch_add(1, memory_order_relaxed);
+} // countQuantum()
+
+// Charge a thread, and its cpu quota if it has one, for the time it ran
+// since it was last charged. CLOCK_MONOTONIC is read in the vDSO, where
+// CLOCK_THREAD_CPUTIME_ID takes a system call: a running thread's worker is
+// pinned and has its cpu to itself, so the two barely differ
+static void chargeCpu(TCB* tcb, long long now) {
+  worker_t* worker = thisWorker();
+  long long ran = now - worker->run_start;
+  worker->run_start = now;
+  tcb->_cpu_ns += ran;
+  uthread_quota_t* quota = tcb->_quota;
+  if (quota != nullptr) {
+    __atomic_fetch_add(&quota->used_ns, ran, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&quota->deficit_ns, ran, __ATOMIC_RELAXED);
+  } // if
+} // chargeCpu()
+
+// Park a thread that another worker suspended while it was running
+// NOTE: assumes the scheduler lock is held
+static void parkSuspended(TCB* tcb) {
+  tcb->setState(BLOCK);
+  tcb->_suspended = true;
+  num_suspended++;
+} // parkSuspended()
+
+// Add a finished thread's stack use to the report of its start routine
+// NOTE: assumes the scheduler lock is held
+static void countStackUsage(TCB* tcb, size_t stack_size) {
+  long used = tcb->getStackHighwater();
+  if (used < 0)
+    return;
+  stack_usage_t& usage = stack_usage[tcb->getStartRoutine()];
+  usage.threads++;
+  usage.stack_size = max(usage.stack_size, stack_size);
+  usage.max_used = max(usage.max_used, used);
+  usage.total_used += used;
+} // countStackUsage()
+
+// Complete a switch on the new thread's side. The previous thread is off its
+// stack now, so it can be made ready again (or parked, if it was suspended
+// while it ran) and the scheduler lock it held across the switch released
+static void finishSwitch() {
+  worker_t* worker = thisWorker();
+  TCB* prev = worker->prev;
+  if (worker->requeue_prev) {
+    // a thread that handed off to this one (see handOff()) held the lock
+    // across the switch, and requeueing it may take the lock again
+    if (worker->unlock_after_switch) {
+      unlockScheduler();
+      worker->unlock_after_switch = false;
+    } // if
+    if (prev->_suspend_pending) {
+      lockScheduler();
+      if (prev->_suspend_pending.exchange(false)) {
+        parkSuspended(prev);
+        // parked under the lock, so nobody can resume it meanwhile
+        if (prev->_trim_stack)
+          prev->trimStack();
+      } else {
+        prev->setState(READY);
+        addToReadyQueue(prev, false, worker->switched_at);
+      } // else
+      unlockScheduler();
+    } else {
+      prev->setState(READY);
+      addToReadyQueue(prev, false, worker->switched_at);
+    } // else
+  } else if (prev != nullptr && prev->getState() == FINISHED) {
+    // return the stack to the pool now rather than when the thread is joined.
+    // The scheduler lock is still held from uthread_exit
+    size_t stack_size = prev->getStackSize();
+    prev->releaseStack();
+    if (prev->_paint_stack)
+      countStackUsage(prev, stack_size);
+    if (prev->_detached) {
+      // nobody will join a detached thread, reclaim it now that it is off
+      // its stack
+      releaseThread(prev);
+    } // if
+  } else if (prev != nullptr && prev->_trim_stack && worker->unlock_after_switch &&
+             prev->getState() == BLOCK) {
+    // a thread that blocked holds the lock across the switch, so it cannot
+    // be woken before its stack is trimmed
+    prev->trimStack();
+  } // else if
+  if (worker->unlock_after_switch)
+    unlockScheduler();
+  worker->prev = nullptr;
+  worker->requeue_prev = false;
+  worker->unlock_after_switch = false;
+} // finishSwitch()
+
+// Switch to the next ready thread. If requeue_old is set tcb_old is put back
+// on the ready queue, and if unlock is set the scheduler lock is released,
+// both only once tcb_old's context has been saved. Unless new_quantum is
+// false, tcb_new starts a full quantum. A trace shows a tcb_old that is
+// neither requeued nor finished blocked on block_reason
+static void switchThreads(TCB* tcb_old, TCB* tcb_new, bool requeue_old, bool unlock,
+                          bool new_quantum = true, int block_reason = TRACE_ON_WAITQ) {
   // NOTE: assumes that interrupts are disabled prior to calling switchThreads()
-  assert(!uthread_info.interrupts_enabled);
-  // increment old thread's quantum count
-  tcb_old->increaseQuantum();
-  // flag is used to differentiate between the return from getcontext call
-  // and the moment when the thread is resumed
-  volatile int flag = 0;
-  int res = getcontext(&(tcb_old->_context));
-  if (res == -1) {
-    cerr << "Error - failed to save thread context" << endl;
-  } // if
-  // If flag == 1 then it was already set below so the thread should resume
-  if (flag == 1) {
+  assert(!interruptsEnabled());
+  // increment old thread's quantum count, and charge it for its run
+  countQuantum(tcb_old);
+  long long now = nowNs();
+  chargeCpu(tcb_old, now);
+  bool preempted = requeue_old && tcb_old->_preempt_pending;
+  trace(TRACE_SWITCH, tcb_new->getId(),
+        tcb_old->getState() == FINISHED ? TRACE_EXITED : !requeue_old ? block_reason :
+        preempted ? TRACE_PREEMPTED : TRACE_YIELDED, now);
+  countSwitch(tcb_old, tcb_new, preempted, now);
+  // the next thread starts a new quantum, drop any deferred preemption
+  tcb_new->_preempt_pending = false;
+  worker_t* worker = thisWorker();
+  worker->prev = tcb_old;
+  worker->requeue_prev = requeue_old;
+  worker->unlock_after_switch = unlock;
+  tls_current = tcb_new;
+  // a thread gets its stack when it first runs
+  if (!tcb_new->prepare()) {
+    cerr << "Error - failed to allocate a stack for thread " << tcb_new->getId() << endl;
+    abort();
+  } // if
+  // start a new quantum and run next thread. Returns once tcb_old is
+  // switched back to, possibly on another worker
+  if (new_quantum)
+    worker->quantum_start = now;
+  ctx_switch(&(tcb_old->_context), &(tcb_new->_context));
+  finishSwitch();
+} // switchThreads()
+
+// Next thread to run when the running thread blocks: the first ready thread,
+// or the worker's idle thread if there is none
+static TCB* nextThread() {
+  TCB* next = popFromReadyQueue();
+  if (next == nullptr)
+    next = thisWorker()->idle;
+  return next;
+} // nextThread()
+
+// Block the calling thread at the back of q (if not nullptr) until another
+// thread hands it the object it waits for and readies it, or until the
+// deadline (CLOCK_MONOTONIC ns, -1 for none) passes. If no other thread is
+// ready the worker idles until one is. reason is what a trace shows the
+// thread waiting on
+// Returns 0 when woken, -1 with errno set to ETIMEDOUT if the deadline
+// passed first
+// NOTE: assumes interrupts are disabled and the scheduler lock is held. The
+// lock is released on return
+static int blockOn(uthread_waitq_t* q, long long deadline = -1, int reason = TRACE_ON_WAITQ) {
+  TCB* tcb = currentThread();
+  tcb->_timed_out = false;
+  feedback(tcb, false);
+  // threads that only ever block never pass through uthread_yield, so
+  // expired timers are collected here too (before arming our own)
+  if (pending_timers > 0)
+    expireTimersLocked();
+  if (deadline >= 0)
+    armTimer(tcb, deadline);
+  TCB* next_thread = nextThread();
+  tcb->setState(BLOCK);
+  // a thread suspending itself is counted as suspended instead
+  if (!tcb->_suspended)
+    num_blocked++;
+  if (q != nullptr)
+    waitqPush(q, tcb);
+  // switch to a new thread, releasing the lock once blocked
+  switchThreads(tcb, next_thread, false, true, true, reason);
+  tcb->setState(RUNNING);
+  if (tcb->_timed_out) {
+    errno = ETIMEDOUT;
+    return -1;
+  } // if
+  return 0;
+} // blockOn()
+
+// Run a thread the caller just woke, such as a receiver handed a value,
+// right away instead of queueing it: the data it was given is still in
+// cache. The caller goes to the back of the ready queue
+// NOTE: assumes interrupts are disabled and the scheduler lock is held. The
+// lock is released on return
+static void handOff(TCB* tcb) {
+  cancelTimer(tcb);
+  if (!tcb->casState(BLOCK, RUNNING)) {
+    unlockScheduler();
     return;
   } // if
-  // set flag for when thread is resumed
-  flag = 1;
-  // update running_tid field in global uthread_info struct
-  uthread_info.running_tid = tcb_new->getId();
-  // reset timer and run next thread
-  startInterruptTimer();
-  setcontext(&(tcb_new->_context));
+  num_blocked--;
+  TCB* self = currentThread();
+  switchThreads(self, tcb, true, true);
+  self->setState(RUNNING);
+} // handOff()
+
+// Start the periods of a quota that began since the last one: each adds
+// quota_ns to the allowance, which first pays back what was overdrawn and
+// never exceeds quota_ns
+// NOTE: assumes the scheduler lock is held
+static void refillQuota(uthread_quota_t* quota, long long now) {
+  if (now < quota->next_refill)
+    return;
+  long long periods = (now - quota->next_refill) / quota->period_ns + 1;
+  quota->next_refill += periods * quota->period_ns;
+  long long deficit = __atomic_load_n(&quota->deficit_ns, __ATOMIC_RELAXED);
+  long long refill = min(periods * quota->quota_ns, quota->quota_ns - deficit);
+  __atomic_fetch_add(&quota->deficit_ns, refill, __ATOMIC_RELAXED);
+} // refillQuota()
+
+// Charge the calling thread for its run so far and, while its quota has no
+// allowance left, block it until the next period starts. Overdrawing by
+// more than a period's allowance takes more than one period to pay back
+// Returns whether the thread waited
+// NOTE: assumes interrupts are disabled
+static bool throttle(TCB* tcb) {
+  chargeCpu(tcb, nowNs());
+  uthread_quota_t* quota = tcb->_quota;
+  bool waited = false;
+  lockScheduler();
+  refillQuota(quota, nowNs());
+  while (__atomic_load_n(&quota->deficit_ns, __ATOMIC_RELAXED) <= 0) {
+    quota->throttled++;
+    blockOn(nullptr, quota->next_refill, TRACE_ON_QUOTA);
+    waited = true;
+    lockScheduler();
+    refillQuota(quota, nowNs());
+  } // while
+  unlockScheduler();
+  return waited;
+} // throttle()
+
+// Absolute deadline for a wait of timeout_ns from now
+static long long deadlineAfter(long long timeout_ns) {
+  return nowNs() + (timeout_ns > 0 ? timeout_ns : 0);
+} // deadlineAfter()
+
+// Put an idle worker to sleep until a thread may have become ready. The
+// first worker to park sleeps in epoll, so fd events and timers still wake
+// threads, the others on the idle_seq futex until wakeIdleWorker()
+// NOTE: called by idle threads only, which count as spinning until here
+static void parkWorker() {
+  unsigned int seq = idle_seq.load();
+  idle_parked.fetch_add(1);
+  idle_spinning.fetch_sub(1);
+  // a thread made ready while we still counted as spinning woke nobody
+  if (!anyQueued()) {
+    if (!epoll_sleeper.exchange(true)) {
+      sleepInEpoll();
+      epoll_sleeper = false;
+      // let a parked worker take over epoll while this one runs threads
+      if (idle_parked.load() > 1) {
+        idle_seq.fetch_add(1);
+        futexWake(&idle_seq, 1);
+      } // if
+    } else {
+      futexWait(&idle_seq, seq);
+    } // else
+  } // if
+  idle_spinning.fetch_add(1);
+  idle_parked.fetch_sub(1);
+} // parkWorker()
+
+// Starting point for a worker's idle thread. Stays in a critical section and
+// looks for a ready thread until one shows up on any worker, waking threads
+// whose timers expired or whose fds became ready meanwhile. If none shows
+// up for IDLE_SPINS rounds, the worker parks
+static void idleLoop(void* arg0, void* arg1) {
+  finishSwitch();
+  while (1) {
+    idle_spinning.fetch_add(1);
+    int spins = 0;
+    TCB* next;
+    while ((next = popFromReadyQueue()) == nullptr) {
+      if (expireTimers() > 0 || pollIo(0) > 0)
+        continue;
+      if (++spins < IDLE_SPINS) {
+        sched_yield();
+      } else {
+        parkWorker();
+        spins = 0;
+      } // else
+    } // while
+    // threads made ready while we spun woke nobody, pass the rest on
+    if (idle_spinning.fetch_sub(1) == 1 && anyQueued())
+      wakeIdleWorker();
+    switchThreads(currentThread(), next, false, false);
+  } // while
+} // idleLoop()
+
+// Starting point for worker kernel threads other than the main one
+static void* workerMain(void* arg) {
+  worker_t* worker = (worker_t*) arg;
+  tls_worker = worker;
+  tls_current = worker->idle;
+  worker->ktid = syscall(SYS_gettid);
+  pinWorker(worker);
+  if (createTimer(worker) == -1)
+    abort();
+  // leave the kernel thread's own stack for the idle thread's
+  if (!worker->idle->prepare()) {
+    cerr << "Error - failed to allocate a stack for worker " << worker->id << endl;
+    abort();
+  } // if
+  uthread_ctx_t boot;
+  ctx_switch(&boot, &(worker->idle->_context));
   assert(false); // should never reach here
-} // switchThreads()
+  return nullptr;
+} // workerMain()
 
 // Library functions -----------------------------------------------------------
 
 // Starting point for thread. Calls top-level thread function
 void stub(void *(*start_routine)(void *), void *arg) {
-  // enable interrupts in case they were disabled during 
-  // the context switch to the new thread
+  // complete the switch to the new thread, which started inside
+  // the critical section of the thread that switched to it
+  finishSwitch();
   enableInterrupts();
   // call the top-level thread funtion and then call uthread_exit after the
   // top-level function has returned
@@ -151,249 +1184,2136 @@ void stub(void *(*start_routine)(void *), void *arg) {
 } // stub()
 
 int uthread_init(int quantum_usecs) {
+  return uthread_init_workers(quantum_usecs, 1);
+} // uthread_init()
+
+int uthread_init_workers(int quantum_usecs, int num_workers) {
+  return uthread_init_sched(quantum_usecs, num_workers, UTHREAD_SCHED_RR);
+} // uthread_init_workers()
+
+int uthread_init_sched(int quantum_usecs, int num_workers, int policy) {
+  if (num_workers < 1) {
+    cerr << "Error - at least one worker is required" << endl;
+    return -1;
+  } // if
+  if (policy != UTHREAD_SCHED_RR && policy != UTHREAD_SCHED_PRIO &&
+      policy != UTHREAD_SCHED_MLFQ) {
+    cerr << "Error - unknown scheduling policy" << endl;
+    return -1;
+  } // if
   // Initialize any data structures
-  uthread_info.num_threads = 0;
   uthread_info.quantum_usecs = quantum_usecs;
-  uthread_info.interrupts_enabled = false;
-  for (int i = 0; i < MAX_THREAD_NUM; i++) {
-    uthread_info.threads[i] = nullptr;
-    available_tids.push_back(i);
+  uthread_info.num_workers = num_workers;
+  uthread_info.policy = policy;
+  if (policy == UTHREAD_SCHED_RR)
+    uthread_info.num_levels = 1;
+  else if (policy == UTHREAD_SCHED_PRIO)
+    uthread_info.num_levels = UTHREAD_PRIO_LEVELS;
+  else
+    uthread_info.num_levels = MLFQ_LEVELS;
+  uthread_info.aging_ns = AGING_QUANTUMS * (quantum_usecs > 0 ? quantum_usecs : 1000) * 1000LL;
+  uthread_info.threads = new ThreadTable();
+  uthread_info.poller = new IoPoller();
+  if (uthread_info.poller->init() == -1)
+    return -1;
+  uthread_info.timers = new TimerWheel(nowNs());
+  // Create the workers. With more than one, each is pinned to its own cpu
+  // (round robin over the cpus this process may run on)
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (num_workers > 1 && sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    CPU_ZERO(&allowed);
+  int num_cpus = CPU_COUNT(&allowed);
+  uthread_info.workers = new worker_t[num_workers];
+  for (int i = 0; i < num_workers; i++) {
+    worker_t* worker = &uthread_info.workers[i];
+    worker->id = i;
+    worker->cpu = -1;
+    worker->quantums = 0;
+    worker->next_aging = 0;
+    worker->run_next = nullptr;
+    worker->run_start = nowNs();
+    worker->quantum_start = worker->run_start;
+    // not ticking, but nobody may arm the timer before it exists
+    worker->ticking = true;
+    worker->tick_lock.clear();
+    worker->ktid = 0;
+    for (int cpu = 0, n = 0; num_cpus > 0 && cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &allowed) && n++ == i % num_cpus) {
+        worker->cpu = cpu;
+        break;
+      } // if
+    } // for
+    worker->idle = new TCB(-1, idleLoop, nullptr, nullptr, RUNNING);
+    worker->yields = 0;
+    worker->prev = nullptr;
+    worker->requeue_prev = false;
+    worker->unlock_after_switch = false;
+    worker->switched_at = worker->run_start;
+    worker->run_queue_max = 0;
+    worker->voluntary = 0;
+    worker->involuntary = 0;
+    for (int b = 0; b < UTHREAD_STATS_BUCKETS; b++) {
+      worker->ready_latency[b] = 0;
+      worker->slices[b] = 0;
+    } // for
+    worker->ready_latency_sum = 0;
+    worker->slices_sum = 0;
   } // for
   // Create a thread for the caller (main) thread.
   // Does not use uthread_create because it is already running
   // will have the thread id of 0
-  int tid = available_tids.front();  
+  int tid = uthread_info.threads->allocate();
   assert(tid == 0);
-  available_tids.pop_front();
-  TCB* tcb = new TCB(tid, nullptr, nullptr, RUNNING);
-  uthread_info.threads[tid] = tcb;
-  uthread_info.num_threads ++;
-  // Setup timer interrupt handler
+  TCB* tcb = new TCB(tid);
+  tcb->_level = initialLevel(tcb);
+  uthread_info.threads->set(tid, tcb);
+  num_live = 1;
+  // The calling kernel thread becomes worker 0
+  worker_t* worker = &uthread_info.workers[0];
+  worker->kthread = pthread_self();
+  worker->ktid = syscall(SYS_gettid);
+  pthread_attr_t main_attr;
+  void* main_stack;
+  size_t main_stack_size;
+  if (pthread_getattr_np(pthread_self(), &main_attr) == 0) {
+    if (pthread_attr_getstack(&main_attr, &main_stack, &main_stack_size) == 0) {
+      main_stack_lo = (char*) main_stack;
+      main_stack_hi = main_stack_lo + main_stack_size;
+    } // if
+    pthread_attr_destroy(&main_attr);
+  } // if
+  tls_worker = worker;
+  tls_current = tcb;
+  pinWorker(worker);
+  // Setup timer interrupt handler. A real-time signal leaves SIGVTALRM and
+  // SIGALRM to the program.
+  // SA_NODEFER keeps the signal unblocked while the handler runs, as the
+  // handler may switch to a thread that never returns through it
+  uthread_info.preempt_signo = SIGRTMIN;
   uthread_info.sig_act.sa_handler = timer_handler;
-  uthread_info.sig_act.sa_flags = 0;
+  uthread_info.sig_act.sa_flags = SA_NODEFER;
   int res = sigemptyset(&uthread_info.sig_act.sa_mask);
-  if (res == -1 || (sigaction(SIGVTALRM, &uthread_info.sig_act, NULL) == -1)) {
-    cerr << "Error - failed to set SIGVTALRM handler" << endl;
+  if (res == -1 || (sigaction(uthread_info.preempt_signo, &uthread_info.sig_act, NULL) == -1)) {
+    cerr << "Error - failed to set the preemption signal handler" << endl;
     return -1;
   } // if
-  // Start timer interrupt
-  startInterruptTimer();
+  // Start worker 0's timer interrupt. The other workers create their own
+  if (createTimer(worker) == -1)
+    return -1;
+  // Start the other workers' kernel threads
+  for (int i = 1; i < num_workers; i++) {
+    worker_t* other = &uthread_info.workers[i];
+    if (pthread_create(&other->kthread, NULL, workerMain, other) != 0) {
+      cerr << "Error - failed to start worker " << i << endl;
+      return -1;
+    } // if
+  } // for
   enableInterrupts();
   // Return 0 on success, -1 on failure
   return 0;
-} // uthread_init()
+} // uthread_init_sched()
+
+int uthread_attr_init(uthread_attr_t* attr) {
+  if (attr == nullptr)
+    return -1;
+  attr->stack_size = STACK_SIZE;
+  attr->guard_size = 1;
+  attr->detach_state = UTHREAD_CREATE_JOINABLE;
+  attr->stack_trim = 0;
+  return 0;
+} // uthread_attr_init()
+
+int uthread_attr_setstacksize(uthread_attr_t* attr, size_t stack_size) {
+  if (attr == nullptr || stack_size < (size_t) PTHREAD_STACK_MIN)
+    return -1;
+  attr->stack_size = stack_size;
+  return 0;
+} // uthread_attr_setstacksize()
+
+int uthread_attr_setguardsize(uthread_attr_t* attr, size_t guard_size) {
+  if (attr == nullptr)
+    return -1;
+  attr->guard_size = guard_size;
+  return 0;
+} // uthread_attr_setguardsize()
+
+int uthread_attr_setdetachstate(uthread_attr_t* attr, int detach_state) {
+  if (attr == nullptr || (detach_state != UTHREAD_CREATE_JOINABLE &&
+                          detach_state != UTHREAD_CREATE_DETACHED))
+    return -1;
+  attr->detach_state = detach_state;
+  return 0;
+} // uthread_attr_setdetachstate()
+
+int uthread_attr_setstacktrim(uthread_attr_t* attr, int stack_trim) {
+  if (attr == nullptr)
+    return -1;
+  attr->stack_trim = stack_trim != 0;
+  return 0;
+} // uthread_attr_setstacktrim()
 
 int uthread_create(void* (*start_routine)(void*), void* arg) {
-  assert(uthread_info.interrupts_enabled);
-  // Disable timer interrupts to avoid context switch during critical area
-  disableInterrupts();
+  return uthread_create_attr(start_routine, arg, nullptr);
+} // uthread_create()
+
+// Create a thread and add it to the ready queue. Its stack is allocated when
+// it is first scheduled. Returns the new tid, -1 on failure
+// NOTE: assumes the scheduler lock is held
+static int createThread(void* (*start_routine)(void*), void* arg,
+                        size_t stack_size, bool stack_guard, bool detached,
+                        bool stack_trim = false) {
   // Check to see if able to make thread
-  if (uthread_info.num_threads >= MAX_THREAD_NUM) {
+  int tid = uthread_info.threads->allocate();
+  if (tid == -1) {
     cerr << "Error - there are already MAX_THREAD_NUM threads running" << endl;
-    enableInterrupts();
     return -1;
   } // if
-  // Create a new thread and add it to the ready queue
-  assert(!available_tids.empty());
-  int tid = available_tids.front();  
-  available_tids.pop_front();
-  TCB* tcb = new TCB(tid, start_routine, arg, READY);
-  uthread_info.threads[tid] = tcb;
-  uthread_info.num_threads ++;
+  TCB* tcb = new TCB(tid, start_routine, arg, READY, stack_size, stack_guard);
+  tcb->_detached = detached;
+  tcb->_paint_stack = stack_paint;
+  tcb->_trim_stack = stack_trim;
+  tcb->_level = initialLevel(tcb);
+  uthread_info.threads->set(tid, tcb);
+  num_live++;
   addToReadyQueue(tcb);
+  trace(TRACE_CREATE, tid);
+  return tid;
+} // createThread()
+
+int uthread_create_attr(void* (*start_routine)(void*), void* arg,
+                        const uthread_attr_t* attr) {
+  size_t stack_size = attr != nullptr ? attr->stack_size : STACK_SIZE;
+  bool stack_guard = attr == nullptr || attr->guard_size > 0;
+  bool detached = attr != nullptr && attr->detach_state == UTHREAD_CREATE_DETACHED;
+  bool stack_trim = attr != nullptr && attr->stack_trim;
+  assert(interruptsEnabled());
+  // Disable timer interrupts to avoid context switch during critical area
+  disableInterrupts();
+  lockScheduler();
+  int tid = createThread(start_routine, arg, stack_size, stack_guard, detached, stack_trim);
+  unlockScheduler();
   enableInterrupts();
   // Return new thread ID on success
   return tid;
-} // uthread_create()
+} // uthread_create_attr()
 
 int uthread_yield(void) {
-  assert(uthread_info.interrupts_enabled);
+  assert(interruptsEnabled());
   // running thread voluntarily gives up the processor
   // disable interrupts to avoid preemption during context switches
   disableInterrupts();
   // get TCB for current thread
-  TCB* tcb = uthread_info.threads[uthread_self()];
-  // obtain next ready thread from ready queue
-  if (! ready_queue.empty()) {
-    TCB* next_thread = popFromReadyQueue();
-    // set current thread to READY state and place at end of ready queue
-    tcb->setState(READY);
-    addToReadyQueue(tcb);
-    // switch to new thread
-    switchThreads(tcb, next_thread);
+  TCB* tcb = currentThread();
+  // set if the timer preempts the thread, clear if it yields on its own
+  feedback(tcb, tcb->_preempt_pending);
+  // a thread whose quota ran out waits for the next period
+  if (tcb->_quota != nullptr && throttle(tcb)) {
+    enableInterrupts();
+    return 0;
+  } // if
+  // wake threads whose timed waits expired, and whose fds became ready
+  // now and then
+  expireTimers();
+  if (++thisWorker()->yields % IO_POLL_INTERVAL == 0)
+    pollIo(0);
+  // obtain next ready thread from ready queue. The caller goes on running
+  // rather than give way to a thread of a lower level
+  TCB* next_thread = popFromReadyQueue(tcb->_level);
+  if (next_thread != nullptr) {
+    // switch to new thread, the current thread is placed at the end of
+    // the ready queue once its context is saved
+    switchThreads(tcb, next_thread, true, false);
     // set state to reflect running state
     tcb->setState(RUNNING);
   } else { // no ready threads so just resume with new quantum
     // increment current thread quantum
-    tcb->increaseQuantum();
-    // reset timer
-    startInterruptTimer();
+    countQuantum(tcb);
+    tcb->_preempt_pending = false;
+    worker_t* worker = thisWorker();
+    worker->quantum_start = nowNs();
+    // nothing can become ready but by another thread or kernel thread, which
+    // restarts the timer (see addToReadyQueue). Until then the thread runs
+    // without ticks, unless it has a quota to keep to
+    if (tcb->_quota == nullptr && pending_timers == 0 &&
+        uthread_info.poller->waiting() == 0 && !anyQueued()) {
+      setTicking(worker, false);
+      // a kernel thread may have queued a thread before seeing the timer off
+      atomic_thread_fence(memory_order_seq_cst);
+      if (anyQueued())
+        setTicking(worker, true);
+    } // if
   } // else
-  // enable interrupts 
+  // enable interrupts
   enableInterrupts();
   return 0;
 } // uthread_yield()
 
+int uthread_yield_to(int tid) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  TCB* tcb = currentThread();
+  lockScheduler();
+  if (! uthread_info.threads->contains(tid)) {
+    cerr << "Error - invalid tid" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  // claim the thread where it waits, a ready queue or a run_next slot: its
+  // entry there is skipped when popped, and keeps the TCB alive until then
+  TCB* target = uthread_info.threads->lookup(tid);
+  if (target == nullptr || target == tcb || !target->casState(READY, RUNNING)) {
+    // blocked, running or finished: give way to whichever thread is next
+    unlockScheduler();
+    enableInterrupts();
+    return uthread_yield();
+  } // if
+  feedback(tcb, tcb->_preempt_pending);
+  // the target runs out the caller's quantum, and the caller goes to the
+  // back of the ready queue
+  switchThreads(tcb, target, true, true, false);
+  tcb->setState(RUNNING);
+  enableInterrupts();
+  return 0;
+} // uthread_yield_to()
+
+int uthread_set_runnext(int enable) {
+  runnext_enabled = enable != 0;
+  return 0;
+} // uthread_set_runnext()
+
+// A thread blocked joining others, kept on its own stack. uthread_join_any
+// queues one per tid, on the _joiners of each thread it waits for
+typedef struct join_waiter {
+  struct join_select* select;
+  TCB* target;
+  int index;                    // of the tid in the joined set
+  struct join_waiter* next;
+  struct join_waiter* prev;
+} join_waiter_t;
+
+// A blocked join, also on the joining thread's stack
+typedef struct join_select {
+  TCB* tcb;
+  join_waiter_t* waiters;       // one per tid
+  int num_waiters;
+  int fired;                    // index of the tid that finished, -1 until then
+} join_select_t;
+
+// Queues of join_waiter_t, reusing uthread_waitq_t
+// NOTE: assume the scheduler lock is held
+
+static void joinqPush(uthread_waitq_t* q, join_waiter_t* w) {
+  w->next = nullptr;
+  w->prev = (join_waiter_t*) q->tail;
+  if (q->tail != nullptr)
+    ((join_waiter_t*) q->tail)->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+} // joinqPush()
+
+static void joinqRemove(uthread_waitq_t* q, join_waiter_t* w) {
+  if (w->prev != nullptr)
+    w->prev->next = w->next;
+  else
+    q->head = w->next;
+  if (w->next != nullptr)
+    w->next->prev = w->prev;
+  else
+    q->tail = w->prev;
+} // joinqRemove()
+
+// Take all waiters of w's join off the threads they wait for, and wake the
+// joining thread to collect w's target, which has finished
+// NOTE: assumes the scheduler lock is held
+static void fireJoinWaiter(join_waiter_t* w) {
+  join_select_t* select = w->select;
+  for (int i = 0; i < select->num_waiters; i++) {
+    join_waiter_t* other = &select->waiters[i];
+    joinqRemove(&other->target->_joiners, other);
+  } // for
+  select->fired = w->index;
+  w->target->_join_pending++;
+  readyThread(select->tcb);
+} // fireJoinWaiter()
+
+// Hand the result of a finished thread to a joiner. The last of the joiners
+// its exit woke frees it; one that comes later only reads the result
+// NOTE: assumes the scheduler lock is held
+static void collectThread(TCB* tcb, void** retval, bool woken) {
+  if (retval != nullptr)
+    *retval = tcb->_retval;
+  if (woken)
+    tcb->_join_pending--;
+  // free the tid's slot, tid itself becomes stale
+  if (tcb->_join_pending == 0)
+    releaseThread(tcb);
+} // collectThread()
+
+// Join whichever of the n threads finishes first, giving up at the deadline
+// (-1 for none). Returns the index of the joined tid, -1 on failure
+static int joinThreads(const int* tids, int n, void** retval, long long deadline) {
+  assert(interruptsEnabled());
+  if (n <= 0) {
+    cerr << "Error - no tid to join" << endl;
+    return -1;
+  } // if
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcbs[n];
+  for (int i = 0; i < n; i++) {
+    tcbs[i] = uthread_info.threads->lookup(tids[i]);
+    if (! uthread_info.threads->contains(tids[i])) { // make sure tid is valid
+      cerr << "Error - tid does not exist" << endl;
+      unlockScheduler();
+      enableInterrupts();
+      return -1;
+    } else if (tcbs[i] == nullptr) {
+      // If the thread specified by tid is already terminated, just return
+      unlockScheduler();
+      enableInterrupts();
+      return i;
+    } else if (tids[i] == uthread_self()) {
+      cerr << "Error - thread trying to join self" << endl;
+      unlockScheduler();
+      enableInterrupts();
+      return -1;
+    } else if (tcbs[i]->_detached) {
+      cerr << "Error - cannot join a detached thread" << endl;
+      unlockScheduler();
+      enableInterrupts();
+      return -1;
+    } // else if
+  } // for
+  for (int i = 0; i < n; i++) {
+    if (tcbs[i]->getState() == FINISHED) {
+      collectThread(tcbs[i], retval, false);
+      unlockScheduler();
+      enableInterrupts();
+      return i;
+    } // if
+  } // for
+  // block until one of the threads finishes, it readies us when it exits.
+  // The worker idles if no other thread is ready
+  join_waiter_t waiters[n];
+  join_select_t select;
+  select.tcb = currentThread();
+  select.waiters = waiters;
+  select.num_waiters = n;
+  select.fired = -1;
+  for (int i = 0; i < n; i++) {
+    waiters[i].select = &select;
+    waiters[i].target = tcbs[i];
+    waiters[i].index = i;
+    joinqPush(&tcbs[i]->_joiners, &waiters[i]);
+  } // for
+  blockOn(nullptr, deadline, TRACE_ON_JOIN);
+  lockScheduler();
+  // a thread that finished as the deadline passed still counts
+  if (select.fired == -1) {
+    // timed out, the threads keep running and may be joined later
+    for (int i = 0; i < n; i++)
+      joinqRemove(&tcbs[i]->_joiners, &waiters[i]);
+    unlockScheduler();
+    enableInterrupts();
+    errno = ETIMEDOUT;
+    return -1;
+  } // if
+  collectThread(tcbs[select.fired], retval, true);
+  unlockScheduler();
+  enableInterrupts();
+  return select.fired;
+} // joinThreads()
+
 int uthread_join(int tid, void **retval) {
-  assert(uthread_info.interrupts_enabled);
+  return joinThreads(&tid, 1, retval, -1) == -1 ? -1 : 0;
+} // uthread_join()
+
+int uthread_join_timed(int tid, void **retval, long long timeout_ns) {
+  return joinThreads(&tid, 1, retval, deadlineAfter(timeout_ns)) == -1 ? -1 : 0;
+} // uthread_join_timed()
+
+int uthread_join_any(const int* tids, int n, void** retval) {
+  return joinThreads(tids, n, retval, -1);
+} // uthread_join_any()
+
+int uthread_detach(int tid) {
+  assert(interruptsEnabled());
   disableInterrupts();
-  if (tid >= MAX_THREAD_NUM || tid < 0) { // make sure tid is valid
+  lockScheduler();
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  if (tcb == nullptr) {
     cerr << "Error - tid does not exist" << endl;
+    unlockScheduler();
     enableInterrupts();
     return -1;
-  } else if (uthread_info.threads[tid] == nullptr) { 
-    // If the thread specified by tid is already terminated, just return
-    enableInterrupts();
-    return 0;
-  } else if (tid == uthread_self()) {
-    cerr << "Error - thread trying to join self" << endl;
+  } else if (tcb->_detached) {
+    cerr << "Error - thread is already detached" << endl;
+    unlockScheduler();
     enableInterrupts();
     return -1;
-  } else if (join_map.count(tid)) {
-    cerr << "Error - another thread is already waiting to join specified tid" << endl;
+  } else if (tcb->_joiners.head != nullptr || tcb->_join_pending > 0) {
+    cerr << "Error - other threads are joining specified tid" << endl;
+    unlockScheduler();
     enableInterrupts();
     return -1;
-  } else if (! finished_map.count(tid)) { // thread trying to join has not finished
-    if (ready_queue.empty()) {
-      // no other threads are ready to run, as such the current thread cannot
-      // block without the whole library blocking
-      cerr << "Error - specified tid is not finished, but current thread cannot" 
-           << " block to join specified tid as there are no ready threads" << endl;
-      enableInterrupts();
-      return -1;
-    } else {
-      // block until thread trying to join finishes
-      // set state to block
-      TCB* self_tcb = uthread_info.threads[uthread_self()];
-      self_tcb->setState(BLOCK);
-      // add self to join_map
-      join_map.emplace(tid, self_tcb); 
-      TCB* next_thread = popFromReadyQueue();
-      // switch to a new thread
-      switchThreads(self_tcb, next_thread);  
-      assert(!uthread_info.interrupts_enabled);
-      // thread specified by tid is ready to be joined
-      // set state to reflect current thread's running state
-      self_tcb->setState(RUNNING);
-    } // else 
-  } // else if 
-  // Set *retval to be the result of thread specified by tid 
-  *retval = finished_map.at(tid); 
-  // cleanup thread specified by tid
-  finished_map.erase(tid);
-  delete uthread_info.threads[tid];
-  uthread_info.threads[tid] = nullptr;
-  // add tid back to available queue
-  available_tids.push_back(tid);
-  uthread_info.num_threads --;
+  } // else if
+  if (tcb->getState() == FINISHED) {
+    // it is off its stack already (uthread_exit holds the scheduler lock
+    // until it has switched away), so reclaim it like a join would
+    releaseThread(tcb);
+  } else {
+    // finishSwitch reclaims it once it has switched away for the last time
+    tcb->_detached = true;
+  } // else
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_detach()
 
+int uthread_sleep_ns(long long ns) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  // a sleep is a wait that only its timeout ends
+  blockOn(nullptr, deadlineAfter(ns), TRACE_ON_SLEEP);
   enableInterrupts();
   return 0;
-} // uthread_join()
+} // uthread_sleep_ns()
 
 void uthread_exit(void *retval) {
-  assert(uthread_info.interrupts_enabled);
+  assert(interruptsEnabled());
   disableInterrupts();
   // If this is the main thread, exit the program
   int tid = uthread_self();
   if (tid == 0) { // uthread_exit called on main thread -- exit program
     exit(0);
   } // if
-  // Move any thread joined on this thread back to the ready queue
-  if (join_map.count(tid)) {
-    TCB* join_thread = join_map.at(tid);
-    join_map.erase(tid);
-    join_thread->setState(READY);
-    addToReadyQueue(join_thread);
-  } // if
-  // Move this thread to the finished map 
-  TCB* this_thread = uthread_info.threads[tid]; 
+  lockScheduler();
+  TCB* this_thread = currentThread();
+  // Move every thread joining this thread back to the ready queue
+  while (this_thread->_joiners.head != nullptr)
+    fireJoinWaiter((join_waiter_t*) this_thread->_joiners.head);
+  // Keep the result in the TCB until the thread is joined
+  this_thread->_retval = retval;
+  if (this_thread->_quota != nullptr)
+    this_thread->_quota->members--;
   this_thread->setState(FINISHED);
-  finished_map.emplace(tid, retval);
-  // switch to next ready thread
-  assert(!ready_queue.empty());
-  TCB* next_thread = popFromReadyQueue();
-  switchThreads(this_thread, next_thread); 
+  num_live--;
+  // switch to next ready thread. The lock is held until this thread is off
+  // its stack, so a joiner cannot free the stack while it is in use
+  switchThreads(this_thread, nextThread(), false, true);
   assert(false); // should never be scheduled again
 } // uthread_exit()
 
 int uthread_suspend(int tid) {
-  assert(uthread_info.interrupts_enabled);
-  if (tid >= MAX_THREAD_NUM || tid < 0) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (! uthread_info.threads->contains(tid)) {
     cerr << "Error - invalid tid" << endl;
+    unlockScheduler();
+    enableInterrupts();
     return -1;
   } // if
-  disableInterrupts();
   // Move the thread specified by tid from whatever state it is
   // in to the block queue
-  if (tid == uthread_self()) { 
-    if (ready_queue.empty()) {
-      cerr << "Error - Attempted to suspend only runnable thread" << endl;
-      enableInterrupts();
-      return -1;
-    } // if
-  } else if (removeFromReadyQueue(tid) == -1){ // not in ready queue and not running
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  if (tid == uthread_self()) {
+    // block until resumed, releasing the lock once suspended. The worker
+    // idles if no other thread is ready
+    tcb->_suspended = true;
+    num_suspended++;
+    trace(TRACE_SUSPEND, tid);
+    blockOn(nullptr, -1, TRACE_ON_SUSPEND);
+    enableInterrupts();
+    return 0;
+  } else if (tcb != nullptr && tcb->casState(READY, BLOCK)) {
+    // thread was ready: its ready queue entry is skipped when popped, and
+    // keeps the TCB alive until then
+    tcb->_suspended = true;
+    num_suspended++;
+    trace(TRACE_SUSPEND, tid);
+  } else if (tcb != nullptr && tcb->getState() == RUNNING) {
+    // running on another worker, it is parked at its next switch
+    tcb->_suspend_pending = true;
+    trace(TRACE_SUSPEND, tid);
+  } else { // not in ready queue and not running
     cerr << "Error - attempting to suspend an already blocked or finished thread" << endl;
+    unlockScheduler();
     enableInterrupts();
     return -1;
-  } // else if 
-  // tid was in ready queue but has been removed, or tid is current thread
-  TCB* next_thread = popFromReadyQueue();
-  TCB* tcb = uthread_info.threads[tid];
-  // move tid to blocked state
-  tcb->setState(BLOCK);
-  // add to the suspend map where the key is its own tid
-  suspend_map.emplace(tid, tcb);
-  // switch to next ready thread
-  switchThreads(tcb, next_thread);
-  // set state to reflect running state
-  tcb->setState(RUNNING);
+  } // else
+  unlockScheduler();
   enableInterrupts();
   return 0;
 } // uthread_suspend()
 
 int uthread_resume(int tid) {
-  assert(uthread_info.interrupts_enabled);
-  if (tid >= MAX_THREAD_NUM || tid < 0)
-    return -1;
+  assert(interruptsEnabled());
   disableInterrupts();
-  // Move the thread specified by tid back to the ready queue from suspend map 
-  // if thread is not suspended, nothing happens
-  if (suspend_map.count(tid)) {
-    TCB* resume_thread = suspend_map.at(tid);
-    suspend_map.erase(tid);
-    resume_thread->setState(READY);
-    addToReadyQueue(resume_thread);
+  lockScheduler();
+  if (! uthread_info.threads->contains(tid)) {
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
   } // if
+  // Move the thread specified by tid back to the ready queue if it is
+  // suspended, if thread is not suspended, nothing happens. The caller may
+  // be a kernel thread that is not a worker
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  if (tcb != nullptr && tcb->_suspended) {
+    tcb->_suspended = false;
+    num_suspended--;
+    // only queued if still blocked, never twice
+    if (tcb->casState(BLOCK, READY))
+      addToReadyQueue(tcb, true);
+    trace(TRACE_RESUME, tid);
+  } else if (tcb != nullptr) {
+    // cancel a suspend that has not taken effect yet
+    tcb->_suspend_pending = false;
+  } // else if
+  unlockScheduler();
   enableInterrupts();
   return 0;
 } // uthread_resume()
 
-int uthread_self() {
-  return uthread_info.running_tid;
-} // uthread_self()
-
-int uthread_get_total_quantums() {
-  assert(uthread_info.interrupts_enabled);
+int uthread_setprio(int tid, int prio) {
+  if (prio < 0 || prio >= UTHREAD_PRIO_LEVELS) {
+    cerr << "Error - priority out of range" << endl;
+    return -1;
+  } // if
+  assert(interruptsEnabled());
   disableInterrupts();
-  int total = 0;
-  TCB* tcb;
-  // iterate through all threads
-  for (int i = 0; i < MAX_THREAD_NUM; i++) {
-    tcb = uthread_info.threads[i];
-    if (tcb != nullptr)
-      total += tcb->getQuantum();
-  } // for
-  enableInterrupts();
-  return total;
+  lockScheduler();
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  if (tcb == nullptr) {
+    cerr << "Error - tid does not exist" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  tcb->_prio = prio;
+  if (uthread_info.policy == UTHREAD_SCHED_PRIO)
+    tcb->_level = prio;
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_setprio()
+
+int uthread_getprio(int tid) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  int prio = tcb != nullptr ? tcb->_prio : -1;
+  unlockScheduler();
+  enableInterrupts();
+  return prio;
+} // uthread_getprio()
+
+int uthread_self() {
+  return currentThread()->getId();
+} // uthread_self()
+
+int uthread_get_total_quantums() {
+  // every worker counts the quantums of the threads it ran, so this
+  // does not depend on the number of threads
+  long total = 0;
+  for (int i = 0; i < uthread_info.num_workers; i++)
+    total += uthread_info.workers[i].quantums.load(memory_order_relaxed);
+  return total;
 } // uthread_get_total_quantums()
 
 int uthread_get_quantums(int tid) {
-  assert(uthread_info.interrupts_enabled);
+  assert(interruptsEnabled());
   disableInterrupts();
-  if (tid >= MAX_THREAD_NUM || tid < 0 || uthread_info.threads[tid] == nullptr)
+  lockScheduler();
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  if (tcb == nullptr) {
+    unlockScheduler();
+    enableInterrupts();
     return -1;
-  int quantums = uthread_info.threads[tid]->getQuantum(); 
+  } // if
+  int quantums = tcb->getQuantum();
+  unlockScheduler();
   enableInterrupts();
   return quantums;
 } // uthread_get_quantums()
+
+// CPU time and quotas ---------------------------------------------------------
+
+long long uthread_get_cputime(int tid) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  if (tcb == nullptr) {
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  long long ns = tcb->_cpu_ns;
+  // the caller's current run is not charged yet
+  if (tcb == currentThread())
+    ns += nowNs() - thisWorker()->run_start;
+  unlockScheduler();
+  enableInterrupts();
+  return ns;
+} // uthread_get_cputime()
+
+int uthread_quota_init(uthread_quota_t* quota, long long quota_ns, long long period_ns) {
+  if (quota_ns <= 0 || period_ns <= 0) {
+    cerr << "Error - cpu quota and period must be positive" << endl;
+    return -1;
+  } // if
+  quota->quota_ns = quota_ns;
+  quota->period_ns = period_ns;
+  quota->deficit_ns = quota_ns;
+  quota->next_refill = nowNs() + period_ns;
+  quota->used_ns = 0;
+  quota->throttled = 0;
+  quota->members = 0;
+  return 0;
+} // uthread_quota_init()
+
+int uthread_quota_destroy(uthread_quota_t* quota) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  int members = quota->members;
+  unlockScheduler();
+  enableInterrupts();
+  if (members > 0) {
+    cerr << "Error - destroying a cpu quota that threads count against" << endl;
+    return -1;
+  } // if
+  return 0;
+} // uthread_quota_destroy()
+
+int uthread_setquota(int tid, uthread_quota_t* quota) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = uthread_info.threads->lookup(tid);
+  if (tcb == nullptr || tcb->getState() == FINISHED) {
+    cerr << "Error - tid does not exist" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  if (tcb->_quota != nullptr)
+    tcb->_quota->members--;
+  if (quota != nullptr)
+    quota->members++;
+  // the caller's run so far counts against the quota it had
+  if (tcb == currentThread())
+    chargeCpu(tcb, nowNs());
+  tcb->_quota = quota;
+  // the thread may be running alone, without ticks to check its quota on
+  if (quota != nullptr) {
+    for (int i = 0; i < uthread_info.num_workers; i++)
+      setTicking(&uthread_info.workers[i], true);
+  } // if
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_setquota()
+
+// Tracing ---------------------------------------------------------------------
+
+int uthread_trace_start(long events) {
+#ifdef UTHREAD_NO_TRACE
+  cerr << "Error - tracing is compiled out" << endl;
+  errno = ENOSYS;
+  return -1;
+#else
+  if (events <= 0) {
+    cerr << "Error - a trace needs room for at least one event" << endl;
+    errno = EINVAL;
+    return -1;
+  } // if
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (trace_rings == nullptr) {
+    trace_rings = new TraceRing*[uthread_info.num_workers + 1];
+    for (int i = 0; i <= uthread_info.num_workers; i++)
+      trace_rings[i] = new TraceRing(events);
+  } else if (!trace_enabled) {
+    // a new trace, the rings keep the size they were first given
+    for (int i = 0; i <= uthread_info.num_workers; i++)
+      trace_rings[i]->clear();
+  } // else if
+  trace_enabled.store(true, memory_order_release);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+#endif
+} // uthread_trace_start()
+
+int uthread_trace_stop() {
+#ifdef UTHREAD_NO_TRACE
+  errno = ENOSYS;
+  return -1;
+#else
+  trace_enabled.store(false, memory_order_relaxed);
+  return 0;
+#endif
+} // uthread_trace_stop()
+
+int uthread_trace_dump(const char* path) {
+#ifdef UTHREAD_NO_TRACE
+  errno = ENOSYS;
+  return -1;
+#else
+  if (trace_rings == nullptr) {
+    cerr << "Error - tracing was never started" << endl;
+    errno = EINVAL;
+    return -1;
+  } // if
+  FILE* out = fopen(path, "w");
+  if (out == nullptr)
+    return -1;
+  int res = TraceRing::dump(out, trace_rings, uthread_info.num_workers + 1);
+  if (fclose(out) != 0)
+    res = -1;
+  return res;
+#endif
+} // uthread_trace_dump()
+
+// Statistics ------------------------------------------------------------------
+
+// Room for the text of uthread_stats_format
+static const int STATS_TEXT_SIZE = 8192;
+
+int uthread_stats(uthread_stats_t* stats) {
+  if (stats == nullptr) {
+    errno = EINVAL;
+    return -1;
+  } // if
+  memset(stats, 0, sizeof(*stats));
+  // the workers' own statistics, each read without stopping it
+  for (int i = 0; i < uthread_info.num_workers; i++) {
+    worker_t* worker = &uthread_info.workers[i];
+    if (worker->run_next.load(memory_order_relaxed) != nullptr)
+      stats->run_queue++;
+    for (int level = 0; level < uthread_info.num_levels; level++)
+      stats->run_queue += worker->ready_queues[level].size();
+    stats->run_queue_max = max(stats->run_queue_max,
+                               __atomic_load_n(&worker->run_queue_max, __ATOMIC_RELAXED));
+    stats->voluntary_switches += __atomic_load_n(&worker->voluntary, __ATOMIC_RELAXED);
+    stats->involuntary_switches += __atomic_load_n(&worker->involuntary, __ATOMIC_RELAXED);
+    for (int b = 0; b < UTHREAD_STATS_BUCKETS; b++) {
+      stats->ready_latency[b] += __atomic_load_n(&worker->ready_latency[b], __ATOMIC_RELAXED);
+      stats->slices[b] += __atomic_load_n(&worker->slices[b], __ATOMIC_RELAXED);
+    } // for
+    stats->ready_latency_sum += __atomic_load_n(&worker->ready_latency_sum, __ATOMIC_RELAXED);
+    stats->slices_sum += __atomic_load_n(&worker->slices_sum, __ATOMIC_RELAXED);
+  } // for
+  stats->run_queue += num_injected.load(memory_order_relaxed);
+  // the thread counts, consistent with each other
+  disableInterrupts();
+  lockScheduler();
+  stats->live = num_live;
+  stats->blocked = num_blocked;
+  stats->suspended = num_suspended;
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_stats()
+
+// Append to the text in buf, of which *len bytes are written. Past size
+// bytes *len keeps counting, as snprintf does
+static void appendText(char* buf, size_t size, int* len, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t used = (size_t) *len < size ? *len : size;
+  *len += vsnprintf(buf + used, size - used, format, args);
+  va_end(args);
+} // appendText()
+
+// Append a histogram of times in ns, in seconds as Prometheus has them
+static void appendHistogram(char* buf, size_t size, int* len, const char* name,
+                            const char* help, const long* buckets, long long sum_ns) {
+  appendText(buf, size, len, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  // Prometheus buckets are cumulative, and bucket b holds times below
+  // 2^(b+1) ns
+  long count = 0;
+  for (int b = 0; b < UTHREAD_STATS_BUCKETS - 1; b++) {
+    count += buckets[b];
+    appendText(buf, size, len, "%s_bucket{le=\"%.9g\"} %ld\n", name,
+               (1LL << (b + 1)) / 1e9, count);
+  } // for
+  count += buckets[UTHREAD_STATS_BUCKETS - 1];
+  appendText(buf, size, len, "%s_bucket{le=\"+Inf\"} %ld\n%s_sum %.9f\n%s_count %ld\n",
+             name, count, name, sum_ns / 1e9, name, count);
+} // appendHistogram()
+
+int uthread_stats_format(const uthread_stats_t* stats, char* buf, size_t size) {
+  if (stats == nullptr || (buf == nullptr && size > 0)) {
+    errno = EINVAL;
+    return -1;
+  } // if
+  int len = 0;
+  if (size > 0)
+    buf[0] = '\0';
+  appendText(buf, size, &len,
+             "# HELP uthread_run_queue Ready queue entries\n"
+             "# TYPE uthread_run_queue gauge\n"
+             "uthread_run_queue %ld\n"
+             "# HELP uthread_run_queue_max Most entries one worker's ready queues held\n"
+             "# TYPE uthread_run_queue_max gauge\n"
+             "uthread_run_queue_max %ld\n"
+             "# HELP uthread_threads Threads created and not finished, by state\n"
+             "# TYPE uthread_threads gauge\n"
+             "uthread_threads{state=\"live\"} %ld\n"
+             "uthread_threads{state=\"blocked\"} %ld\n"
+             "uthread_threads{state=\"suspended\"} %ld\n"
+             "# HELP uthread_switches_total Context switches, by how the thread left\n"
+             "# TYPE uthread_switches_total counter\n"
+             "uthread_switches_total{kind=\"voluntary\"} %ld\n"
+             "uthread_switches_total{kind=\"involuntary\"} %ld\n",
+             stats->run_queue, stats->run_queue_max, stats->live, stats->blocked,
+             stats->suspended, stats->voluntary_switches, stats->involuntary_switches);
+  appendHistogram(buf, size, &len, "uthread_ready_latency_seconds",
+                  "Time from made ready to running", stats->ready_latency,
+                  stats->ready_latency_sum);
+  appendHistogram(buf, size, &len, "uthread_slice_seconds",
+                  "Time run between two switches", stats->slices, stats->slices_sum);
+  return len;
+} // uthread_stats_format()
+
+// Write all of buf to a socket
+// Returns 0 on success, -1 on failure
+static int writeAll(int fd, const char* buf, size_t count) {
+  while (count > 0) {
+    ssize_t n = uthread_write(fd, buf, count);
+    if (n == -1)
+      return -1;
+    buf += n;
+    count -= n;
+  } // while
+  return 0;
+} // writeAll()
+
+// Answer every connection to the listening socket in arg with the current
+// statistics
+static void* statsServer(void* arg) {
+  int listen_fd = (int) (long) arg;
+  char text[STATS_TEXT_SIZE];
+  while (1) {
+    int fd = uthread_accept(listen_fd, nullptr, nullptr);
+    if (fd == -1) {
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+        // out of fds or memory for now, retry later
+        uthread_sleep_ns(100000000);
+        continue;
+      } // if
+      cerr << "Error - the statistics server failed to accept a connection" << endl;
+      return nullptr;
+    } // if
+    // the request is not looked at, but read: closing a socket with
+    // unread data resets the connection, and may lose the response
+    char request[1024];
+    uthread_read(fd, request, sizeof(request));
+    uthread_stats_t stats;
+    uthread_stats(&stats);
+    int len = uthread_stats_format(&stats, text, sizeof(text));
+    if (len >= STATS_TEXT_SIZE)
+      len = STATS_TEXT_SIZE - 1;
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %d\r\n\r\n", len);
+    if (writeAll(fd, header, header_len) == 0)
+      writeAll(fd, text, len);
+    uthread_close(fd);
+  } // while
+} // statsServer()
+
+int uthread_stats_serve(int listen_fd) {
+  if (listen_fd < 0) {
+    errno = EBADF;
+    return -1;
+  } // if
+  uthread_attr_t attr;
+  uthread_attr_init(&attr);
+  uthread_attr_setdetachstate(&attr, UTHREAD_CREATE_DETACHED);
+  return uthread_create_attr(statsServer, (void*) (long) listen_fd, &attr);
+} // uthread_stats_serve()
+
+// Profiling -------------------------------------------------------------------
+
+// Create a worker's profiling timer: SIGPROF to the worker's kernel thread
+// at every interval of its cpu time, once armed
+// Returns 0 on success, -1 on failure
+static int createProfTimer(worker_t* worker) {
+  // a worker that is still starting has yet to publish its kernel thread id
+  while (worker->ktid.load() == 0)
+    sched_yield();
+  clockid_t clock;
+  if (pthread_getcpuclockid(worker->kthread, &clock) != 0)
+    return -1;
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev._sigev_un._tid = worker->ktid;
+  return timer_create(clock, &sev, &worker->prof_timer);
+} // createProfTimer()
+
+// Arm the workers' profiling timers to fire every interval_ns, or stop them
+// if it is 0
+// NOTE: assumes the scheduler lock is held
+static void setProfTimers(long long interval_ns) {
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = interval_ns / 1000000000;
+  its.it_value.tv_nsec = interval_ns % 1000000000;
+  its.it_interval = its.it_value;
+  for (int i = 0; i < uthread_info.num_workers; i++) {
+    if (timer_settime(uthread_info.workers[i].prof_timer, 0, &its, NULL) == -1)
+      cerr << "Error - failed to set the profiling timer of worker " << i << endl;
+  } // for
+} // setProfTimers()
+
+int uthread_prof_start(int hz, long samples) {
+  if (hz <= 0 || hz > 1000000000 || samples <= 0) {
+    cerr << "Error - a profile needs a positive frequency and room for samples" << endl;
+    errno = EINVAL;
+    return -1;
+  } // if
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (prof_buffers == nullptr) {
+    // the handler is kept once installed: a sample may still be pending
+    // when profiling stops, and SIGPROF would end the process
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = prof_handler;
+    act.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&act.sa_mask);
+    sigaddset(&act.sa_mask, uthread_info.preempt_signo);
+    if (sigaction(SIGPROF, &act, NULL) == -1) {
+      cerr << "Error - failed to set the SIGPROF handler" << endl;
+      unlockScheduler();
+      enableInterrupts();
+      return -1;
+    } // if
+    for (int i = 0; i < uthread_info.num_workers; i++) {
+      if (createProfTimer(&uthread_info.workers[i]) == -1) {
+        cerr << "Error - failed to create the profiling timer of worker " << i << endl;
+        abort();
+      } // if
+    } // for
+    prof_buffers = new ProfBuffer*[uthread_info.num_workers];
+    for (int i = 0; i < uthread_info.num_workers; i++)
+      prof_buffers[i] = new ProfBuffer(samples);
+  } else if (!prof_enabled) {
+    // a new profile, the buffers keep the size they were first given
+    for (int i = 0; i < uthread_info.num_workers; i++)
+      prof_buffers[i]->clear();
+  } // else if
+  prof_enabled.store(true, memory_order_release);
+  setProfTimers(1000000000LL / hz);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_prof_start()
+
+int uthread_prof_stop() {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (prof_buffers != nullptr)
+    setProfTimers(0);
+  prof_enabled.store(false, memory_order_relaxed);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_prof_stop()
+
+int uthread_prof_dump(const char* path) {
+  if (prof_buffers == nullptr) {
+    cerr << "Error - profiling was never started" << endl;
+    errno = EINVAL;
+    return -1;
+  } // if
+  FILE* out = fopen(path, "w");
+  if (out == nullptr)
+    return -1;
+  int res = ProfBuffer::dump(out, prof_buffers, uthread_info.num_workers);
+  if (fclose(out) != 0)
+    res = -1;
+  return res;
+} // uthread_prof_dump()
+
+// Stack use -------------------------------------------------------------------
+
+int uthread_stack_paint(int enable) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  stack_paint = enable != 0;
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_stack_paint()
+
+long uthread_stack_highwater(int tid) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = uthread_info.threads->contains(tid) ? uthread_info.threads->lookup(tid) : nullptr;
+  // the stack of a finished thread was measured when it was released
+  long used = tcb != nullptr ? tcb->getStackHighwater() : -1;
+  unlockScheduler();
+  enableInterrupts();
+  if (used == -1) {
+    cerr << "Error - invalid tid, or the thread's stack is not painted" << endl;
+    errno = EINVAL;
+  } // if
+  return used;
+} // uthread_stack_highwater()
+
+// Stack size to suggest for threads that used at most used bytes: room for
+// a preemption signal frame on top of their deepest use, and a page for the
+// signal handler's own frames. The kernel tells how large a signal frame
+// this cpu needs (about 12 KB with AVX-512)
+static size_t suggestedStackSize(long used) {
+  long signal_frame = 12288;
+#ifdef _SC_MINSIGSTKSZ
+  if (sysconf(_SC_MINSIGSTKSZ) > 0)
+    signal_frame = sysconf(_SC_MINSIGSTKSZ);
+#endif
+  size_t size = StackPool::roundSize(used + signal_frame + sysconf(_SC_PAGESIZE));
+  return max(size, (size_t) PTHREAD_STACK_MIN);
+} // suggestedStackSize()
+
+int uthread_stack_report(const char* path) {
+  // copy the counts out, naming the start routines takes a while
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  vector<pair<void*, stack_usage_t> > usage(stack_usage.begin(), stack_usage.end());
+  unlockScheduler();
+  enableInterrupts();
+  // deepest first
+  sort(usage.begin(), usage.end(),
+       [](const pair<void*, stack_usage_t>& a, const pair<void*, stack_usage_t>& b) {
+         return a.second.max_used > b.second.max_used;
+       });
+  FILE* out = fopen(path, "w");
+  if (out == nullptr)
+    return -1;
+  fprintf(out, "%8s %10s %10s %10s %10s  %s\n", "threads", "stack", "mean used",
+          "max used", "suggested", "start routine");
+  for (auto& entry : usage) {
+    const stack_usage_t& u = entry.second;
+    fprintf(out, "%8ld %10zu %10lld %10ld %10zu  %s\n", u.threads, u.stack_size,
+            u.total_used / u.threads, u.max_used, suggestedStackSize(u.max_used),
+            symbolName(entry.first).c_str());
+  } // for
+  int res = ferror(out) ? -1 : 0;
+  if (fclose(out) != 0)
+    res = -1;
+  return res;
+} // uthread_stack_report()
+
+// Tasks -----------------------------------------------------------------------
+
+static void* poolThread(void* arg);
+
+// Get another pool thread to look at the task queue: wake a parked one, or
+// start one if the pool may grow. Does nothing if one is on its way already
+// Returns false if there is no pool thread at all to run tasks
+// NOTE: assumes the scheduler lock is held
+static bool wakePoolThread() {
+  if (pool_pending > 0)
+    return true;
+  TCB* tcb = waitqPop(&pool_waiters);
+  if (tcb != nullptr) {
+    readyThread(tcb);
+    pool_pending++;
+    return true;
+  } // if
+  if (pool_size < TASK_POOL_MAX &&
+      createThread(poolThread, nullptr, STACK_SIZE, true, true) != -1) {
+    pool_pending++;
+    pool_size++;
+  } // if
+  return pool_size > 0;
+} // wakePoolThread()
+
+// Body of a pool thread: runs queued tasks one after the other, parking on
+// pool_waiters while there are none. Never returns
+static void* poolThread(void* arg) {
+  disableInterrupts();
+  lockScheduler();
+  pool_pending--;
+  while (1) {
+    uthread_future_t* task = task_head;
+    if (task == nullptr) {
+      // uthread_submit readies us
+      blockOn(&pool_waiters);
+      lockScheduler();
+      pool_pending--;
+      continue;
+    } // if
+    task_head = task->next;
+    if (task_head == nullptr)
+      task_tail = nullptr;
+    pool_busy++;
+    // let other workers help with the rest of the queue
+    if (task_head != nullptr && pool_busy < uthread_info.num_workers)
+      wakePoolThread();
+    unlockScheduler();
+    enableInterrupts();
+    void* result = task->fn(task->arg);
+    disableInterrupts();
+    lockScheduler();
+    pool_busy--;
+    // the future belongs to the submitter again once done is set
+    TCB* waiter = (TCB*) task->waiter;
+    task->result = result;
+    __atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+    if (waiter != nullptr)
+      readyThread(waiter);
+  } // while
+  return nullptr;
+} // poolThread()
+
+int uthread_submit(uthread_future_t* future, void* (*fn)(void*), void* arg) {
+  future->fn = fn;
+  future->arg = arg;
+  future->result = nullptr;
+  future->done = 0;
+  future->waiter = nullptr;
+  future->next = nullptr;
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (task_tail != nullptr)
+    task_tail->next = future;
+  else
+    task_head = future;
+  task_tail = future;
+  if (!wakePoolThread()) {
+    // nothing would ever run the task
+    task_head = task_tail = nullptr;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_submit()
+
+int uthread_future_wait(uthread_future_t* future, void** result) {
+  if (uthread_future_done(future)) {
+    *result = future->result;
+    return 0;
+  } // if
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (!future->done) {
+    if (future->waiter != nullptr) {
+      cerr << "Error - another thread is already waiting on the future" << endl;
+      unlockScheduler();
+      enableInterrupts();
+      return -1;
+    } // if
+    // the pool thread readies us when the task returns
+    future->waiter = currentThread();
+    blockOn(nullptr);
+    lockScheduler();
+  } // if
+  *result = future->result;
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_future_wait()
+
+int uthread_future_done(uthread_future_t* future) {
+  return __atomic_load_n(&future->done, __ATOMIC_ACQUIRE);
+} // uthread_future_done()
+
+// Synchronization -------------------------------------------------------------
+
+// Every wait queue is protected by the scheduler lock. A thread that releases
+// an object with waiters hands it to the first one before readying it, so the
+// woken thread never has to compete for it again
+
+// Take an unlocked mutex for thread tid. Marks the mutex contended either
+// way, so that its owner's unlock takes the slow path and sees any waiter
+// NOTE: assumes the scheduler lock is held
+static bool tryAcquireMutex(uthread_mutex_t* mutex, int tid) {
+  if (__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0)
+    return false;
+  mutex->owner = tid;
+  return true;
+} // tryAcquireMutex()
+
+// Hand the mutex to its first waiter, or unlock it if there is none
+// NOTE: assumes the scheduler lock is held
+static void releaseMutex(uthread_mutex_t* mutex) {
+  TCB* next = waitqPop(&mutex->waiters);
+  if (next == nullptr) {
+    mutex->owner = -1;
+    __atomic_store_n(&mutex->state, 0, __ATOMIC_RELEASE);
+    return;
+  } // if
+  mutex->owner = next->getId();
+  // with nobody else waiting the new owner can unlock on the fast path
+  if (mutex->waiters.head == nullptr)
+    __atomic_store_n(&mutex->state, 1, __ATOMIC_RELAXED);
+  readyThread(next);
+} // releaseMutex()
+
+int uthread_mutex_init(uthread_mutex_t* mutex) {
+  mutex->state = 0;
+  mutex->owner = -1;
+  mutex->waiters.head = nullptr;
+  mutex->waiters.tail = nullptr;
+  return 0;
+} // uthread_mutex_init()
+
+int uthread_mutex_destroy(uthread_mutex_t* mutex) {
+  if (__atomic_load_n(&mutex->state, __ATOMIC_RELAXED) != 0) {
+    cerr << "Error - destroying a locked mutex" << endl;
+    return -1;
+  } // if
+  return 0;
+} // uthread_mutex_destroy()
+
+// Lock a mutex, giving up at the deadline (-1 for none)
+static int lockMutex(uthread_mutex_t* mutex, long long deadline) {
+  // uncontended: a single compare and swap, no critical section needed
+  int expected = 0;
+  if (__atomic_compare_exchange_n(&mutex->state, &expected, 1, false,
+                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    mutex->owner = uthread_self();
+    return 0;
+  } // if
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  int tid = uthread_self();
+  if (mutex->owner == tid) {
+    cerr << "Error - thread already holds the mutex" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  if (tryAcquireMutex(mutex, tid)) {
+    unlockScheduler();
+    enableInterrupts();
+    return 0;
+  } // if
+  // wait for the owner to hand the mutex over
+  int res = blockOn(&mutex->waiters, deadline);
+  enableInterrupts();
+  return res;
+} // lockMutex()
+
+int uthread_mutex_lock(uthread_mutex_t* mutex) {
+  return lockMutex(mutex, -1);
+} // uthread_mutex_lock()
+
+int uthread_mutex_timedlock(uthread_mutex_t* mutex, long long timeout_ns) {
+  return lockMutex(mutex, deadlineAfter(timeout_ns));
+} // uthread_mutex_timedlock()
+
+int uthread_mutex_trylock(uthread_mutex_t* mutex) {
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&mutex->state, &expected, 1, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return -1;
+  mutex->owner = uthread_self();
+  return 0;
+} // uthread_mutex_trylock()
+
+int uthread_mutex_unlock(uthread_mutex_t* mutex) {
+  if (mutex->owner != uthread_self()) {
+    cerr << "Error - thread does not hold the mutex" << endl;
+    return -1;
+  } // if
+  // uncontended: nobody waits, just unlock
+  mutex->owner = -1;
+  int expected = 1;
+  if (__atomic_compare_exchange_n(&mutex->state, &expected, 0, false,
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    return 0;
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  releaseMutex(mutex);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_mutex_unlock()
+
+int uthread_cond_init(uthread_cond_t* cond) {
+  cond->waiters.head = nullptr;
+  cond->waiters.tail = nullptr;
+  return 0;
+} // uthread_cond_init()
+
+int uthread_cond_destroy(uthread_cond_t* cond) {
+  if (cond->waiters.head != nullptr) {
+    cerr << "Error - destroying a condition variable with waiting threads" << endl;
+    return -1;
+  } // if
+  return 0;
+} // uthread_cond_destroy()
+
+// Wait on a condition variable, giving up at the deadline (-1 for none)
+static int waitCond(uthread_cond_t* cond, uthread_mutex_t* mutex, long long deadline) {
+  int tid = uthread_self();
+  if (mutex->owner != tid) {
+    cerr << "Error - thread does not hold the mutex" << endl;
+    return -1;
+  } // if
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = currentThread();
+  tcb->_wait_data = mutex;
+  releaseMutex(mutex);
+  if (blockOn(&cond->waiters, deadline) == 0) {
+    // a signal moved this thread to the mutex, which was then handed over
+    enableInterrupts();
+    return 0;
+  } // if
+  // the wait timed out before a signal, take the mutex back the usual way
+  tcb->_wait_data = nullptr;
+  enableInterrupts();
+  lockMutex(mutex, -1);
+  errno = ETIMEDOUT;
+  return -1;
+} // waitCond()
+
+int uthread_cond_wait(uthread_cond_t* cond, uthread_mutex_t* mutex) {
+  return waitCond(cond, mutex, -1);
+} // uthread_cond_wait()
+
+int uthread_cond_timedwait(uthread_cond_t* cond, uthread_mutex_t* mutex,
+                           long long timeout_ns) {
+  return waitCond(cond, mutex, deadlineAfter(timeout_ns));
+} // uthread_cond_timedwait()
+
+// Move a thread woken from a condition wait to its mutex. It only becomes
+// ready once it owns the mutex, so it never wakes up just to block again
+// NOTE: assumes the scheduler lock is held
+static void requeueOnMutex(TCB* tcb) {
+  uthread_mutex_t* mutex = (uthread_mutex_t*) tcb->_wait_data;
+  tcb->_wait_data = nullptr;
+  // the wait was signalled in time, what is left is waiting for the mutex
+  cancelTimer(tcb);
+  if (tryAcquireMutex(mutex, tcb->getId()))
+    readyThread(tcb);
+  else
+    waitqPush(&mutex->waiters, tcb);
+} // requeueOnMutex()
+
+int uthread_cond_signal(uthread_cond_t* cond) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = waitqPop(&cond->waiters);
+  if (tcb != nullptr)
+    requeueOnMutex(tcb);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_cond_signal()
+
+int uthread_cond_broadcast(uthread_cond_t* cond) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb;
+  while ((tcb = waitqPop(&cond->waiters)) != nullptr)
+    requeueOnMutex(tcb);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_cond_broadcast()
+
+int uthread_sem_init(uthread_sem_t* sem, int value) {
+  if (value < 0)
+    return -1;
+  sem->value = value;
+  sem->waiters.head = nullptr;
+  sem->waiters.tail = nullptr;
+  return 0;
+} // uthread_sem_init()
+
+int uthread_sem_destroy(uthread_sem_t* sem) {
+  if (sem->waiters.head != nullptr) {
+    cerr << "Error - destroying a semaphore with waiting threads" << endl;
+    return -1;
+  } // if
+  return 0;
+} // uthread_sem_destroy()
+
+int uthread_sem_trywait(uthread_sem_t* sem) {
+  int value = __atomic_load_n(&sem->value, __ATOMIC_RELAXED);
+  while (value > 0) {
+    if (__atomic_compare_exchange_n(&sem->value, &value, value - 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 0;
+  } // while
+  return -1;
+} // uthread_sem_trywait()
+
+// Decrement a semaphore, giving up at the deadline (-1 for none)
+static int waitSem(uthread_sem_t* sem, long long deadline) {
+  if (uthread_sem_trywait(sem) == 0)
+    return 0;
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  // a post may have come in before the lock was taken. Posts made while
+  // threads wait go to them directly, so value stays 0 while any wait
+  if (uthread_sem_trywait(sem) == 0) {
+    unlockScheduler();
+    enableInterrupts();
+    return 0;
+  } // if
+  int res = blockOn(&sem->waiters, deadline);
+  enableInterrupts();
+  return res;
+} // waitSem()
+
+int uthread_sem_wait(uthread_sem_t* sem) {
+  return waitSem(sem, -1);
+} // uthread_sem_wait()
+
+int uthread_sem_timedwait(uthread_sem_t* sem, long long timeout_ns) {
+  return waitSem(sem, deadlineAfter(timeout_ns));
+} // uthread_sem_timedwait()
+
+int uthread_sem_post(uthread_sem_t* sem) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = waitqPop(&sem->waiters);
+  if (tcb != nullptr)
+    readyThread(tcb);
+  else
+    __atomic_add_fetch(&sem->value, 1, __ATOMIC_RELEASE);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_sem_post()
+
+int uthread_rwlock_init(uthread_rwlock_t* rwlock) {
+  rwlock->readers = 0;
+  rwlock->writer = -1;
+  rwlock->waiters.head = nullptr;
+  rwlock->waiters.tail = nullptr;
+  return 0;
+} // uthread_rwlock_init()
+
+int uthread_rwlock_destroy(uthread_rwlock_t* rwlock) {
+  if (rwlock->readers > 0 || rwlock->writer != -1) {
+    cerr << "Error - destroying a held reader-writer lock" << endl;
+    return -1;
+  } // if
+  return 0;
+} // uthread_rwlock_destroy()
+
+// Hand the lock to the waiters at the front of the queue: one writer, or
+// every reader up to the next writer
+// NOTE: assumes the scheduler lock is held
+static void grantRwlock(uthread_rwlock_t* rwlock) {
+  TCB* tcb;
+  while ((tcb = (TCB*) rwlock->waiters.head) != nullptr && rwlock->writer == -1) {
+    if (tcb->_wait_writer) {
+      if (rwlock->readers > 0)
+        break;
+      rwlock->writer = tcb->getId();
+    } else {
+      rwlock->readers++;
+    } // else
+    waitqPop(&rwlock->waiters);
+    readyThread(tcb);
+  } // while
+} // grantRwlock()
+
+int uthread_rwlock_rdlock(uthread_rwlock_t* rwlock) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  // readers do not overtake waiting writers
+  if (rwlock->writer == -1 && rwlock->waiters.head == nullptr) {
+    rwlock->readers++;
+    unlockScheduler();
+    enableInterrupts();
+    return 0;
+  } // if
+  currentThread()->_wait_writer = false;
+  int res = blockOn(&rwlock->waiters);
+  enableInterrupts();
+  return res;
+} // uthread_rwlock_rdlock()
+
+int uthread_rwlock_wrlock(uthread_rwlock_t* rwlock) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  int tid = uthread_self();
+  if (rwlock->writer == tid) {
+    cerr << "Error - thread already holds the write lock" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  if (rwlock->writer == -1 && rwlock->readers == 0 && rwlock->waiters.head == nullptr) {
+    rwlock->writer = tid;
+    unlockScheduler();
+    enableInterrupts();
+    return 0;
+  } // if
+  currentThread()->_wait_writer = true;
+  int res = blockOn(&rwlock->waiters);
+  enableInterrupts();
+  return res;
+} // uthread_rwlock_wrlock()
+
+int uthread_rwlock_unlock(uthread_rwlock_t* rwlock) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (rwlock->writer == uthread_self()) {
+    rwlock->writer = -1;
+  } else if (rwlock->readers > 0) {
+    rwlock->readers--;
+  } else {
+    cerr << "Error - thread does not hold the reader-writer lock" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // else
+  grantRwlock(rwlock);
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_rwlock_unlock()
+
+int uthread_wg_init(uthread_wg_t* wg, int count) {
+  if (count < 0)
+    return -1;
+  wg->count = count;
+  wg->waiters.head = nullptr;
+  wg->waiters.tail = nullptr;
+  return 0;
+} // uthread_wg_init()
+
+int uthread_wg_destroy(uthread_wg_t* wg) {
+  if (wg->waiters.head != nullptr) {
+    cerr << "Error - destroying a wait group with waiting threads" << endl;
+    return -1;
+  } // if
+  return 0;
+} // uthread_wg_destroy()
+
+int uthread_wg_add(uthread_wg_t* wg, int delta) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  int count = wg->count + delta;
+  if (count < 0) {
+    cerr << "Error - wait group count below 0" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  __atomic_store_n(&wg->count, count, __ATOMIC_RELEASE);
+  // every waiter is woken exactly once, however many threads counted down
+  if (count == 0) {
+    TCB* tcb;
+    while ((tcb = waitqPop(&wg->waiters)) != nullptr)
+      readyThread(tcb);
+  } // if
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_wg_add()
+
+int uthread_wg_done(uthread_wg_t* wg) {
+  return uthread_wg_add(wg, -1);
+} // uthread_wg_done()
+
+int uthread_wg_wait(uthread_wg_t* wg) {
+  if (__atomic_load_n(&wg->count, __ATOMIC_ACQUIRE) == 0)
+    return 0;
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (wg->count == 0) {
+    unlockScheduler();
+    enableInterrupts();
+    return 0;
+  } // if
+  int res = blockOn(&wg->waiters);
+  enableInterrupts();
+  return res;
+} // uthread_wg_wait()
+
+int uthread_barrier_init(uthread_barrier_t* barrier, int count) {
+  if (count < 1)
+    return -1;
+  barrier->count = count;
+  barrier->arrived = 0;
+  barrier->waiters.head = nullptr;
+  barrier->waiters.tail = nullptr;
+  return 0;
+} // uthread_barrier_init()
+
+int uthread_barrier_destroy(uthread_barrier_t* barrier) {
+  if (barrier->waiters.head != nullptr) {
+    cerr << "Error - destroying a barrier with waiting threads" << endl;
+    return -1;
+  } // if
+  return 0;
+} // uthread_barrier_destroy()
+
+int uthread_barrier_wait(uthread_barrier_t* barrier) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (++barrier->arrived < barrier->count) {
+    int res = blockOn(&barrier->waiters);
+    enableInterrupts();
+    return res;
+  } // if
+  // last to arrive: release this round's threads. The queue is empty again
+  // before any of them runs, so they may wait for the next round right away
+  barrier->arrived = 0;
+  TCB* tcb;
+  while ((tcb = waitqPop(&barrier->waiters)) != nullptr)
+    readyThread(tcb);
+  unlockScheduler();
+  enableInterrupts();
+  return UTHREAD_BARRIER_SERIAL_THREAD;
+} // uthread_barrier_wait()
+
+// Channels --------------------------------------------------------------------
+
+// A thread blocked on a channel, kept on its own stack. A select queues one
+// per case, on the senders or receivers of the case's channel
+typedef struct chan_waiter {
+  struct chan_select* select;
+  uthread_chan_case_t* c;
+  int index;                    // of the case in the select
+  struct chan_waiter* next;
+  struct chan_waiter* prev;
+} chan_waiter_t;
+
+// A blocked select, also on the selecting thread's stack
+typedef struct chan_select {
+  TCB* tcb;
+  chan_waiter_t* waiters;       // one per case
+  int num_waiters;
+  int fired;                    // index of the completed case, -1 until then
+} chan_select_t;
+
+// Queues of chan_waiter_t, reusing uthread_waitq_t
+// NOTE: assume the scheduler lock is held
+
+static void chanqPush(uthread_waitq_t* q, chan_waiter_t* w) {
+  w->next = nullptr;
+  w->prev = (chan_waiter_t*) q->tail;
+  if (q->tail != nullptr)
+    ((chan_waiter_t*) q->tail)->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+} // chanqPush()
+
+static void chanqRemove(uthread_waitq_t* q, chan_waiter_t* w) {
+  if (w->prev != nullptr)
+    w->prev->next = w->next;
+  else
+    q->head = w->next;
+  if (w->next != nullptr)
+    w->next->prev = w->prev;
+  else
+    q->tail = w->prev;
+} // chanqRemove()
+
+static uthread_waitq_t* chanQueue(uthread_chan_case_t* c) {
+  return c->op == UTHREAD_CHAN_SEND ? &c->chan->senders : &c->chan->receivers;
+} // chanQueue()
+
+// Complete the blocked case of w: take all of its select's waiters off
+// their queues, as the other cases must not complete any more. Returns the
+// thread to wake
+// NOTE: assumes the scheduler lock is held
+static TCB* fireWaiter(chan_waiter_t* w, int ok) {
+  chan_select_t* select = w->select;
+  for (int i = 0; i < select->num_waiters; i++) {
+    chan_waiter_t* other = &select->waiters[i];
+    chanqRemove(chanQueue(other->c), other);
+  } // for
+  w->c->ok = ok;
+  select->fired = w->index;
+  return select->tcb;
+} // fireWaiter()
+
+// Complete case c if it can go ahead without blocking. A thread blocked on
+// the other end of the channel is completed as well and returned in woken
+// Returns true if c completed
+// NOTE: assumes the scheduler lock is held
+static bool tryChanCase(uthread_chan_case_t* c, TCB** woken) {
+  uthread_chan_t* chan = c->chan;
+  *woken = nullptr;
+  if (c->op == UTHREAD_CHAN_SEND) {
+    if (chan->closed) {
+      c->ok = 0;
+      return true;
+    } // if
+    chan_waiter_t* receiver = (chan_waiter_t*) chan->receivers.head;
+    if (receiver != nullptr) {
+      // only possible while the buffer is empty: copy straight across
+      memcpy(receiver->c->elem, c->elem, chan->elem_size);
+      *woken = fireWaiter(receiver, 1);
+    } else if (chan->count < chan->capacity) {
+      size_t tail = (chan->head + chan->count) % chan->capacity;
+      memcpy(chan->buffer + tail * chan->elem_size, c->elem, chan->elem_size);
+      chan->count++;
+    } else {
+      return false;
+    } // else
+    c->ok = 1;
+    return true;
+  } // if
+  chan_waiter_t* sender = (chan_waiter_t*) chan->senders.head;
+  if (chan->count > 0) {
+    memcpy(c->elem, chan->buffer + chan->head * chan->elem_size, chan->elem_size);
+    chan->head = (chan->head + 1) % chan->capacity;
+    chan->count--;
+    // a blocked sender's value takes the freed slot
+    if (sender != nullptr) {
+      size_t tail = (chan->head + chan->count) % chan->capacity;
+      memcpy(chan->buffer + tail * chan->elem_size, sender->c->elem, chan->elem_size);
+      chan->count++;
+      *woken = fireWaiter(sender, 1);
+    } // if
+    c->ok = 1;
+  } else if (sender != nullptr) {
+    memcpy(c->elem, sender->c->elem, chan->elem_size);
+    *woken = fireWaiter(sender, 1);
+    c->ok = 1;
+  } else if (chan->closed) {
+    memset(c->elem, 0, chan->elem_size);
+    c->ok = 0;
+  } else {
+    return false;
+  } // else
+  return true;
+} // tryChanCase()
+
+int uthread_chan_init(uthread_chan_t* chan, size_t elem_size, size_t capacity) {
+  if (elem_size == 0) {
+    cerr << "Error - channel values must have a size" << endl;
+    return -1;
+  } // if
+  chan->elem_size = elem_size;
+  chan->capacity = capacity;
+  chan->count = 0;
+  chan->head = 0;
+  chan->buffer = capacity > 0 ? new char[elem_size * capacity] : nullptr;
+  chan->closed = 0;
+  chan->senders.head = chan->senders.tail = nullptr;
+  chan->receivers.head = chan->receivers.tail = nullptr;
+  return 0;
+} // uthread_chan_init()
+
+int uthread_chan_destroy(uthread_chan_t* chan) {
+  if (chan->senders.head != nullptr || chan->receivers.head != nullptr) {
+    cerr << "Error - destroying a channel threads are blocked on" << endl;
+    return -1;
+  } // if
+  delete [] chan->buffer;
+  chan->buffer = nullptr;
+  return 0;
+} // uthread_chan_destroy()
+
+int uthread_chan_select(uthread_chan_case_t* cases, int n, int block) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  for (int i = 0; i < n; i++) {
+    TCB* woken;
+    if (!tryChanCase(&cases[i], &woken))
+      continue;
+    if (woken != nullptr && cases[i].op == UTHREAD_CHAN_SEND &&
+        cases[i].chan->capacity == 0) {
+      // let the receiver use the value right away. A buffered channel lets
+      // the sender run on and fill the buffer instead
+      handOff(woken);
+    } else {
+      if (woken != nullptr)
+        readyThread(woken);
+      unlockScheduler();
+    } // else
+    enableInterrupts();
+    return i;
+  } // for
+  if (!block) {
+    unlockScheduler();
+    enableInterrupts();
+    errno = EAGAIN;
+    return -1;
+  } // if
+  // wait on every case until another thread completes one of them
+  chan_waiter_t waiters[n];
+  chan_select_t select;
+  select.tcb = currentThread();
+  select.waiters = waiters;
+  select.num_waiters = n;
+  select.fired = -1;
+  for (int i = 0; i < n; i++) {
+    waiters[i].select = &select;
+    waiters[i].c = &cases[i];
+    waiters[i].index = i;
+    chanqPush(chanQueue(&cases[i]), &waiters[i]);
+  } // for
+  blockOn(nullptr);
+  enableInterrupts();
+  return select.fired;
+} // uthread_chan_select()
+
+int uthread_chan_send(uthread_chan_t* chan, const void* elem) {
+  uthread_chan_case_t c = {chan, UTHREAD_CHAN_SEND, (void*) elem, 0};
+  uthread_chan_select(&c, 1, 1);
+  if (!c.ok) {
+    errno = EPIPE;
+    return -1;
+  } // if
+  return 0;
+} // uthread_chan_send()
+
+int uthread_chan_recv(uthread_chan_t* chan, void* elem) {
+  uthread_chan_case_t c = {chan, UTHREAD_CHAN_RECV, elem, 0};
+  uthread_chan_select(&c, 1, 1);
+  if (!c.ok) {
+    errno = EPIPE;
+    return -1;
+  } // if
+  return 0;
+} // uthread_chan_recv()
+
+int uthread_chan_close(uthread_chan_t* chan) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  if (chan->closed) {
+    cerr << "Error - channel is already closed" << endl;
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  chan->closed = 1;
+  // blocked receivers find the buffer empty, blocked senders cannot send
+  while (chan->receivers.head != nullptr) {
+    chan_waiter_t* w = (chan_waiter_t*) chan->receivers.head;
+    memset(w->c->elem, 0, chan->elem_size);
+    readyThread(fireWaiter(w, 0));
+  } // while
+  while (chan->senders.head != nullptr)
+    readyThread(fireWaiter((chan_waiter_t*) chan->senders.head, 0));
+  unlockScheduler();
+  enableInterrupts();
+  return 0;
+} // uthread_chan_close()
+
+// I/O -------------------------------------------------------------------------
+
+// Put fd in non-blocking mode the first time a thread uses it
+static int prepareFd(int fd) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  int res = uthread_info.poller->setNonBlocking(fd);
+  unlockScheduler();
+  enableInterrupts();
+  return res;
+} // prepareFd()
+
+// Park the calling thread until fd is readable (EPOLLIN) or writable
+// (EPOLLOUT). The worker meanwhile runs other threads
+// Returns 0 when woken, -1 with errno set to EBADF if fd was closed
+// meanwhile (see uthread_close)
+static int waitForFd(int fd, unsigned int events) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  TCB* tcb = currentThread();
+  if (uthread_info.poller->arm(fd, events, tcb) == -1) {
+    unlockScheduler();
+    enableInterrupts();
+    return -1;
+  } // if
+  tcb->_fd_closed = false;
+  int res = blockOn(nullptr, -1, TRACE_ON_IO);
+  enableInterrupts();
+  // the fd number may be reused already, it must not be tried again
+  if (res == 0 && tcb->_fd_closed) {
+    errno = EBADF;
+    return -1;
+  } // if
+  return res;
+} // waitForFd()
+
+ssize_t uthread_read(int fd, void* buf, size_t count) {
+  if (prepareFd(fd) == -1)
+    return -1;
+  while (1) {
+    ssize_t n = read(fd, buf, count);
+    if (n >= 0)
+      return n;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (waitForFd(fd, EPOLLIN) == -1)
+      return -1;
+  } // while
+} // uthread_read()
+
+ssize_t uthread_write(int fd, const void* buf, size_t count) {
+  if (prepareFd(fd) == -1)
+    return -1;
+  while (1) {
+    ssize_t n = write(fd, buf, count);
+    if (n >= 0)
+      return n;
+    if (errno == EINTR)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (waitForFd(fd, EPOLLOUT) == -1)
+      return -1;
+  } // while
+} // uthread_write()
+
+int uthread_accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+  if (prepareFd(fd) == -1)
+    return -1;
+  while (1) {
+    // the connection is created non-blocking, ready for uthread_read
+    int conn = accept4(fd, addr, addrlen, SOCK_NONBLOCK);
+    if (conn >= 0) {
+      disableInterrupts();
+      lockScheduler();
+      uthread_info.poller->markNonBlocking(conn);
+      unlockScheduler();
+      enableInterrupts();
+      return conn;
+    } // if
+    if (errno == EINTR || errno == ECONNABORTED)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      return -1;
+    if (waitForFd(fd, EPOLLIN) == -1)
+      return -1;
+  } // while
+} // uthread_accept()
+
+int uthread_connect(int fd, const struct sockaddr* addr, socklen_t addrlen) {
+  if (prepareFd(fd) == -1)
+    return -1;
+  if (connect(fd, addr, addrlen) == 0)
+    return 0;
+  // an interrupted connect carries on in the background
+  if (errno != EINPROGRESS && errno != EINTR)
+    return -1;
+  // the socket becomes writable once the connection is established or fails
+  if (waitForFd(fd, EPOLLOUT) == -1)
+    return -1;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+    return -1;
+  if (error != 0) {
+    errno = error;
+    return -1;
+  } // if
+  return 0;
+} // uthread_connect()
+
+// Register or drop the calling thread as the waiter for every fd of fds
+// NOTE: assumes interrupts are disabled and the scheduler lock is held
+static int armPollFds(struct pollfd* fds, nfds_t nfds, bool arm) {
+  TCB* tcb = currentThread();
+  for (nfds_t i = 0; i < nfds; i++) {
+    if (fds[i].fd < 0)
+      continue;
+    if (!arm) {
+      uthread_info.poller->disarm(fds[i].fd, tcb);
+      continue;
+    } // if
+    if (((fds[i].events & POLLIN) && uthread_info.poller->arm(fds[i].fd, EPOLLIN, tcb) == -1) ||
+        ((fds[i].events & POLLOUT) && uthread_info.poller->arm(fds[i].fd, EPOLLOUT, tcb) == -1)) {
+      int saved_errno = errno;
+      armPollFds(fds, i + 1, false);
+      errno = saved_errno;
+      return -1;
+    } // if
+  } // for
+  return 0;
+} // armPollFds()
+
+int uthread_poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+  long long deadline = timeout > 0 ? deadlineAfter(timeout * 1000000LL) : -1;
+  while (1) {
+    int n = poll(fds, nfds, 0);
+    if (n != 0 || timeout == 0)
+      return n;
+    assert(interruptsEnabled());
+    disableInterrupts();
+    lockScheduler();
+    if (armPollFds(fds, nfds, true) == -1) {
+      unlockScheduler();
+      enableInterrupts();
+      return -1;
+    } // if
+    // the first fd event or the timeout drops the registrations on the
+    // other fds, see readyThread()
+    TCB* tcb = currentThread();
+    tcb->_poll_fds = fds;
+    tcb->_poll_nfds = nfds;
+    int res = blockOn(nullptr, deadline, TRACE_ON_IO);
+    enableInterrupts();
+    if (res == -1)
+      return poll(fds, nfds, 0);
+  } // while
+} // uthread_poll()
+
+int uthread_close(int fd) {
+  assert(interruptsEnabled());
+  disableInterrupts();
+  lockScheduler();
+  // threads waiting on fd would never be woken by it now. A thread in
+  // uthread_poll finds it invalid when it polls again
+  TCB* waiters[2];
+  int n = uthread_info.poller->forget(fd, waiters);
+  for (int i = 0; i < n; i++) {
+    waiters[i]->_fd_closed = true;
+    readyThread(waiters[i]);
+  } // for
+  unlockScheduler();
+  enableInterrupts();
+  return close(fd);
+} // uthread_close()
@@ -6,25 +6,258 @@
  * Author: OS, huji.os.2015@gmail.com
  */
 
-#define MAX_THREAD_NUM 100 /* maximal number of threads */
-#define STACK_SIZE 4096 /* stack size per thread (in bytes) */
+#define MAX_THREAD_NUM (1 << 20) /* maximal number of threads */
+/* default stack size per thread (in bytes). Stacks are committed lazily, but
+ * must hold a signal frame for preemption (about 12 KB with AVX-512) */
+#define STACK_SIZE 65536
 
-/* Initialize the thread library */
+#include <stddef.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* Thread creation attributes */
+typedef struct uthread_attr {
+  size_t stack_size; /* usable stack size in bytes, rounded up to pages */
+  size_t guard_size; /* 0 for no guard page below the stack */
+  int detach_state;  /* UTHREAD_CREATE_JOINABLE or UTHREAD_CREATE_DETACHED */
+  int stack_trim;    /* non-zero to trim the stack whenever the thread blocks */
+} uthread_attr_t;
+
+#define UTHREAD_CREATE_JOINABLE 0
+#define UTHREAD_CREATE_DETACHED 1
+
+/* A task submitted with uthread_submit and its result. The caller owns the
+ * storage, which must stay valid until uthread_future_wait returns */
+typedef struct uthread_future {
+  void* (*fn)(void*);
+  void* arg;
+  void* result;
+  int done;                      /* set once fn has returned */
+  void* waiter;                  /* thread blocked in uthread_future_wait */
+  struct uthread_future* next;   /* in the queue of pending tasks */
+} uthread_future_t;
+
+/* FIFO queue of threads blocked on a synchronization object */
+typedef struct uthread_waitq {
+  void* head;
+  void* tail;
+} uthread_waitq_t;
+
+/* Mutex. Unlocking hands it directly to the longest waiting thread */
+typedef struct uthread_mutex {
+  int state;     /* 0 unlocked, 1 locked, 2 locked and maybe contended */
+  int owner;     /* tid of the owner, -1 if unlocked */
+  uthread_waitq_t waiters;
+} uthread_mutex_t;
+
+/* Condition variable */
+typedef struct uthread_cond {
+  uthread_waitq_t waiters;
+} uthread_cond_t;
+
+/* Counting semaphore */
+typedef struct uthread_sem {
+  int value;
+  uthread_waitq_t waiters;
+} uthread_sem_t;
+
+/* Reader-writer lock. Waiters are served in arrival order */
+typedef struct uthread_rwlock {
+  int readers;   /* number of readers holding the lock */
+  int writer;    /* tid of the writer holding the lock, -1 if none */
+  uthread_waitq_t waiters;
+} uthread_rwlock_t;
+
+/* Wait group, or countdown latch: waiters block until the count drops to
+ * 0, and are woken once, when it does */
+typedef struct uthread_wg {
+  int count;
+  uthread_waitq_t waiters;
+} uthread_wg_t;
+
+/* Reusable barrier for a fixed number of threads */
+typedef struct uthread_barrier {
+  int count;     /* threads that must arrive to release the barrier */
+  int arrived;   /* threads waiting at the barrier in this round */
+  uthread_waitq_t waiters;
+} uthread_barrier_t;
+
+/* Returned to exactly one of the threads released by a barrier */
+#define UTHREAD_BARRIER_SERIAL_THREAD 1
+
+/* CPU quota of one thread, or shared by a group of threads: together they
+ * may run quota_ns out of every period_ns. A thread whose group used up
+ * the allowance of the period waits for the next one when it is next
+ * preempted or yields. Running over (by up to a quantum) is paid back out
+ * of the next period, and an unused allowance is not carried over, so the
+ * group never gets more than quota_ns per period on average (deficit round
+ * robin, one round per period) */
+typedef struct uthread_quota {
+  long long quota_ns;
+  long long period_ns;
+  long long deficit_ns;    /* allowance left this period, negative if overdrawn */
+  long long next_refill;   /* CLOCK_MONOTONIC ns at which the next period starts */
+  long long used_ns;       /* cpu time used by the group's threads */
+  long long throttled;     /* times a thread waited for the next period */
+  int members;             /* threads counting against the quota */
+} uthread_quota_t;
+
+/* Channel of fixed size values, in FIFO order. A send to an unbuffered
+ * channel (capacity 0) waits for a receiver and copies the value straight
+ * into the receiver's destination */
+typedef struct uthread_chan {
+  size_t elem_size;
+  size_t capacity;   /* values the buffer holds, 0 if unbuffered */
+  size_t count;      /* values in the buffer */
+  size_t head;       /* buffer index of the oldest value */
+  char* buffer;
+  int closed;
+  uthread_waitq_t senders;     /* threads blocked sending */
+  uthread_waitq_t receivers;   /* threads blocked receiving */
+} uthread_chan_t;
+
+#define UTHREAD_CHAN_SEND 0
+#define UTHREAD_CHAN_RECV 1
+
+/* One operation of a uthread_chan_select */
+typedef struct uthread_chan_case {
+  uthread_chan_t* chan;
+  int op;        /* UTHREAD_CHAN_SEND or UTHREAD_CHAN_RECV */
+  void* elem;    /* value to send, or where to store the received value */
+  int ok;        /* set to 1 if a value moved, 0 if the channel was closed */
+} uthread_chan_case_t;
+
+#define UTHREAD_MUTEX_INITIALIZER {0, -1, {NULL, NULL}}
+#define UTHREAD_COND_INITIALIZER {{NULL, NULL}}
+#define UTHREAD_RWLOCK_INITIALIZER {0, -1, {NULL, NULL}}
+
+/* Scheduling policies, see uthread_init_sched */
+#define UTHREAD_SCHED_RR   0  /* one FIFO ready queue, round robin */
+#define UTHREAD_SCHED_PRIO 1  /* strict priorities set with uthread_setprio */
+#define UTHREAD_SCHED_MLFQ 2  /* multilevel feedback queue */
+
+/* Priorities run from 0, served first, to UTHREAD_PRIO_LEVELS - 1 */
+#define UTHREAD_PRIO_LEVELS 8
+#define UTHREAD_PRIO_DEFAULT 4
+
+/* Initialize the thread library. A quantum_usecs of 0 or less makes
+ * scheduling cooperative: threads only switch when they yield or block.
+ * Otherwise each worker is preempted by a timer on its cpu time, which
+ * sends SIGRTMIN */
 // Return 0 on success, -1 on failure
 int uthread_init(int quantum_usecs);
 
+/* Initialize the thread library with num_workers kernel threads (M:N) */
+// Threads run on any worker; each worker is pinned to a cpu when
+// num_workers > 1. uthread_init(q) is uthread_init_workers(q, 1)
+// Return 0 on success, -1 on failure
+int uthread_init_workers(int quantum_usecs, int num_workers);
+
+/* Initialize the thread library with num_workers kernel threads and a
+ * scheduling policy. UTHREAD_SCHED_RR keeps one FIFO ready queue.
+ * UTHREAD_SCHED_PRIO always runs the ready thread of highest priority.
+ * UTHREAD_SCHED_MLFQ ignores priorities: a thread that uses up its quantum
+ * moves down a level, one that blocks or yields before it does moves up.
+ * With both, a worker takes its next thread from the lowest level that has
+ * one every few quantums, so that no ready thread starves (aging).
+ * uthread_init_workers(q, n) is uthread_init_sched(q, n, UTHREAD_SCHED_RR) */
+// Return 0 on success, -1 on failure
+int uthread_init_sched(int quantum_usecs, int num_workers, int policy);
+
 /* Create a new thread whose entry point is f */
 // Return new thread ID on success, -1 on failure
 int uthread_create(void* (*start_routine)(void*), void* arg);
 
-/* Join a thread */
+/* Initialize thread creation attributes to the defaults */
+// Return 0 on success, -1 on failure
+int uthread_attr_init(uthread_attr_t* attr);
+
+/* Set the stack size for threads created with attr */
+// Return 0 on success, -1 on failure (stack_size below PTHREAD_STACK_MIN)
+int uthread_attr_setstacksize(uthread_attr_t* attr, size_t stack_size);
+
+/* Set the guard size for threads created with attr. Any non-zero size gives
+ * one guard page; 0 gives none, which lets many more stacks share a mapping */
+// Return 0 on success, -1 on failure
+int uthread_attr_setguardsize(uthread_attr_t* attr, size_t guard_size);
+
+/* Set whether threads created with attr start detached */
+// Return 0 on success, -1 on failure
+int uthread_attr_setdetachstate(uthread_attr_t* attr, int detach_state);
+
+/* Set whether threads created with attr trim their stack whenever they
+ * block or are suspended: the pages below the frames still in use go back
+ * to the kernel, so a blocked thread only keeps its live stack depth
+ * resident, however deep it went before. Each block then costs a system
+ * call, and going deeper again faults the pages back in: meant for very
+ * many threads that are mostly blocked */
+// Return 0 on success, -1 on failure
+int uthread_attr_setstacktrim(uthread_attr_t* attr, int stack_trim);
+
+/* Create a new thread with the given attributes (NULL for the defaults) */
+// Return new thread ID on success, -1 on failure
+int uthread_create_attr(void* (*start_routine)(void*), void* arg,
+                        const uthread_attr_t* attr);
+
+/* Run fn(arg) on a pooled thread. Pool threads are parked between tasks
+ * and reused, so a task costs no thread creation. A task must return rather
+ * than call uthread_exit */
 // Return 0 on success, -1 on failure
+int uthread_submit(uthread_future_t* future, void* (*fn)(void*), void* arg);
+
+/* Wait for a submitted task to finish */
+// Return 0 on success with *result set to the task's return value, -1 on
+// failure (another thread already waits on the future)
+int uthread_future_wait(uthread_future_t* future, void** result);
+
+/* Whether a submitted task has finished, without waiting */
+// Return 1 if it has, 0 if not
+int uthread_future_done(uthread_future_t* future);
+
+/* Join a thread. Any number of threads may join the same thread, and all
+ * of them get its result */
+// Return 0 on success, -1 on failure (including a detached tid)
 int uthread_join(int tid, void **retval);
 
+/* Join whichever of the n threads in tids finishes first. The others keep
+ * running and may be joined later */
+// Return the index in tids of the joined thread on success, -1 on failure
+int uthread_join_any(const int* tids, int n, void **retval);
+
+/* Detach a thread: its TCB, stack and tid are reclaimed as soon as it
+ * finishes, and it can no longer be joined */
+// Return 0 on success, -1 on failure (invalid tid, already detached, or
+// other threads are joining it)
+int uthread_detach(int tid);
+
+/* Join a thread, waiting at most timeout_ns nanoseconds for it to finish */
+// Return 0 on success, -1 on failure (errno is ETIMEDOUT on a timeout)
+int uthread_join_timed(int tid, void **retval, long long timeout_ns);
+
+/* Block the calling thread for ns nanoseconds, letting other threads run */
+// Return 0 on success, -1 on failure
+int uthread_sleep_ns(long long ns);
+
 /* yield */
 // Return 0 on success, -1 on failure
 int uthread_yield(void);
 
+/* Yield to the thread tid, which runs right away for the rest of the
+ * caller's quantum. The caller goes to the back of the ready queue. If tid
+ * is not ready (blocked, running or finished), this is uthread_yield */
+// Return 0 on success, -1 on failure (invalid tid)
+int uthread_yield_to(int tid);
+
+/* Enable or disable the run next slot. When enabled, a thread woken by the
+ * running thread (uthread_resume, a post, an unlock, a send...) runs as
+ * soon as the running thread blocks or yields, ahead of the other ready
+ * threads of its level. Each worker holds one such thread: waking another
+ * moves the first to the back of the ready queue. Threads woken by timers
+ * and fd events are queued as usual. Disabled by default */
+// Return 0 on success, -1 on failure
+int uthread_set_runnext(int enable);
+
 /* Terminate this thread */
 // Does not return to caller. If this is the main thread, exit the program
 void uthread_exit(void *retval);
@@ -34,9 +267,142 @@ void uthread_exit(void *retval);
 int uthread_suspend(int tid);
 
 /* Resume a thread */
+// May be called from any kernel thread, including ones that run no
+// uthreads, to wake a thread on an external event
 // Return 0 on success, -1 on failure
 int uthread_resume(int tid);
 
+/* Set the priority of a thread, 0 (served first) to UTHREAD_PRIO_LEVELS - 1.
+ * Only UTHREAD_SCHED_PRIO uses it. A thread already in a ready queue moves
+ * the next time it is queued */
+// Return 0 on success, -1 on failure
+int uthread_setprio(int tid, int prio);
+
+/* Get the priority of a thread */
+// Return the priority on success, -1 on failure
+int uthread_getprio(int tid);
+
+/* Get the time a thread has run, in ns: wall time on its worker, which
+ * only differs from cpu time when the worker waits for a cpu. Time is
+ * charged when a thread is switched out, so for a thread running on another
+ * worker this leaves out the current run */
+// Return the time on success, -1 on failure
+long long uthread_get_cputime(int tid);
+
+/* Initialize a cpu quota of quota_ns every period_ns */
+// Return 0 on success, -1 on failure
+int uthread_quota_init(uthread_quota_t* quota, long long quota_ns, long long period_ns);
+
+/* Destroy a cpu quota. No thread may count against it any more */
+// Return 0 on success, -1 on failure
+int uthread_quota_destroy(uthread_quota_t* quota);
+
+/* Make a thread count against a cpu quota, or against none if quota is
+ * NULL. Threads sharing a quota share its allowance */
+// Return 0 on success, -1 on failure
+int uthread_setquota(int tid, uthread_quota_t* quota);
+
+/* Snapshot of the scheduler, from uthread_stats. Switch counts and
+ * histograms add up since uthread_init. Histogram bucket i counts times of
+ * 2^i to 2^(i+1) - 1 ns (bucket 0 also counts 0 and 1 ns), the last bucket
+ * everything longer */
+#define UTHREAD_STATS_BUCKETS 32
+typedef struct uthread_stats {
+  long run_queue;            /* ready queue entries, stale ones included */
+  long run_queue_max;        /* most entries one worker's ready queues held */
+  long live;                 /* threads created and not finished, main too */
+  long blocked;              /* waiting on a lock, join, sleep, fd, ... */
+  long suspended;            /* waiting for uthread_resume */
+  long voluntary_switches;   /* away from a thread that yielded, blocked or exited */
+  long involuntary_switches; /* away from a preempted thread */
+  long ready_latency[UTHREAD_STATS_BUCKETS]; /* made ready until switched to */
+  long long ready_latency_sum; /* ns */
+  long slices[UTHREAD_STATS_BUCKETS]; /* switched to until switched away */
+  long long slices_sum;      /* ns */
+} uthread_stats_t;
+
+/* Fill stats with a snapshot of the scheduler. Its cost depends on the
+ * number of workers, not of threads, so it can be polled in production.
+ * Counts are read while threads run, so they may be off by the few threads
+ * changing state meanwhile */
+// Return 0 on success, -1 on failure
+int uthread_stats(uthread_stats_t* stats);
+
+/* Write stats to buf in the Prometheus text format, as uthread_* metrics
+ * (histograms in seconds) */
+// Return the length of the full text, as snprintf: the text was cut short
+// if it is size or more. -1 on failure
+int uthread_stats_format(const uthread_stats_t* stats, char* buf, size_t size);
+
+/* Serve uthread_stats over HTTP on a listening socket, for Prometheus to
+ * scrape: a detached thread answers every connection with the current
+ * statistics, whatever the request, and closes it */
+// Return the tid of the serving thread, -1 on failure
+int uthread_stats_serve(int listen_fd);
+
+/* Start recording scheduler events: thread creation, switches (and why
+ * the previous thread left: it yielded, was preempted, exited, or what it
+ * blocked on), preemptions, suspends and resumes. Each worker keeps its
+ * last events events in a ring of 16 byte entries, allocated by the first
+ * call; later calls start a new trace in the same rings. Recording takes
+ * no lock and allocates nothing. Compiled out, at no cost, with
+ * make NOTRACE=1 */
+// Return 0 on success, -1 on failure (errno is ENOSYS if compiled out)
+int uthread_trace_start(long events);
+
+/* Stop recording scheduler events */
+// Return 0 on success, -1 on failure
+int uthread_trace_stop();
+
+/* Write the recorded events to path as Chrome trace JSON, for
+ * chrome://tracing or ui.perfetto.dev: a track per worker, with a slice for
+ * every run of a thread and an instant for every other event. Stop tracing
+ * first, events recorded during the dump may come out torn */
+// Return 0 on success, -1 on failure
+int uthread_trace_dump(const char* path);
+
+/* Start sampling where the cpu time goes: every worker takes hz samples per
+ * second of its cpu time (SIGPROF), each the running thread's tid and the
+ * call stack found through its frame pointers. Each worker keeps its last
+ * samples samples, in a buffer allocated by the first call; later calls
+ * start a new profile in the same buffers, or change the frequency of the
+ * running one. Taking a sample takes no lock and allocates nothing */
+// Return 0 on success, -1 on failure
+int uthread_prof_start(int hz, long samples);
+
+/* Stop sampling */
+// Return 0 on success, -1 on failure
+int uthread_prof_stop();
+
+/* Write the samples to path as collapsed stacks, for flamegraph.pl or
+ * speedscope: a line per distinct stack, "uthread <tid>;outer;...;inner
+ * count", so every thread gets its own tower. Stop sampling first, samples
+ * taken during the dump may come out torn */
+// Return 0 on success, -1 on failure
+int uthread_prof_dump(const char* path);
+
+/* Paint the stacks of threads created from now on (if enable is non-zero)
+ * with a pattern, so that uthread_stack_highwater can tell how deep they
+ * went. Painting writes the whole stack, which makes it resident: a mode
+ * to size stacks with, not to run very many threads in */
+// Return 0 on success, -1 on failure
+int uthread_stack_paint(int enable);
+
+/* Get the most stack a thread with a painted stack has used so far, in
+ * bytes. A finished thread's is measured when it exits, so it can still be
+ * asked for until the thread is joined */
+// Return the bytes used on success, -1 on failure (no such thread, or its
+// stack is not painted)
+long uthread_stack_highwater(int tid);
+
+/* Write a report of the stack use of the threads that finished with a
+ * painted stack to path: a line per start routine, deepest first, with the
+ * number of threads, the stack size they had, their mean and maximum use,
+ * and a suggested stack size (the maximum with room for a preemption signal
+ * frame) to pass to uthread_attr_setstacksize */
+// Return 0 on success, -1 on failure
+int uthread_stack_report(const char* path);
+
 /* Get the id of the calling thread */
 // Return the thread ID
 int uthread_self();
@@ -49,4 +415,198 @@ int uthread_get_total_quantums();
 // Return the thread quantum set count
 int uthread_get_quantums(int tid);
 
+/* Initialize a mutex */
+// Return 0 on success, -1 on failure
+int uthread_mutex_init(uthread_mutex_t* mutex);
+
+/* Destroy a mutex */
+// Return 0 on success, -1 on failure (mutex is locked)
+int uthread_mutex_destroy(uthread_mutex_t* mutex);
+
+/* Lock a mutex, blocking until it is available */
+// Return 0 on success, -1 on failure
+int uthread_mutex_lock(uthread_mutex_t* mutex);
+
+/* Lock a mutex, waiting at most timeout_ns nanoseconds for it */
+// Return 0 on success, -1 on failure (errno is ETIMEDOUT on a timeout)
+int uthread_mutex_timedlock(uthread_mutex_t* mutex, long long timeout_ns);
+
+/* Lock a mutex if it is available */
+// Return 0 on success, -1 if the mutex is locked
+int uthread_mutex_trylock(uthread_mutex_t* mutex);
+
+/* Unlock a mutex held by the calling thread */
+// Return 0 on success, -1 on failure (caller is not the owner)
+int uthread_mutex_unlock(uthread_mutex_t* mutex);
+
+/* Initialize a condition variable */
+// Return 0 on success, -1 on failure
+int uthread_cond_init(uthread_cond_t* cond);
+
+/* Destroy a condition variable */
+// Return 0 on success, -1 on failure (threads are waiting on it)
+int uthread_cond_destroy(uthread_cond_t* cond);
+
+/* Atomically unlock mutex and wait on cond. The mutex is held again on return */
+// Return 0 on success, -1 on failure (caller does not hold mutex)
+int uthread_cond_wait(uthread_cond_t* cond, uthread_mutex_t* mutex);
+
+/* As uthread_cond_wait, waiting at most timeout_ns nanoseconds for a signal.
+ * The mutex is held again on return, also after a timeout */
+// Return 0 on success, -1 on failure (errno is ETIMEDOUT on a timeout)
+int uthread_cond_timedwait(uthread_cond_t* cond, uthread_mutex_t* mutex,
+                           long long timeout_ns);
+
+/* Wake the longest waiting thread on cond */
+// Return 0 on success, -1 on failure
+int uthread_cond_signal(uthread_cond_t* cond);
+
+/* Wake all threads waiting on cond */
+// Return 0 on success, -1 on failure
+int uthread_cond_broadcast(uthread_cond_t* cond);
+
+/* Initialize a semaphore with the given value */
+// Return 0 on success, -1 on failure
+int uthread_sem_init(uthread_sem_t* sem, int value);
+
+/* Destroy a semaphore */
+// Return 0 on success, -1 on failure (threads are waiting on it)
+int uthread_sem_destroy(uthread_sem_t* sem);
+
+/* Decrement a semaphore, blocking while its value is 0 */
+// Return 0 on success, -1 on failure
+int uthread_sem_wait(uthread_sem_t* sem);
+
+/* Decrement a semaphore, waiting at most timeout_ns nanoseconds */
+// Return 0 on success, -1 on failure (errno is ETIMEDOUT on a timeout)
+int uthread_sem_timedwait(uthread_sem_t* sem, long long timeout_ns);
+
+/* Decrement a semaphore if its value is above 0 */
+// Return 0 on success, -1 if the value is 0
+int uthread_sem_trywait(uthread_sem_t* sem);
+
+/* Increment a semaphore, waking the longest waiting thread */
+// May be called from any kernel thread, like uthread_resume
+// Return 0 on success, -1 on failure
+int uthread_sem_post(uthread_sem_t* sem);
+
+/* Initialize a reader-writer lock */
+// Return 0 on success, -1 on failure
+int uthread_rwlock_init(uthread_rwlock_t* rwlock);
+
+/* Destroy a reader-writer lock */
+// Return 0 on success, -1 on failure (lock is held)
+int uthread_rwlock_destroy(uthread_rwlock_t* rwlock);
+
+/* Lock for reading, blocking while a writer holds or waits for the lock */
+// Return 0 on success, -1 on failure
+int uthread_rwlock_rdlock(uthread_rwlock_t* rwlock);
+
+/* Lock for writing, blocking while the lock is held */
+// Return 0 on success, -1 on failure
+int uthread_rwlock_wrlock(uthread_rwlock_t* rwlock);
+
+/* Release a read or write lock held by the calling thread */
+// Return 0 on success, -1 on failure (lock is not held)
+int uthread_rwlock_unlock(uthread_rwlock_t* rwlock);
+
+/* Initialize a wait group with the given count */
+// Return 0 on success, -1 on failure (count is negative)
+int uthread_wg_init(uthread_wg_t* wg, int count);
+
+/* Destroy a wait group */
+// Return 0 on success, -1 on failure (threads are waiting on it)
+int uthread_wg_destroy(uthread_wg_t* wg);
+
+/* Add delta, which may be negative, to the count. Waiters are woken when
+ * it reaches 0 */
+// May be called from any kernel thread, like uthread_resume
+// Return 0 on success, -1 on failure (the count would drop below 0)
+int uthread_wg_add(uthread_wg_t* wg, int delta);
+
+/* Decrement the count, uthread_wg_add(wg, -1) */
+// Return 0 on success, -1 on failure (the count is already 0)
+int uthread_wg_done(uthread_wg_t* wg);
+
+/* Block until the count is 0 */
+// Return 0 on success, -1 on failure
+int uthread_wg_wait(uthread_wg_t* wg);
+
+/* Initialize a barrier released each time count threads have arrived */
+// Return 0 on success, -1 on failure (count is below 1)
+int uthread_barrier_init(uthread_barrier_t* barrier, int count);
+
+/* Destroy a barrier */
+// Return 0 on success, -1 on failure (threads are waiting at it)
+int uthread_barrier_destroy(uthread_barrier_t* barrier);
+
+/* Block until count threads, the caller included, wait at the barrier. It
+ * is ready for the next round as soon as it releases them */
+// Return UTHREAD_BARRIER_SERIAL_THREAD in the last thread to arrive, 0 in
+// the others, -1 on failure
+int uthread_barrier_wait(uthread_barrier_t* barrier);
+
+/* Initialize a channel of elem_size byte values, buffering up to capacity
+ * of them (0 for an unbuffered channel) */
+// Return 0 on success, -1 on failure
+int uthread_chan_init(uthread_chan_t* chan, size_t elem_size, size_t capacity);
+
+/* Destroy a channel, freeing its buffer */
+// Return 0 on success, -1 on failure (threads are blocked on it)
+int uthread_chan_destroy(uthread_chan_t* chan);
+
+/* Send the value at elem, blocking while the channel is full (or, if it is
+ * unbuffered, until a receiver takes the value) */
+// Return 0 on success, -1 on failure (errno is EPIPE if the channel is closed)
+int uthread_chan_send(uthread_chan_t* chan, const void* elem);
+
+/* Receive a value into elem, blocking while the channel is empty */
+// Return 0 on success, -1 on failure (errno is EPIPE if the channel is
+// closed and drained)
+int uthread_chan_recv(uthread_chan_t* chan, void* elem);
+
+/* Close a channel. Blocked senders and receivers fail with EPIPE, and
+ * receivers may still drain the values buffered before the close */
+// Return 0 on success, -1 on failure (already closed)
+int uthread_chan_close(uthread_chan_t* chan);
+
+/* Complete the first of n channel operations that can go ahead, blocking
+ * until one can if block is non-zero. Each case's ok field tells whether the
+ * case moved a value or found its channel closed */
+// Return the index of the completed case, -1 on failure (errno is EAGAIN if
+// block is 0 and no case could go ahead)
+int uthread_chan_select(uthread_chan_case_t* cases, int n, int block);
+
+/* I/O. The calling thread parks until the fd is ready instead of blocking
+ * the kernel thread. fds are switched to non-blocking mode on first use, so
+ * close them with uthread_close. Only one thread at a time may wait to read
+ * and one to write on the same fd */
+
+/* Read from fd, waiting until it is readable */
+// Return as read(2): bytes read, 0 at end of file, -1 on failure (errno set)
+ssize_t uthread_read(int fd, void* buf, size_t count);
+
+/* Write to fd, waiting until it is writable */
+// Return as write(2): bytes written, -1 on failure (errno set)
+ssize_t uthread_write(int fd, const void* buf, size_t count);
+
+/* Accept a connection on a listening socket, waiting for one to arrive */
+// Return the new (non-blocking) socket, -1 on failure (errno set)
+int uthread_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);
+
+/* Connect a socket, waiting until the connection is established */
+// Return 0 on success, -1 on failure (errno set)
+int uthread_connect(int fd, const struct sockaddr* addr, socklen_t addrlen);
+
+/* Wait for events on several fds, as poll(2). timeout is in milliseconds,
+ * -1 waits indefinitely */
+// Return the number of fds with events, 0 on timeout, -1 on failure
+int uthread_poll(struct pollfd* fds, nfds_t nfds, int timeout);
+
+/* Close an fd used with the I/O functions above. Threads waiting on it are
+ * woken: uthread_read, _write, _accept and _connect fail with EBADF, and
+ * uthread_poll reports it as POLLNVAL */
+// Return 0 on success, -1 on failure (errno set)
+int uthread_close(int fd);
+
 #endif